@@ -47,7 +47,10 @@ struct OpenFile opentab[MAXOPEN] = {
 };
 
 // Virtual address at which to receive page mappings containing client requests.
-union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
+union Fsipc *fsreq = (union Fsipc *)(0x0ffff000 - FSIPC_MAXPAGES * PGSIZE);
+
+// Pages received with the current request, starting at fsreq
+static uint32_t fsreq_npages;
 
 void
 serve_init(void)
@@ -245,7 +248,7 @@ serve_read(envid_t envid, union Fsipc *ipc)
 		return r;
 
 	if ((r = file_read(o->o_file, ret->ret_buf,
-			   MIN(req->req_n, sizeof ret->ret_buf),
+			   MIN(req->req_n, fsreq_npages * PGSIZE),
 			   o->o_fd->fd_offset)) < 0)
 		return r;
 
@@ -272,7 +275,7 @@ serve_write(envid_t envid, struct Fsreq_write *req)
 	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
 		return r;
 
-	if (req->req_n > sizeof(req->req_buf))
+	if (req->req_n > FSREQ_WRITE_MAX(fsreq_npages))
 		return -E_INVAL;
 
 	if ((r = file_write(o->o_file, req->req_buf, req->req_n, o->o_fd->fd_offset)) < 0)
@@ -368,16 +371,42 @@ fshandler handlers[] = {
 };
 #define NHANDLERS (sizeof(handlers)/sizeof(handlers[0]))
 
+// Unmap the pages received with the last request, all in one system
+// call if there were several.
+static void
+unmap_request(void)
+{
+	static struct SyscallBatch b;	// Too big for the stack
+	uint32_t i;
+
+	if (fsreq_npages <= 1) {
+		sys_page_unmap(0, fsreq);
+		return;
+	}
+	for (i = 0; i < fsreq_npages; i++)
+		batch_add(&b, SYS_page_unmap, 0, (uint64_t) fsreq + i * PGSIZE,
+			  0, 0, 0);
+	batch_flush(&b);
+}
+
 void
 serve(void)
 {
-	uint32_t req, whom;
-	int perm, r;
-	void *pg;
+	uint32_t req, whom, reply_to = 0;
+	int perm, reply_perm = 0, r = 0;
+	void *pg = NULL;
 
 	while (1) {
+		// Reply to the last request and wait for the next one in
+		// a single system call.
 		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		req = ipc_reply_recv(reply_to, r, pg, reply_perm,
+				     (envid_t *) &whom,
+				     IPC_WINDOW(fsreq, 1 + FSIPC_MAXPAGES), &perm);
+		fsreq_npages = thisenv->env_ipc_npages;
+		if (debug && reply_to)
+			cprintf("FS: Sent response %d to %x\n", r, reply_to);
+		reply_to = 0;
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, uvpt[PGNUM(fsreq)], fsreq);
@@ -398,10 +427,9 @@ serve(void)
 			cprintf("Invalid request code %d from %08x\n", req, whom);
 			r = -E_INVAL;
 		}
-		ipc_send(whom, r, pg, perm);
-		if(debug)
-			cprintf("FS: Sent response %d to %x\n", r, whom);
-		sys_page_unmap(0, fsreq);
+		reply_to = whom;
+		reply_perm = perm;
+		unmap_request();
 	}
 }
 
@@ -0,0 +1,56 @@
+#line 2 "../inc/chan.h"
+// Asynchronous message channels between two environments.
+//
+// A channel is one page of memory shared by two environments, holding
+// a ring of messages in each direction.  Each end sends by filling in
+// the next slot of the ring its peer consumes, and receives by polling
+// the ring it consumes, so a stream of requests and completions needs
+// no system calls at all.  An end that runs out of messages sets its
+// ring's cr_waiting flag and sleeps in sys_ipc_notify_wait(); only
+// then does the peer make a system call, sys_ipc_notify(), to wake it.
+// See lib/chan.c.
+
+#ifndef JOS_INC_CHAN_H
+#define JOS_INC_CHAN_H
+
+#include <inc/types.h>
+
+// Slots per ring; a power of two.
+#define CHAN_NSLOTS	32
+
+// Largest notification bit number an end may ask to be woken with.
+#define CHAN_MAXBIT	30
+
+// One message.  The meaning of the fields is up to the two ends;
+// cm_tag conventionally lets a client match completions to requests.
+struct ChanMsg {
+	uint64_t cm_tag;
+	uint64_t cm_op;
+	uint64_t cm_arg[2];
+};
+
+// A ring of messages consumed by one end of the channel.  cr_head and
+// cr_tail count messages consumed and produced; they only increase.
+struct ChanRing {
+	volatile uint32_t cr_head;	// Written only by the consumer
+	volatile uint32_t cr_tail;	// Written only by the producer
+	volatile uint32_t cr_waiting;	// Consumer is asleep, or about to be
+	uint32_t cr_pad;
+	struct ChanMsg cr_slots[CHAN_NSLOTS];
+};
+
+// One end of a channel: the env there, and the notification bit it
+// wants to be woken with.
+struct ChanEnd {
+	volatile envid_t ce_env;
+	volatile uint32_t ce_bit;
+};
+
+// The shared channel page.  ch_ring[i] is consumed by ch_end[i].
+// End 0 is the env that created the channel.
+struct Chan {
+	struct ChanEnd ch_end[2];
+	struct ChanRing ch_ring[2];
+};
+
+#endif	// !JOS_INC_CHAN_H
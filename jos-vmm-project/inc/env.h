@@ -56,6 +56,31 @@ enum EnvType {
 #line 59 "../inc/env.h"
 };
 
+// Fair-share scheduling: an env's share of the CPU is proportional to
+// env_weight.  Envs with ENV_SCHED_WAKEBOOST run ahead of CPU-bound
+// envs when an IPC wakes them.
+#define ENV_WEIGHT_DEFAULT	1024
+#define ENV_WEIGHT_MAX		(64 * ENV_WEIGHT_DEFAULT)
+#define ENV_SCHED_WAKEBOOST	0x1
+
+// Multi-page IPC.  A send whose perm includes IPC_SG grants the pages
+// listed by the struct IpcSg at srcva, rather than the page at srcva;
+// they are mapped one after another at the receiver's dstva.  A
+// receiver accepts up to n pages at va by passing IPC_WINDOW(va, n)
+// as its dstva.
+#define IPC_SG			0x1000
+#define IPC_MAXRANGES		16
+#define IPC_MAXPAGES		256
+#define IPC_WINDOW(va, n)	((void *) ((uintptr_t) (va) | ((n) - 1)))
+
+struct IpcSg {
+	uint32_t is_n;			// Number of ranges
+	struct IpcRange {
+		void *ir_va;		// Page-aligned start of the range
+		uint32_t ir_npages;
+	} is_ranges[IPC_MAXRANGES];
+};
+
 struct Env {
 	struct Trapframe env_tf;	// Saved registers
 	struct Env *env_link;   // Free list link pointers
@@ -68,12 +93,27 @@ struct Env {
 	int env_cpunum;			// The CPU that the env is running on
 #line 72 "../inc/env.h"
 
+	// Scheduling
+	struct Env *env_rq_next;	// Run queue link pointers
+	struct Env *env_rq_prev;
+	int env_rq_cpu;			// Run queue the env is on, or -1
+	uint32_t env_weight;		// CPU share relative to other envs
+	uint32_t env_sched_flags;	// ENV_SCHED_* flags
+	uint32_t env_affinity;		// Mask of CPUs the env may run on
+	uint64_t env_vruntime;		// CPU time used, scaled by weight
+	uint64_t env_cputime;		// CPU time used, in TSC cycles
+	uint64_t env_dispatched;	// TSC when last charged for CPU time
+
 	// Address space
 	pml4e_t *env_pml4e;		// Kernel virtual address of top-level page dir,
 	// or root of extended page tables in guest mode.
 	physaddr_t env_cr3;
 #line 78 "../inc/env.h"
 
+	// FPU, SSE and AVX state; see kern/fpu.c
+	void *env_fpu;			// Saved state, or NULL if never used
+	int env_fpu_cpu;		// CPU that last loaded it, or -1
+
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
 
@@ -83,6 +123,38 @@ struct Env {
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+	envid_t env_ipc_recvfrom;	// Only receive from this env, or 0
+	uint32_t env_ipc_dstpages;	// Pages we accept at env_ipc_dstva
+	uint32_t env_ipc_npages;	// Pages received
+
+	// Blocking IPC send
+	struct Env *env_ipc_waitq_head;	// Senders blocked sending to us, FIFO
+	struct Env *env_ipc_waitq_tail;
+	struct Env *env_ipc_waitq_next;	// Next sender on the same queue
+	struct Env *env_ipc_sendto;	// Env we are blocked sending to, or NULL
+	uint32_t env_ipc_send_value;	// Message we are blocked sending
+	void *env_ipc_send_srcva;
+	unsigned env_ipc_send_perm;
+	struct IpcSg env_ipc_send_sg;	// Pages we are sending, with IPC_SG
+	bool env_ipc_send_timed;	// Does the send time out?
+	unsigned env_ipc_send_deadline;	// time_msec() at which it does
+
+	// IPC endpoints
+	struct Env *env_ipc_endpoint;	// Endpoint we receive for, or NULL
+	struct Env *env_ipc_idle_head;	// Members waiting for a message, LIFO
+	struct Env *env_ipc_idle_next;	// Next member on the same list
+	bool env_ipc_idle;		// On our endpoint's idle list
+	struct Env *env_ipc_members;	// Members other than ourselves
+	struct Env *env_ipc_member_next; // Next member of the same endpoint
+
+	// IPC calls waiting for a reply
+	struct Env *env_ipc_server;	// Env our call went to, or NULL
+	struct Env *env_ipc_callers;	// Callers waiting for our reply
+	struct Env *env_ipc_caller_next; // Next caller of the same server
+
+	// IPC notifications
+	uint32_t env_notify_pending;	// Bits sent by sys_ipc_notify
+	bool env_notify_waiting;	// Blocked in sys_ipc_notify_wait
 #line 90 "../inc/env.h"
 	uint8_t *elf;
 #line 93 "../inc/env.h"
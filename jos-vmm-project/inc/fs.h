@@ -117,4 +117,14 @@ union Fsipc {
 	char _pad[PGSIZE];
 };
 
+// A read or write request may carry up to FSIPC_MAXPAGES pages of file
+// data along with the request page, sent together with IPC_SG.  The
+// file server receives them right after the request page, so the data
+// in ret_buf or req_buf runs on past the end of the union.
+#define FSIPC_MAXPAGES	32
+
+// Bytes of data a write request of 'npages' pages in all can carry.
+#define FSREQ_WRITE_MAX(npages) \
+	((npages) * PGSIZE - offsetof(union Fsipc, write.req_buf))
+
 #endif /* !JOS_INC_FS_H */
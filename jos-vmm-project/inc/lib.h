@@ -26,6 +26,7 @@
 #line 29 "../inc/lib.h"
 #include <inc/malloc.h>
 #include <inc/ns.h>
+#include <inc/chan.h>
 #line 33 "../inc/lib.h"
 #include <inc/vmx.h>
 #line 35 "../inc/lib.h"
@@ -60,7 +61,11 @@ int	sys_env_destroy(envid_t);
 #line 64 "../inc/lib.h"
 void	sys_yield(void);
 static envid_t sys_exofork(void);
+envid_t	sys_fork(void);
 int	sys_env_set_status(envid_t env, int status);
+int	sys_env_set_sched(envid_t env, uint32_t weight, uint32_t flags);
+int	sys_env_set_affinity(envid_t env, uint32_t cpumask);
+int	sys_batch(struct Syscall *calls, unsigned n);
 #line 68 "../inc/lib.h"
 int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
 #line 70 "../inc/lib.h"
@@ -71,6 +76,15 @@ int	sys_page_map(envid_t src_env, void *src_pg,
 int	sys_page_unmap(envid_t env, void *pg);
 int	sys_ipc_try_send(envid_t to_env, uint64_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_send(envid_t to_env, uint32_t value, void *pg, int perm,
+		     unsigned timeout_ms);
+int	sys_ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		     void *rcv_pg);
+int	sys_ipc_reply_recv(envid_t to_env, uint32_t value, void *pg, int perm,
+			   void *rcv_pg);
+int	sys_ipc_notify(envid_t to_env, uint32_t bits);
+int	sys_ipc_notify_wait(void);
+int	sys_ipc_join(envid_t member);
 #line 78 "../inc/lib.h"
 unsigned int sys_time_msec(void);
 #line 80 "../inc/lib.h"
@@ -100,9 +114,25 @@ sys_exofork(void)
 	return ret;
 }
 
+// batch.c
+struct SyscallBatch {
+	unsigned sb_n;
+	struct Syscall sb_calls[SYSCALL_BATCH_MAX];
+};
+int	batch_add(struct SyscallBatch *b, int num, uint64_t a1, uint64_t a2,
+		  uint64_t a3, uint64_t a4, uint64_t a5);
+int	batch_flush(struct SyscallBatch *b);
+
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	ipc_send_timeout(envid_t to_env, uint32_t value, void *pg, int perm,
+			 unsigned timeout_ms);
+int32_t ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		 void *rcv_pg, int *perm_store);
+int32_t ipc_reply_recv(envid_t to_env, uint32_t value, void *pg, int perm,
+		       envid_t *from_env_store, void *rcv_pg, int *perm_store);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int	ipc_stage(void *va, size_t npages);
 envid_t	ipc_find_env(enum EnvType type);
 
 #line 114 "../inc/lib.h"
@@ -112,8 +142,17 @@ int32_t ipc_host_recv(void *pg);
 #endif
 #line 119 "../inc/lib.h"
 
+// chan.c
+int	chan_create(struct Chan *ch, unsigned bit);
+int	chan_accept(struct Chan *ch, unsigned bit);
+int	chan_send(struct Chan *ch, const struct ChanMsg *m);
+bool	chan_ready(struct Chan *ch);
+bool	chan_poll(struct Chan *ch, struct ChanMsg *m);
+void	chan_wait(struct Chan **chs, int n);
+void	chan_recv(struct Chan *ch, struct ChanMsg *m);
+
 // fork.c
-#define	PTE_SHARE	0x400
+extern bool fork_in_kernel;
 envid_t	fork(void);
 envid_t	sfork(void);	// Challenge!
 #line 125 "../inc/lib.h"
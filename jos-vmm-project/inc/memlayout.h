@@ -13,11 +13,14 @@
  * which are relevant to both the kernel and user-mode software.
  */
 
-// Global descriptor numbers
+// Global descriptor numbers.  SYSCALL and SYSRET derive their segments
+// from a single selector in the STAR MSR, so the kernel text and data
+// descriptors and the user data and text descriptors must stay in
+// this order.
 #define GD_KT     0x08     // kernel text
 #define GD_KD     0x10     // kernel data
-#define GD_UT     0x18     // user text
-#define GD_UD     0x20     // user data
+#define GD_UD     0x18     // user data
+#define GD_UT     0x20     // user text
 #define GD_TSS0   0x28     // Task segment selector for CPU 0
 
 /*
@@ -127,6 +130,11 @@
 // Top of user-accessible VM
 #define UTOP		UENVS
 
+// Top of the VM user envs may map pages in: the first PML4 entry.  The
+// rest of the space below UTOP shares its page tables with the kernel,
+// and so with every env.
+#define UMAPTOP		0x8000000000
+
 // Top of one-page user exception stack
 #define UXSTACKTOP	0xef800000
 // Next page left invalid to guard against exception stack overflow; then:
@@ -142,6 +150,9 @@
 // Used for temporary page mappings for the user page-fault handler
 // (should not conflict with other temporary page mappings)
 #define PFTEMP		(UTEMP + PTSIZE - PGSIZE)
+// Used for temporary mappings of 2MB pages: the 2MB below UTEXT, clear
+// of UTEMP's pages and PFTEMP
+#define UTEMPLARGE	(UTEMP + PTSIZE)
 // The location of the user-level STABS data structure
 #define USTABDATA	(PTSIZE)
 
@@ -201,8 +212,28 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 	
 	uint16_t pp_ref;
+
+	// Buddy allocator state.  A free block of 2^pp_order pages is
+	// linked through pp_link and pp_prev on the free list for its
+	// order, with PP_BUDDY set in its first page's pp_flags.
+	uint8_t pp_order;
+	uint8_t pp_flags;
+
+	// A kmalloc slab page (PP_SLAB) holds objects of size class
+	// pp_order.  pp_slab_inuse of them are allocated; the free ones
+	// are linked from pp_slab_free.
+	uint16_t pp_slab_inuse;
+	union {
+		struct PageInfo *pp_prev;
+		void *pp_slab_free;
+	};
 };
 
+#define PP_BUDDY	0x1	// First page of a free buddy block
+#define PP_LARGE	0x2	// First page of an allocated 2MB page
+#define PP_SLAB		0x4	// kmalloc slab page
+#define PP_KMALLOC	0x8	// First page of a large kmalloc block
+
 #line 207 "../inc/memlayout.h"
 #endif /* !__ASSEMBLER__ */
 #endif /* !JOS_INC_MEMLAYOUT_H */
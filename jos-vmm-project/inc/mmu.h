@@ -76,11 +76,21 @@
 #define PTE_A		0x020	// Accessed
 #define PTE_D		0x040	// Dirty
 #define PTE_PS		0x080	// Page Size
+#define PTE_G		0x100	// Global, if CR4_PGE
 #define PTE_MBZ		0x180	// Bits must be zero
 
 // The PTE_AVAIL bits aren't used by the kernel or interpreted by the
 // hardware, so user processes are allowed to set them arbitrarily.
 #define PTE_AVAIL	0xE00	// Available for software use
+#define PTE_SHARE	0x400	// Shared with children rather than copied
+#define PTE_COW		0x800	// Copy-on-write
+#define PTE_ZERO	0x200	// Zero page, allocated on the first write
+
+// A lazily allocated PTE_SHARE page that fork shared before it was
+// written is not present until it is touched: its PTE has PTE_ZERO
+// and PTE_SHARE, but not PTE_P, and its address refers to the kernel.
+#define PTE_LAZYSHARE(pte) \
+	(((pte) & (PTE_P | PTE_SHARE | PTE_ZERO)) == (PTE_SHARE | PTE_ZERO))
 
 // Flags in PTE_SYSCALL may be used only in system calls. (Others may not.)
 #define PTE_SYSCALL (PTE_AVAIL | PTE_P | PTE_W | PTE_U)
@@ -112,11 +122,27 @@
 #define CR4_PVI		0x00000002	// Protected-Mode Virtual Interrupts
 #define CR4_VME		0x00000001	// V86 Mode Extensions
 #define CR4_VMXE	0x00002000	// VMX 
+#define CR4_PGE		0x00000080	// Page Global Enable
+#define CR4_PCIDE	0x00020000	// Process-Context Identifiers
+#define CR4_OSFXSR	0x00000200	// OS supports FXSAVE/FXRSTOR
+#define CR4_OSXMMEXCPT	0x00000400	// OS handles SIMD exceptions
+#define CR4_OSXSAVE	0x00040000	// XSAVE and XCR0 enabled
+
+// With CR4_PCIDE, the low bits of CR3 are the PCID, and a CR3 load with
+// CR3_NOFLUSH keeps the translations cached under the new PCID.
+#define CR3_PCID	0xFFF
+#define CR3_NOFLUSH	(1ULL << 63)
 
 // x86_64 related flags
 #define CR4_PAE		0x00000020
 #define EFER_MSR	0xC0000080
+#define EFER_SCE	0		// SYSCALL enable
 #define EFER_LME	8
+#define STAR_MSR	0xC0000081	// SYSCALL/SYSRET segments
+#define LSTAR_MSR	0xC0000082	// SYSCALL entry point
+#define SFMASK_MSR	0xC0000084	// RFLAGS bits cleared by SYSCALL
+#define GS_BASE_MSR	0xC0000101	// GS base
+#define KERNEL_GS_BASE_MSR 0xC0000102	// GS base swapped in by SWAPGS
 
 // Eflags register
 #define FL_CF		0x00000001	// Carry Flag
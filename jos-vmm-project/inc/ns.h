@@ -103,4 +103,9 @@ union Nsipc {
 	char _pad[PGSIZE];
 };
 
+// Most bytes one NSREQ_RECV returns or one NSREQ_SEND carries: the data
+// travels in the request page.  Sockets are streams, so a longer read
+// or write is cut short to this, as a short count.
+#define NSIPC_MAXBUF	((int) (PGSIZE - sizeof(struct Nsreq_send)))
+
 #endif // !JOS_INC_NS_H
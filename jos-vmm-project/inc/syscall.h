@@ -2,6 +2,8 @@
 #ifndef JOS_INC_SYSCALL_H
 #define JOS_INC_SYSCALL_H
 
+#include <inc/types.h>
+
 /* system call numbers */
 enum {
 	SYS_cputs = 0,
@@ -35,8 +37,29 @@ enum {
 	SYS_vmx_get_vmdisk_number,
 	SYS_vmx_incr_vmdisk_number,
 #endif
+	SYS_env_set_sched,
+	SYS_env_set_affinity,
+	SYS_batch,
+	SYS_fork,
+	SYS_ipc_send,
+	SYS_ipc_call,
+	SYS_ipc_reply_recv,
+	SYS_ipc_notify,
+	SYS_ipc_notify_wait,
+	SYS_ipc_join,
 #line 42 "../inc/syscall.h"
 	NSYSCALLS
 };
 
+// One entry of a SYS_batch request: a system call number and its
+// arguments, and the call's return value once the kernel has run it.
+struct Syscall {
+	uint64_t sc_num;
+	uint64_t sc_args[5];
+	int64_t sc_ret;
+};
+
+// Most entries the kernel will run in one SYS_batch call
+#define SYSCALL_BATCH_MAX	128
+
 #endif /* !JOS_INC_SYSCALL_H */
@@ -28,6 +28,7 @@
 // These are arbitrarily chosen, but with care not to overlap
 // processor defined exceptions or interrupt vectors.
 #define T_SYSCALL   48		// system call
+#define T_SYSCALL_FAST	1	// tf_err of a system call made with SYSCALL
 #define T_DEFAULT   500		// catchall
 
 #define IRQ_OFFSET	32	// IRQ 0 corresponds to int IRQ_OFFSET
@@ -40,6 +41,10 @@
 #define IRQ_IDE         14
 #define IRQ_ERROR       19
 
+// Inter-processor interrupts, sent through the local APIC.
+#define IRQ_RESCHED     20	// Wake a halted CPU to look for work
+#define IRQ_TLB         21	// Flush stale TLB entries
+
 #ifndef __ASSEMBLER__
 
 #include <inc/types.h>
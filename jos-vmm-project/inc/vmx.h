@@ -3,7 +3,8 @@
 #define JOS_INC_VMX_H
 
 #define GUEST_MEM_SZ 16 * 1024 * 1024
-#define MAX_MSR_COUNT ( PGSIZE / 2 ) / ( 128 / 8 )
+#define MAX_MSR_COUNT 8
+#define MSR_AREA_SZ ( MAX_MSR_COUNT * ( 128 / 8 ) )
 
 #ifndef __ASSEMBLER__
 
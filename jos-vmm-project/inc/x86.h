@@ -150,6 +150,12 @@ invlpg(void *addr)
 	__asm __volatile("invlpg (%0)" : : "r" (addr) : "memory");
 }  
 
+static __inline void
+mfence(void)
+{
+	__asm __volatile("mfence" : : : "memory");
+}
+
 static __inline void
 lidt(void *p)
 {
@@ -280,6 +286,38 @@ cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *e
 		*edxp = edx;
 }
 
+// cpuid for leaves, such as 0xD, that take a subleaf in %ecx.
+static __inline void
+cpuid_count(uint32_t info, uint32_t count, uint32_t *eaxp, uint32_t *ebxp,
+	    uint32_t *ecxp, uint32_t *edxp)
+{
+	uint32_t eax, ebx, ecx, edx;
+	asm volatile("cpuid"
+		     : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
+		     : "a" (info), "c" (count));
+	if (eaxp)
+		*eaxp = eax;
+	if (ebxp)
+		*ebxp = ebx;
+	if (ecxp)
+		*ecxp = ecx;
+	if (edxp)
+		*edxp = edx;
+}
+
+static __inline void
+xsetbv(uint32_t xcr, uint64_t val)
+{
+	__asm __volatile("xsetbv" : : "c" (xcr), "a" ((uint32_t) val),
+			 "d" ((uint32_t) (val >> 32)));
+}
+
+static __inline void
+clts(void)
+{
+	__asm __volatile("clts");
+}
+
 static inline uint32_t
 xchg(volatile uint32_t *addr,uint32_t newval){
 	uint32_t result;
@@ -293,9 +331,10 @@ xchg(volatile uint32_t *addr,uint32_t newval){
 static __inline uint64_t
 read_tsc(void)
 {
-	uint64_t tsc;
-	__asm __volatile("rdtsc" : "=A" (tsc));
-	return tsc;
+	uint32_t lo, hi;
+	// "=A" only names %rax in 64-bit mode, dropping the high half.
+	__asm __volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t) hi << 32) | lo;
 }
 
 static __inline uint64_t
@@ -3,6 +3,13 @@
 #ifndef JOS_INC_CPU_H
 #define JOS_INC_CPU_H
 
+// Offsets in struct CpuInfo of the fields that trap entry code reads
+// through %gs.
+#define CPU_SELF	0
+#define CPU_KSTACKTOP	8
+
+#ifndef __ASSEMBLER__
+
 #include <inc/types.h>
 #include <inc/memlayout.h>
 #include <inc/mmu.h>
@@ -12,6 +19,15 @@
 #define NCPU  4
 #line 17 "../kern/cpu.h"
 
+// PCIDs each CPU hands out to the address spaces it runs.
+#define NPCID	32
+
+// Range of an address space whose TLB entries are to be flushed.
+struct TlbRange {
+	physaddr_t tr_cr3;              // The address space, or 0 for none
+	uintptr_t tr_start;             // First page
+	uintptr_t tr_end;               // End of the last page
+};
 
 
 // Values of status in struct Cpu
@@ -23,10 +39,23 @@ enum {
 
 // Per-CPU state
 struct CpuInfo {
+	struct CpuInfo *cpu_self;       // This struct; %gs:CPU_SELF in the kernel
+	uintptr_t cpu_kstacktop;        // Top of this CPU's kernel stack
 	uint8_t cpu_id;                 // Local APIC ID; index into cpus[] below
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
+	bool cpu_resched;               // Preempt cpu_env before returning to it
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
+	physaddr_t cpu_pcid_cr3[NPCID]; // Address space cached under PCID i+1, or 0
+	unsigned cpu_pcid_next;         // Next PCID to recycle, less one
+	physaddr_t cpu_cr3;             // Address space loaded by tlb_load
+	volatile bool cpu_in_user;      // Running user code in cpu_cr3
+	struct TlbRange cpu_tlb_req;    // Flush another CPU asked of us
+	volatile uint32_t cpu_tlb_pending; // cpu_tlb_req is waiting
+	struct TlbRange cpu_tlb_gather; // Flushes to ask of other CPUs
+	struct PageInfo *cpu_tlb_free;  // Pages to free after it is sent
+	struct Env *cpu_fpu_env;        // Env whose FPU state we hold, or NULL
+	bool cpu_fpu_dirty;             // CR0_TS is clear, so it may have changed
 #line 34 "../kern/cpu.h"
     bool is_vmx_root;               // Is the CPU in VMX root mode?
     uintptr_t vmxon_region;         // KVA of vmxon region.
@@ -38,17 +67,40 @@ extern struct CpuInfo cpus[NCPU];
 extern int ncpu;                    // Total number of CPUs in the system
 extern struct CpuInfo *bootcpu;     // The boot-strap processor (BSP)
 extern physaddr_t lapicaddr;        // Physical MMIO address of the local APIC
+extern uint64_t lapic_tsc_per_ms;   // TSC cycles per ms, or 0 if unknown
 
 // Per-CPU kernel stacks
 extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
 
+#ifndef VMM_GUEST
+// The kernel's GS base is this CPU's struct CpuInfo; see cpu_init_gs.
+static __inline struct CpuInfo *
+thiscpu_gs(void)
+{
+	struct CpuInfo *c;
+
+	__asm __volatile("movq %%gs:%c1,%0" : "=r" (c) : "i" (CPU_SELF));
+	return c;
+}
+#define thiscpu (thiscpu_gs())
+#define cpunum() (thiscpu->cpu_id)
+#else
 int cpunum(void);
 #define thiscpu (&cpus[cpunum()])
+#endif
 
 void mp_init(void);
+void cpu_init_gs(void);
 void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(int apicid, int vector);
+void lapic_bench(void);
+void lapic_timer_oneshot(uint32_t ms);
+void lapic_timer_stop(void);
+bool lapic_timer_pending(void);
+
+#endif /* !__ASSEMBLER__ */
 
 #endif
@@ -9,11 +9,14 @@
 
 #include <kern/env.h>
 #include <kern/pmap.h>
+#include <kern/fpu.h>
+#include <kern/kmalloc.h>
 #include <kern/trap.h>
 #include <kern/monitor.h>
 #include <kern/macro.h>
 #include <kern/dwarf_api.h>
 #include <kern/sched.h>
+#include <kern/ipc.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <vmm/vmx.h>
@@ -26,6 +29,17 @@ struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
 // (linked by Env->env_link)
 
+// Protects env_free_list.
+static struct spinlock env_lock = {
+	.name = "env_lock"
+};
+
+// Per-environment locks on the page tables of each address space.
+// Anything that modifies an environment's mappings holds its lock,
+// so system calls that only change the caller's own mappings can
+// run without the big kernel lock.
+static struct spinlock env_vm_locks[NENV];
+
 #define ENVGENSHIFT	12		// >= LOGNENV
 
 // Global descriptor table.
@@ -55,12 +69,12 @@ struct Segdesc gdt[2*NCPU + 5] =
 	// 0x10 - kernel data segment
 	[GD_KD >> 3] = SEG64(STA_W, 0x0, 0xffffffff,0),
 
-	// 0x18 - user code segment
-	[GD_UT >> 3] = SEG64(STA_X | STA_R, 0x0, 0xffffffff,3),
-
-	// 0x20 - user data segment
+	// 0x18 - user data segment
 	[GD_UD >> 3] = SEG64(STA_W, 0x0, 0xffffffff,3),
 
+	// 0x20 - user code segment
+	[GD_UT >> 3] = SEG64(STA_X | STA_R, 0x0, 0xffffffff,3),
+
 	// Per-CPU TSS descriptors (starting from GD_TSS0) are initialized
 	// in trap_init_percpu()
 	[GD_TSS0 >> 3] = SEG_NULL,
@@ -126,6 +140,43 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	return 0;
 }
 
+// Take an environment off the free list.
+// Returns NULL if there are no free environments.
+static struct Env *
+env_free_list_get(void)
+{
+	struct Env *e;
+
+	spin_lock(&env_lock);
+	if ((e = env_free_list))
+		env_free_list = e->env_link;
+	spin_unlock(&env_lock);
+	return e;
+}
+
+// Return an environment to the free list.
+static void
+env_free_list_put(struct Env *e)
+{
+	spin_lock(&env_lock);
+	e->env_link = env_free_list;
+	env_free_list = e;
+	spin_unlock(&env_lock);
+}
+
+// Lock and unlock the page tables of e's address space.
+void
+env_vm_lock(struct Env *e)
+{
+	spin_lock(&env_vm_locks[e - envs]);
+}
+
+void
+env_vm_unlock(struct Env *e)
+{
+	spin_unlock(&env_vm_locks[e - envs]);
+}
+
 // Mark all environments in 'envs' as free, set their env_ids to 0,
 // and insert them into the env_free_list.
 // Make sure the environments are in the free list in the same order
@@ -140,10 +191,13 @@ env_init(void)
 	int i;
 	for (i = 0; i < NENV; i++) {
 		envs[i].env_status = ENV_FREE;
+		envs[i].env_rq_cpu = -1;
 		envs[i].env_link = &envs[i+1];
+		__spin_initlock(&env_vm_locks[i], "env_vm_lock");
 	}
 	envs[NENV-1].env_link = NULL;
 	env_free_list = &envs[0];
+	ipc_init();
 
 	// Per-CPU part of the initialization
 	env_init_percpu();
@@ -159,6 +213,7 @@ env_init_percpu(void)
 	// the user data segment.
 	asm volatile("movw %%ax,%%gs" :: "a" (GD_UD|3));
 	asm volatile("movw %%ax,%%fs" :: "a" (GD_UD|3));
+	cpu_init_gs();
 	// The kernel does use ES, DS, and SS.  We'll change between
 	// the kernel and user data segments as needed.
 	asm volatile("movw %%ax,%%es" :: "a" (GD_KD));
@@ -186,11 +241,6 @@ env_setup_vm(struct Env *e)
 {
 	int r;
 	int i;
-	struct PageInfo *p = NULL;
-
-	// Allocate a page for the page directory
-	if (!(p = page_alloc(ALLOC_ZERO)))
-		return -E_NO_MEM;
 
 	// Now, set e->env_pml4e and initialize the page directory.
 	//
@@ -210,16 +260,11 @@ env_setup_vm(struct Env *e)
 	//    - The functions in kern/pmap.h are handy.
 
 	// LAB 3: Your code here.
-	p->pp_ref       += 1;
-	e->env_pml4e    = page2kva(p);
-	e->env_cr3      = page2pa(p);
-
-	memset(e->env_pml4e, 0, PGSIZE);
-	e->env_pml4e[1] = boot_pml4e[1];
-
-	// UVPT maps the env's own page table read-only.
-	// Permissions: kernel R, user R
-	e->env_pml4e[PML4(UVPT)] = e->env_cr3 | PTE_P | PTE_U;
+	// pml4e_alloc sets up the page directory as described, or takes
+	// one already set up from the PML4s of freed environments.
+	if (!(e->env_pml4e = pml4e_alloc()))
+		return -E_NO_MEM;
+	e->env_cr3 = PADDR(e->env_pml4e);
 
 	return 0;
 }
@@ -231,7 +276,7 @@ env_guest_alloc(struct Env **newenv_store, envid_t parent_id)
 	int32_t generation;
 	struct Env *e;
 
-	if (!(e = env_free_list))
+	if (!(e = env_free_list_get()))
 		return -E_NO_FREE_ENV;
 
 	memset(&e->env_vmxinfo, 0, sizeof(struct VmxGuestInfo));
@@ -239,8 +284,10 @@ env_guest_alloc(struct Env **newenv_store, envid_t parent_id)
 	// allocate a page for the EPT PML4..
 	struct PageInfo *p = NULL;
 
-	if (!(p = page_alloc(ALLOC_ZERO)))
+	if (!(p = page_alloc(ALLOC_ZERO))) {
+		env_free_list_put(e);
 		return -E_NO_MEM;
+	}
 
 	memset(p, 0, sizeof(struct PageInfo));
 	p->pp_ref       += 1;
@@ -251,43 +298,29 @@ env_guest_alloc(struct Env **newenv_store, envid_t parent_id)
 	struct PageInfo *q = vmx_init_vmcs();
 	if (!q) {
 		page_decref(p);
+		env_free_list_put(e);
 		return -E_NO_MEM;
 	}
 	q->pp_ref += 1;
 	e->env_vmxinfo.vmcs = page2kva(q);
 
-	// Allocate a page for msr load/store area.
-	struct PageInfo *r = NULL;
-	if (!(r = page_alloc(ALLOC_ZERO))) {
+	// Allocate the msr load/store areas, and the IO bitmaps, which
+	// must each be a whole page.
+	e->env_vmxinfo.msr_host_area = kmalloc(MSR_AREA_SZ, ALLOC_ZERO);
+	e->env_vmxinfo.msr_guest_area = kmalloc(MSR_AREA_SZ, ALLOC_ZERO);
+	e->env_vmxinfo.io_bmap_a = kmalloc(PGSIZE, ALLOC_ZERO);
+	e->env_vmxinfo.io_bmap_b = kmalloc(PGSIZE, ALLOC_ZERO);
+	if (!e->env_vmxinfo.msr_host_area || !e->env_vmxinfo.msr_guest_area
+	    || !e->env_vmxinfo.io_bmap_a || !e->env_vmxinfo.io_bmap_b) {
+		kfree(e->env_vmxinfo.msr_host_area);
+		kfree(e->env_vmxinfo.msr_guest_area);
+		kfree(e->env_vmxinfo.io_bmap_a);
+		kfree(e->env_vmxinfo.io_bmap_b);
 		page_decref(p);
 		page_decref(q);
+		env_free_list_put(e);
 		return -E_NO_MEM;
 	}
-	r->pp_ref += 1;
-	e->env_vmxinfo.msr_host_area = page2kva(r);
-	e->env_vmxinfo.msr_guest_area = page2kva(r) + PGSIZE / 2;
-
-	// Allocate pages for IO bitmaps.
-	struct PageInfo *s = NULL;
-	if (!(s = page_alloc(ALLOC_ZERO))) {
-		page_decref(p);
-		page_decref(q);
-		page_decref(r);
-		return -E_NO_MEM;
-	}
-	s->pp_ref += 1;
-	e->env_vmxinfo.io_bmap_a = page2kva(s);
-
-	struct PageInfo *t = NULL;
-	if (!(t = page_alloc(ALLOC_ZERO))) {
-		page_decref(p);
-		page_decref(q);
-		page_decref(r);
-		page_decref(s);
-		return -E_NO_MEM;
-	}
-	t->pp_ref += 1;
-	e->env_vmxinfo.io_bmap_b = page2kva(t);
 
 	// Generate an env_id for this environment.
 	generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
@@ -302,14 +335,15 @@ env_guest_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	e->env_vmxinfo.vcpunum = vcpu_count++;
     	cprintf("VCPUNUM allocated: %d\n", e->env_vmxinfo.vcpunum);
+	sched_env_init(e);
+	sched_enqueue(e);
 
 	memset(&e->env_tf, 0, sizeof(e->env_tf));
 
 	e->env_pgfault_upcall = 0;
 	e->env_ipc_recving = 0;
+	ipc_env_alloc(e);
 
-	// commit the allocation
-	env_free_list = e->env_link;
 	*newenv_store = e;
 
 	return 0;
@@ -318,11 +352,12 @@ env_guest_alloc(struct Env **newenv_store, envid_t parent_id)
 void env_guest_free(struct Env *e) {
 	// Free the VMCS.
 	page_decref(pa2page(PADDR(e->env_vmxinfo.vmcs)));
-	// Free msr load/store area.
-	page_decref(pa2page(PADDR(e->env_vmxinfo.msr_host_area)));
-	// Free IO bitmaps page.
-	page_decref(pa2page(PADDR(e->env_vmxinfo.io_bmap_a)));
-	page_decref(pa2page(PADDR(e->env_vmxinfo.io_bmap_b)));
+	// Free msr load/store areas.
+	kfree(e->env_vmxinfo.msr_host_area);
+	kfree(e->env_vmxinfo.msr_guest_area);
+	// Free IO bitmaps.
+	kfree(e->env_vmxinfo.io_bmap_a);
+	kfree(e->env_vmxinfo.io_bmap_b);
 
 	// Free the host pages that were allocated for the guest and
 	// the EPT tables itself.
@@ -335,8 +370,8 @@ void env_guest_free(struct Env *e) {
 
 	// return the environment to the free list
 	e->env_status = ENV_FREE;
-	e->env_link = env_free_list;
-	env_free_list = e;
+	sched_dequeue(e);
+	env_free_list_put(e);
 
 	cprintf("[%08x] free vmx guest env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 }
@@ -358,12 +393,14 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	int r;
 	struct Env *e;
 
-	if (!(e = env_free_list))
+	if (!(e = env_free_list_get()))
 		return -E_NO_FREE_ENV;
 
 	// Allocate and set up the page directory for this environment.
-	if ((r = env_setup_vm(e)) < 0)
+	if ((r = env_setup_vm(e)) < 0) {
+		env_free_list_put(e);
 		return r;
+	}
 
 	// Generate an env_id for this environment.
 	generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
@@ -375,6 +412,10 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
 	e->env_status = ENV_RUNNABLE;
+	// Start out on the creating CPU's run queue.
+	e->env_cpunum = cpunum();
+	sched_env_init(e);
+	sched_enqueue(e);
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -403,11 +444,15 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Clear the page fault handler until user installs one.
 	e->env_pgfault_upcall = 0;
 
-	// Also clear the IPC receiving flag.
+	// Also clear the IPC receiving flag, and any notifications sent
+	// to the previous env in this slot after it was freed.
 	e->env_ipc_recving = 0;
+	ipc_env_alloc(e);
+
+	// The FPU state is allocated on first use.
+	e->env_fpu = NULL;
+	e->env_fpu_cpu = -1;
 
-	// commit the allocation
-	env_free_list = e->env_link;
 	*newenv_store = e;
 
 	// cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
@@ -469,7 +514,7 @@ load_icode(struct Env *e, uint8_t *binary)
 	struct Proghdr *ph, *eph;
 
 	if (elf && elf->e_magic == ELF_MAGIC) {
-		lcr3(PADDR((uint64_t)e->env_pml4e));
+		tlb_load(PADDR((uint64_t)e->env_pml4e));
 		ph  = (struct Proghdr *)((uint8_t *)elf + elf->e_phoff);
 		eph = ph + elf->e_phnum;
 		for(;ph < eph; ph++) {
@@ -500,7 +545,7 @@ load_icode(struct Env *e, uint8_t *binary)
 				debug_address += sh->sh_size;
 			}
 		}
-		lcr3(boot_cr3);
+		tlb_load(boot_cr3);
 	} else {
 		panic("Invalid Binary");
 	}
@@ -530,6 +575,11 @@ env_create(uint8_t *binary, enum EnvType type)
 	// LAB 5: Your code here.
 	if (type == ENV_TYPE_FS)
 		e->env_tf.tf_eflags |= FL_IOPL_3;
+
+	// The servers spend their time waiting for requests; answer them
+	// promptly even when CPU-bound envs are running.
+	if (type == ENV_TYPE_FS || type == ENV_TYPE_NS)
+		e->env_sched_flags |= ENV_SCHED_WAKEBOOST;
 }
 
 //
@@ -538,9 +588,9 @@ env_create(uint8_t *binary, enum EnvType type)
 void
 env_free(struct Env *e)
 {
-	pte_t *pt;
-	uint64_t pdeno, pteno;
-	physaddr_t pa;
+	// Settle any blocking IPC sends to or from e.
+	ipc_env_free(e);
+	fpu_env_free(e);
 
 #ifndef VMM_GUEST
 	if(e->env_type == ENV_TYPE_GUEST) {
@@ -553,61 +603,21 @@ env_free(struct Env *e)
 	// before freeing the page directory, just in case the page
 	// gets reused.
 	if (e == curenv)
-		lcr3(boot_cr3);
+		tlb_load(boot_cr3);
 
 	// Note the environment's demise.
 	// cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
-	// Flush all mapped pages in the user portion of the address space
-	pdpe_t *env_pdpe = KADDR(PTE_ADDR(e->env_pml4e[0]));
-	int pdeno_limit;
-	uint64_t pdpe_index;
-	// using 3 instead of NPDPENTRIES as we have only first three indices
-	// set for 4GB of address space.
-	for(pdpe_index=0;pdpe_index<=3;pdpe_index++){
-		if(!(env_pdpe[pdpe_index] & PTE_P))
-			continue;
-		pde_t *env_pgdir = KADDR(PTE_ADDR(env_pdpe[pdpe_index]));
-		pdeno_limit  = pdpe_index==3?PDX(UTOP):PDX(0xFFFFFFFF);
-		static_assert(UTOP % PTSIZE == 0);
-		for (pdeno = 0; pdeno < pdeno_limit; pdeno++) {
-
-			// only look at mapped page tables
-			if (!(env_pgdir[pdeno] & PTE_P))
-				continue;
-			// find the pa and va of the page table
-			pa = PTE_ADDR(env_pgdir[pdeno]);
-			pt = (pte_t*) KADDR(pa);
-
-			// unmap all PTEs in this page table
-			for (pteno = 0; pteno < PTX(~0); pteno++) {
-				if (pt[pteno] & PTE_P){
-					page_remove(e->env_pml4e, PGADDR((uint64_t)0,pdpe_index,pdeno, pteno, 0));
-				}
-			}
-
-			// free the page table itself
-			env_pgdir[pdeno] = 0;
-			page_decref(pa2page(pa));
-		}
-		// free the page directory
-		pa = PTE_ADDR(env_pdpe[pdpe_index]);
-		env_pdpe[pdpe_index] = 0;
-		page_decref(pa2page(pa));
-	}
-	// free the page directory pointer
-	page_decref(pa2page(PTE_ADDR(e->env_pml4e[0])));
-	// free the page map level 4 (PML4)
-	e->env_pml4e[0] = 0;
-	pa = e->env_cr3;
+	// Unmap all the pages in the user portion of the address space,
+	// and free the page tables.
+	pml4e_free(e->env_pml4e);
 	e->env_pml4e = 0;
 	e->env_cr3 = 0;
-	page_decref(pa2page(pa));
 
 	// return the environment to the free list
 	e->env_status = ENV_FREE;
-	e->env_link = env_free_list;
-	env_free_list = e;
+	sched_dequeue(e);
+	env_free_list_put(e);
 }
 
 //
@@ -645,12 +655,41 @@ env_pop_tf(struct Trapframe *tf)
 {
 	// Record the CPU we are running on for user-space debugging
 	curenv->env_cpunum = cpunum();
+
+	// Send the TLB flushes this kernel entry gathered, and do any
+	// other CPUs sent us.
+	tlb_shootdown();
+	tlb_set_user(true);
+
+#ifndef VMM_GUEST
+	// An env that entered the kernel with SYSCALL has given up %rcx
+	// and %r11, so it can leave with the much cheaper SYSRET.  SYSRET
+	// faults in ring 0, on the user's stack, if the return address is
+	// not canonical, so only use it for addresses we know are.
+	if (tf->tf_trapno == T_SYSCALL && tf->tf_err == T_SYSCALL_FAST &&
+	    tf->tf_rip < UTOP && tf->tf_cs == (GD_UT | 3) &&
+	    tf->tf_ss == (GD_UD | 3))
+		__asm __volatile("movq %0,%%rsp\n"
+				 POPA
+				 "movw (%%rsp),%%es\n"
+				 "movw 8(%%rsp),%%ds\n"
+				 "addq $32,%%rsp\n" /* skip es, ds, tf_trapno and tf_err */
+				 "\tmovq 0(%%rsp),%%rcx\n"
+				 "\tmovq 16(%%rsp),%%r11\n"
+				 "\tmovq 24(%%rsp),%%rsp\n"
+				 "\tswapgs\n"
+				 "\tsysretq"
+				 : : "g" (tf) : "memory");
+#endif
 	__asm __volatile("movq %0,%%rsp\n"
 			 POPA
 			 "movw (%%rsp),%%es\n"
 			 "movw 8(%%rsp),%%ds\n"
 			 "addq $16,%%rsp\n"
 			 "\taddq $16,%%rsp\n" /* skip tf_trapno and tf_errcode */
+#ifndef VMM_GUEST
+			 "\tswapgs\n"	/* back to the user's GS base */
+#endif
 			 "\tiretq"
 			 : : "g" (tf) : "memory");
 	panic("iret failed");  /* mostly to placate the compiler */
@@ -666,10 +705,18 @@ env_pop_tf(struct Trapframe *tf)
 void
 env_run(struct Env *e)
 {
+	// A new environment gets a fresh timeslice; when returning to
+	// the same one, only rearm the timer once its slice has run out.
+	if (curenv != e || !lapic_timer_pending())
+		lapic_timer_oneshot(sched_timeslice_ms);
+
 	// Is this a context switch or just a return?
 	if (curenv != e) {
-		if (curenv && curenv->env_status == ENV_RUNNING)
+		if (curenv && curenv->env_status == ENV_RUNNING) {
 			curenv->env_status = ENV_RUNNABLE;
+			sched_enqueue(curenv);
+		}
+		fpu_switch_out();
 
 		// cprintf("cpu %d switch from env %d to env %d\n",
 		// 	cpunum(), curenv ? curenv - envs : -1, e - envs);
@@ -677,14 +724,19 @@ env_run(struct Env *e)
 		// keep track of which environment we're currently
 		// running
 		curenv = e;
+		sched_dequeue(e);
 		e->env_status = ENV_RUNNING;
+		e->env_dispatched = read_tsc();
 
 		// Hint, Lab 0: An environment has started running. We should keep track of that somewhere, right?
 		e->env_runs++; // increment the number of times the env has been run
 
-		// restore e's address space
+		// restore e's address space; a guest runs in its EPT, and
+		// its VM exits come back to boot_cr3
 		if(e->env_type != ENV_TYPE_GUEST)
-			lcr3(e->env_cr3);
+			tlb_load(e->env_cr3);
+		else
+			tlb_load(boot_cr3);
 	}
 
 	assert(e->env_status == ENV_RUNNING);
@@ -692,6 +744,9 @@ env_run(struct Env *e)
 
 #ifndef VMM_GUEST
 	if(e->env_type == ENV_TYPE_GUEST) {
+		tlb_shootdown();
+		// A guest uses the FPU without trapping to us.
+		fpu_load(e);
 		vmx_vmrun(e);
 		panic ("vmx_run never returns\n");
 	}
@@ -0,0 +1,165 @@
+#line 2 "../kern/fpu.c"
+// Switching the x87, SSE and AVX registers between environments.
+//
+// The kernel never uses these registers itself (it is built with
+// -mno-sse -mno-mmx), and most environments never touch them, so
+// their state is switched lazily.  A CPU runs user code with CR0_TS
+// set until the environment's first FPU or SIMD instruction, which
+// traps with T_DEVICE; fpu_load then loads the environment's state
+// and clears CR0_TS.  When the environment stops running on the CPU,
+// fpu_switch_out saves the state only if it was loaded during that
+// timeslice.  The registers keep holding it, so an environment that
+// runs again on the same CPU, with no other one having used the FPU
+// there since, needs no reload.
+//
+// The state is saved with XSAVEOPT, XSAVE or FXSAVE, whichever the CPU
+// has, in a page allocated on the environment's first use of the FPU.
+
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/error.h>
+#include <inc/assert.h>
+
+#include <kern/fpu.h>
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+#include <kern/env.h>
+
+// XSAVE state components we enable: x87, SSE and AVX.
+#define XFEATURE_MASK	0x7
+
+// Offsets in the FXSAVE/XSAVE area.
+#define FPU_FCW		0
+#define FPU_MXCSR	24
+
+static uint64_t fpu_xcr0;	// Components XSAVE saves, or 0 for FXSAVE
+static bool fpu_xsaveopt;	// The CPU has XSAVEOPT
+
+// Enable the FPU and SSE on this CPU, and XSAVE if it has it.
+void
+fpu_init_percpu(void)
+{
+#ifndef VMM_GUEST
+	uint32_t eax, ebx, ecx, edx;
+#endif
+
+	lcr0((rcr0() | CR0_MP | CR0_TS) & ~CR0_EM);
+	lcr4(rcr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+#ifndef VMM_GUEST
+	// A guest kernel sticks to FXSAVE: XSETBV always exits to the
+	// VMM, which does not handle it.
+	cpuid(1, NULL, NULL, &ecx, NULL);
+	if (!(ecx & (1 << 26)))
+		return;
+	lcr4(rcr4() | CR4_OSXSAVE);
+	cpuid_count(0xD, 0, &eax, NULL, NULL, &edx);
+	fpu_xcr0 = (((uint64_t) edx << 32) | eax) & XFEATURE_MASK;
+	xsetbv(0, fpu_xcr0);
+	cpuid_count(0xD, 0, NULL, &ebx, NULL, NULL);
+	if (ebx > PGSIZE)
+		panic("XSAVE area of %d bytes", ebx);
+	cpuid_count(0xD, 1, &eax, NULL, NULL, NULL);
+	fpu_xsaveopt = eax & 1;
+#endif
+}
+
+static void
+fpu_save(void *area)
+{
+	uint32_t lo = fpu_xcr0, hi = fpu_xcr0 >> 32;
+
+	if (fpu_xsaveopt)
+		asm volatile("xsaveopt64 (%0)"
+			     : : "r" (area), "a" (lo), "d" (hi) : "memory");
+	else if (fpu_xcr0)
+		asm volatile("xsave64 (%0)"
+			     : : "r" (area), "a" (lo), "d" (hi) : "memory");
+	else
+		asm volatile("fxsave64 (%0)" : : "r" (area) : "memory");
+}
+
+static void
+fpu_restore(void *area)
+{
+	uint32_t lo = fpu_xcr0, hi = fpu_xcr0 >> 32;
+
+	if (fpu_xcr0)
+		asm volatile("xrstor64 (%0)"
+			     : : "r" (area), "a" (lo), "d" (hi) : "memory");
+	else
+		asm volatile("fxrstor64 (%0)" : : "r" (area) : "memory");
+}
+
+// Give this CPU's FPU to e, which is about to use it here: on a
+// T_DEVICE trap for a user environment, or before running a guest.
+// Returns 0, or -E_NO_MEM if e has no state area yet and none can be
+// allocated, in which case the FPU belongs to nobody.
+int
+fpu_load(struct Env *e)
+{
+	struct CpuInfo *c = thiscpu;
+	struct PageInfo *pp;
+	uint8_t *area;
+
+	clts();
+	c->cpu_fpu_dirty = true;
+	if (c->cpu_fpu_env == e && e->env_fpu_cpu == cpunum())
+		return 0;
+
+	c->cpu_fpu_env = NULL;
+	if (!e->env_fpu) {
+		if (!(pp = page_alloc(ALLOC_ZERO))) {
+			c->cpu_fpu_dirty = false;
+			lcr0(rcr0() | CR0_TS);
+			return -E_NO_MEM;
+		}
+		pp->pp_ref++;
+		// The initial state: all exceptions masked, and an XSAVE
+		// header with no components in use.
+		area = page2kva(pp);
+		*(uint16_t *) (area + FPU_FCW) = 0x37f;
+		*(uint32_t *) (area + FPU_MXCSR) = 0x1f80;
+		e->env_fpu = area;
+	}
+	fpu_restore(e->env_fpu);
+	c->cpu_fpu_env = e;
+	e->env_fpu_cpu = cpunum();
+	return 0;
+}
+
+// The current environment stops running on this CPU.  Save its FPU
+// state if it used the FPU, and make the next one trap before it does.
+void
+fpu_switch_out(void)
+{
+	struct CpuInfo *c = thiscpu;
+
+	if (!c->cpu_fpu_dirty)
+		return;
+	if (c->cpu_fpu_env)
+		fpu_save(c->cpu_fpu_env->env_fpu);
+	c->cpu_fpu_dirty = false;
+	lcr0(rcr0() | CR0_TS);
+}
+
+// e is being freed: forget its FPU state.
+void
+fpu_env_free(struct Env *e)
+{
+	struct CpuInfo *c = thiscpu;
+
+	if (c->cpu_fpu_env == e) {
+		c->cpu_fpu_env = NULL;
+		if (c->cpu_fpu_dirty) {
+			c->cpu_fpu_dirty = false;
+			lcr0(rcr0() | CR0_TS);
+		}
+	}
+	// Other CPUs may still name e as the owner of their FPU, but
+	// fpu_load checks env_fpu_cpu as well.
+	e->env_fpu_cpu = -1;
+	if (e->env_fpu) {
+		page_decref(pa2page(PADDR(e->env_fpu)));
+		e->env_fpu = NULL;
+	}
+}
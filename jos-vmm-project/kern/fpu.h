@@ -0,0 +1,15 @@
+#line 2 "../kern/fpu.h"
+#ifndef JOS_KERN_FPU_H
+#define JOS_KERN_FPU_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+
+void fpu_init_percpu(void);
+int fpu_load(struct Env *e);
+void fpu_switch_out(void);
+void fpu_env_free(struct Env *e);
+
+#endif /* JOS_KERN_FPU_H */
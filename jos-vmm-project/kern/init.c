@@ -11,6 +11,8 @@
 #include <kern/dwarf_api.h>
 #line 13 "../kern/init.c"
 #include <kern/pmap.h>
+#include <kern/kmalloc.h>
+#include <kern/fpu.h>
 #include <kern/kclock.h>
 #line 17 "../kern/init.c"
 #include <kern/env.h>
@@ -66,6 +68,10 @@ i386_init(void)
 	// This ensures that all static/global variables start out zero.
 	memset(edata, 0, end - edata);
 
+	// thiscpu is reached through GS, so point it at cpus[0] before
+	// anything uses it.
+	cpu_init_gs();
+
 	// Initialize the console.
 	// Can't call cprintf until after we do this!
 	cons_init();
@@ -96,11 +102,13 @@ i386_init(void)
 #line 120 "../kern/init.c"
 	// Lab 2 memory management initialization functions
 	x64_vm_init();
+	check_kmalloc();
 #line 124 "../kern/init.c"
 
 	// Lab 3 user environment initialization functions
 	env_init();
 	trap_init();
+	fpu_init_percpu();
 #line 130 "../kern/init.c"
 
 #line 132 "../kern/init.c"
@@ -208,11 +216,14 @@ mp_main(void)
 {
 	// We are in high EIP now, safe to switch to kern_pgdir 
 	lcr3(boot_cr3);
+	cpu_init_gs();
+	tlb_init_percpu();
 	cprintf("SMP: CPU %d starting\n", cpunum());
 
 	lapic_init();
 	env_init_percpu();
 	trap_init_percpu();
+	fpu_init_percpu();
 	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
 
 	// Now that we have finished some basic setup, call sched_yield()
@@ -0,0 +1,914 @@
+#line 2 "../kern/ipc.c"
+// Kernel side of IPC: delivering a message to an environment blocked
+// in sys_ipc_recv(), and the queues of senders blocked in
+// sys_ipc_send() until their target receives.
+//
+// Each environment has a FIFO queue of the senders waiting for it,
+// linked through env_ipc_waitq_next.  A sender on a queue is
+// ENV_NOT_RUNNABLE with its message saved in its env_ipc_send_*
+// fields; the receiver takes the message from the head of its queue
+// the next time it calls sys_ipc_recv(), and wakes the sender with
+// the result of the send.  The queues are protected by the big
+// kernel lock.
+//
+// sys_ipc_call() sends and then receives the reply in one system call,
+// in a closed receive that only accepts a message from the env it
+// called; sys_ipc_reply_recv() is the server's half.  When the partner
+// is ready, both hand this CPU straight to it with sched_handoff()
+// rather than going through the run queues.
+//
+// A send with IPC_SG in its perm grants a list of page ranges instead
+// of one page.  The list is copied into the sender's env_ipc_send_sg
+// when the send starts, since a queued sender's memory cannot be read
+// from the receiver's address space, and the pages are mapped one
+// after another in the receiver's window.
+//
+// An env can also be an endpoint for a pool of workers: envs that it
+// adds with sys_ipc_join() receive messages sent to it as if they were
+// the env itself.  Members blocked in an open receive sit on the
+// endpoint's idle list, and a message sent to the endpoint goes to an
+// idle member, preferably one that last ran on the sender's CPU.  If
+// none is idle, the sender waits on the endpoint's own queue, which
+// members take messages from as they finish their work.  A member's
+// reply is accepted by a caller of the endpoint.
+//
+// Notifications carry no message: sys_ipc_notify() sets bits in the
+// target's env_notify_pending, and wakes it if it is blocked in
+// sys_ipc_notify_wait().  Bits that arrive while it is not waiting are
+// kept until it next waits, so a wakeup cannot be lost.  Each env's
+// notification state has its own lock, so a notification that wakes
+// no one, and a wait that finds bits pending, need no kernel lock.
+// The rest of IPC blocks and wakes envs through the scheduler, and so
+// stays under the big kernel lock with it.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/mmu.h>
+#include <inc/string.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
+#include <kern/time.h>
+#include <kern/ipc.h>
+#ifndef VMM_GUEST
+#include <vmm/ept.h>
+#endif
+
+// Number of queued senders with a timeout, and a time no later than
+// the earliest of their deadlines.
+static unsigned ipc_ntimeouts;
+static unsigned ipc_next_deadline;
+
+// Protect each env's env_notify_pending and env_notify_waiting.
+static struct spinlock ipc_notify_locks[NENV];
+
+#define NOTIFY_LOCK(e)	(&ipc_notify_locks[(e) - envs])
+
+void
+ipc_init(void)
+{
+	int i;
+
+	for (i = 0; i < NENV; i++)
+		__spin_initlock(&ipc_notify_locks[i], "ipc_notify_lock");
+}
+
+// Check that 'src' may send the page at 'srcva' with 'perm'.
+// Returns the page, or NULL if it may not.
+static struct PageInfo *
+ipc_check_page(struct Env *src, void *srcva, unsigned perm)
+{
+	struct PageInfo *pp;
+	pte_t *ppte;
+
+	if (PGOFF(srcva) || srcva >= (void *) UMAPTOP)
+		return NULL;
+	if ((~perm & (PTE_U|PTE_P)) || (perm & ~PTE_SYSCALL))
+		return NULL;
+	if ((pp = page_lookup(src->env_pml4e, srcva, &ppte)) == NULL)
+		return NULL;
+	if ((perm & PTE_W) && !(*ppte & PTE_W))
+		return NULL;
+	// IPC grants 4KB pages; use sys_page_map to share a 2MB page.
+	if (*ppte & PTE_PS)
+		return NULL;
+	return pp;
+}
+
+// If 'src' sends the lazily allocated page at 'srcva' writable, give
+// it a page of its own first, rather than send the zero page, and if
+// fork shared it before it had a page, give it that page.  No address
+// space may be locked.
+//
+// Returns 0 on success, or -E_NO_MEM.
+static int
+ipc_lazy_alloc(struct Env *src, void *srcva, unsigned perm)
+{
+	int r;
+
+	if (PGOFF(srcva) || srcva >= (void *) UMAPTOP ||
+	    src->env_type == ENV_TYPE_GUEST)
+		return 0;
+	env_vm_lock(src);
+	r = page_lazy_alloc(src->env_pml4e, srcva, perm);
+	env_vm_unlock(src);
+	return r < 0 ? r : 0;
+}
+
+// 'e' has blocked in an open receive.  If it is an endpoint member, put
+// it on the endpoint's idle list.
+static void
+ipc_idle_add(struct Env *e)
+{
+	struct Env *ep = e->env_ipc_endpoint;
+
+	if (!ep || e->env_ipc_idle)
+		return;
+	e->env_ipc_idle_next = ep->env_ipc_idle_head;
+	ep->env_ipc_idle_head = e;
+	e->env_ipc_idle = true;
+}
+
+static void
+ipc_idle_remove(struct Env *e)
+{
+	struct Env **pp;
+
+	if (!e->env_ipc_idle)
+		return;
+	for (pp = &e->env_ipc_endpoint->env_ipc_idle_head; *pp != e;
+	     pp = &(*pp)->env_ipc_idle_next)
+		assert(*pp);
+	*pp = e->env_ipc_idle_next;
+	e->env_ipc_idle_next = NULL;
+	e->env_ipc_idle = false;
+}
+
+// 'c' no longer waits for a reply, if it was.
+static void
+ipc_caller_remove(struct Env *c)
+{
+	struct Env **pp;
+
+	if (!c->env_ipc_server)
+		return;
+	for (pp = &c->env_ipc_server->env_ipc_callers; *pp != c;
+	     pp = &(*pp)->env_ipc_caller_next)
+		assert(*pp);
+	*pp = c->env_ipc_caller_next;
+	c->env_ipc_caller_next = NULL;
+	c->env_ipc_server = NULL;
+}
+
+// 'c', blocked in sys_ipc_call(), has had its message delivered to
+// 'server', and now waits for server's reply.
+static void
+ipc_caller_add(struct Env *c, struct Env *server)
+{
+	ipc_caller_remove(c);
+	c->env_ipc_server = server;
+	c->env_ipc_caller_next = server->env_ipc_callers;
+	server->env_ipc_callers = c;
+}
+
+// 'c' waited for a reply that will never come: fail its call.
+static void
+ipc_caller_fail(struct Env *c)
+{
+	ipc_caller_remove(c);
+	c->env_ipc_recving = 0;
+	c->env_tf.tf_regs.reg_rax = -E_BAD_ENV;
+	if (c->env_status == ENV_NOT_RUNNABLE)
+		sched_wakeup(c);
+}
+
+// Record where 'e' will receive pages: 'dstva', as passed to one of the
+// receiving system calls, is a page address, or IPC_WINDOW(va, n) to
+// accept up to n pages at va.
+//
+// Returns 0 on success, or -E_INVAL if the window does not end at or
+// below UMAPTOP.
+int
+ipc_set_dstva(struct Env *e, void *dstva)
+{
+	uintptr_t va = ROUNDDOWN((uintptr_t) dstva, PGSIZE);
+	unsigned npages = PGOFF(dstva) + 1;
+
+	if (dstva >= (void *) UTOP) {
+		e->env_ipc_dstva = dstva;
+		e->env_ipc_dstpages = 0;
+		return 0;
+	}
+	if (va + (uintptr_t) npages * PGSIZE > UMAPTOP)
+		return -E_INVAL;
+	e->env_ipc_dstva = (void *) va;
+	e->env_ipc_dstpages = npages;
+	return 0;
+}
+
+// Check that curenv may send what 'srcva' and 'perm' describe, before
+// it starts a send.  With IPC_SG, copy the list of ranges at srcva into
+// curenv->env_ipc_send_sg and check every page in it.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_FAULT if the list of ranges is not readable.
+//	-E_INVAL if the list is too long, or a range is not page-aligned
+//		or not below UMAPTOP, or a page cannot be sent with 'perm'.
+//	-E_NO_MEM if a lazily allocated page sent writable cannot be
+//		allocated.
+int
+ipc_send_prepare(void *srcva, unsigned perm)
+{
+	struct IpcSg *sg = &curenv->env_ipc_send_sg;
+	struct IpcRange *ir;
+	unsigned i, j, total = 0;
+	uintptr_t va;
+	int r;
+
+	if (!(perm & IPC_SG)) {
+		if (srcva >= (void *) UTOP)
+			return 0;
+		if ((r = ipc_lazy_alloc(curenv, srcva, perm)) < 0)
+			return r;
+		if (!ipc_check_page(curenv, srcva, perm))
+			return -E_INVAL;
+		return 0;
+	}
+
+	perm &= ~IPC_SG;
+	if (curenv->env_type == ENV_TYPE_GUEST)
+		return -E_INVAL;
+	if (user_mem_check(curenv, srcva, sizeof(*sg), PTE_U) < 0)
+		return -E_FAULT;
+	memmove(sg, srcva, sizeof(*sg));
+	if (sg->is_n > IPC_MAXRANGES)
+		return -E_INVAL;
+	for (i = 0; i < sg->is_n; i++) {
+		ir = &sg->is_ranges[i];
+		va = (uintptr_t) ir->ir_va;
+		if (ir->ir_npages > IPC_MAXPAGES)
+			return -E_INVAL;
+		total += ir->ir_npages;
+		if (PGOFF(va) || total > IPC_MAXPAGES ||
+		    va + (uintptr_t) ir->ir_npages * PGSIZE > UMAPTOP)
+			return -E_INVAL;
+		for (j = 0; j < ir->ir_npages; j++) {
+			if ((r = ipc_lazy_alloc(curenv, (void *) (va + j * PGSIZE), perm)) < 0)
+				return r;
+			if (!ipc_check_page(curenv, (void *) (va + j * PGSIZE), perm))
+				return -E_INVAL;
+		}
+	}
+	return 0;
+}
+
+// Map the pages in src's env_ipc_send_sg one after another in dst's
+// window, with 'perm'.  Either all of them are mapped or, on error,
+// none are, though pages that were mapped in the window before may
+// then have been unmapped.
+static int
+ipc_deliver_sg(struct Env *src, struct Env *dst, unsigned perm)
+{
+	struct IpcSg *sg = &src->env_ipc_send_sg;
+	struct IpcRange *ir;
+	struct PageInfo *pp;
+	uint8_t *dstva = dst->env_ipc_dstva;
+	unsigned i, j, n = 0, total = 0;
+	int r = 0;
+
+	for (i = 0; i < sg->is_n; i++)
+		total += sg->is_ranges[i].ir_npages;
+	if (total > dst->env_ipc_dstpages ||
+	    (uintptr_t) dstva + (uintptr_t) total * PGSIZE > UMAPTOP)
+		return -E_INVAL;
+
+	env_vm_lock(dst);
+	for (i = 0; i < sg->is_n && r == 0; i++) {
+		ir = &sg->is_ranges[i];
+		for (j = 0; j < ir->ir_npages; j++) {
+			// A queued sender may have changed its mappings.
+			pp = ipc_check_page(src, (uint8_t *) ir->ir_va + j * PGSIZE, perm);
+			if (pp == NULL) {
+				r = -E_INVAL;
+				break;
+			}
+			if ((r = page_insert(dst->env_pml4e, pp, dstva + n * PGSIZE, perm)) < 0)
+				break;
+			n++;
+		}
+	}
+	if (r < 0)
+		while (n > 0)
+			page_remove(dst->env_pml4e, dstva + --n * PGSIZE);
+	env_vm_unlock(dst);
+	if (r < 0)
+		return r;
+
+	dst->env_ipc_npages = total;
+	dst->env_ipc_perm = total ? perm : 0;
+	return 0;
+}
+
+// Deliver a message from 'src' to 'dst', which must be blocked in
+// sys_ipc_recv(): map the page at 'srcva' in src at dst's
+// env_ipc_dstva if both are below UTOP, and fill in dst's ipc fields
+// so that its sys_ipc_recv() returns 0.  The caller makes dst
+// runnable.
+//
+// When src is a guest, srcva is a host kernel address for the page;
+// when dst is a guest, the page goes into its extended page tables.
+//
+// With IPC_SG in 'perm', src's env_ipc_send_sg, filled in by
+// ipc_send_prepare(), lists the pages to map instead.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if srcva < UTOP and the page cannot be sent with 'perm'
+//		(see sys_ipc_try_send).
+//	-E_INVAL if more pages are sent than dst's window holds.
+//	-E_NO_MEM if there's not enough memory to map the page in dst.
+int
+ipc_deliver(struct Env *src, struct Env *dst, uint32_t value,
+	    void *srcva, unsigned perm)
+{
+	struct PageInfo *pp;
+	int r;
+
+	dst->env_ipc_npages = 0;
+	if (perm & IPC_SG) {
+		if (src->env_type == ENV_TYPE_GUEST || dst->env_type == ENV_TYPE_GUEST)
+			return -E_INVAL;
+		if (dst->env_ipc_dstva < (void *) UTOP) {
+			if ((r = ipc_deliver_sg(src, dst, perm & ~IPC_SG)) < 0)
+				return r;
+		} else
+			dst->env_ipc_perm = 0;
+	} else if (src->env_type == ENV_TYPE_GUEST && dst->env_ipc_dstva < (void *) UTOP) {
+		// A guest sending to the host: map the page in dst's
+		// page table.
+		pp = pa2page(PADDR(srcva));
+		env_vm_lock(dst);
+		r = page_insert(dst->env_pml4e, pp, dst->env_ipc_dstva, perm);
+		env_vm_unlock(dst);
+		if (r < 0) {
+			cprintf("[%08x] ipc_deliver page_insert failure!\n", dst->env_id);
+			return -E_INVAL;
+		}
+		dst->env_ipc_npages = 1;
+	} else if (dst->env_type == ENV_TYPE_GUEST && srcva < (void *) UTOP) {
+		// The host sending to a guest: map the page in dst's EPT.
+#ifndef VMM_GUEST
+		pp = page_lookup(src->env_pml4e, srcva, NULL);
+		if (pp == NULL) {
+			cprintf("[%08x] ipc_deliver page_lookup failure!\n", dst->env_id);
+			return -E_INVAL;
+		}
+		r = ept_page_insert(dst->env_pml4e, pp, dst->env_ipc_dstva, __EPTE_FULL);
+		if (r < 0) {
+			cprintf("[%08x] ipc_deliver ept_page_insert failure!\n", dst->env_id);
+			return -E_INVAL;
+		}
+		dst->env_ipc_npages = 1;
+#endif
+	} else if (srcva < (void *) UTOP && dst->env_ipc_dstva < (void *) UTOP) {
+		if ((r = ipc_lazy_alloc(src, srcva, perm)) < 0)
+			return r;
+		if ((pp = ipc_check_page(src, srcva, perm)) == NULL) {
+			cprintf("[%08x] cannot send page %08x perm %x\n", src->env_id, srcva, perm);
+			return -E_INVAL;
+		}
+		env_vm_lock(dst);
+		r = page_insert(dst->env_pml4e, pp, dst->env_ipc_dstva, perm);
+		env_vm_unlock(dst);
+		if (r < 0) {
+			cprintf("[%08x] page_insert %08x failed in ipc_deliver (%e)\n", src->env_id, srcva, r);
+			return r;
+		}
+		dst->env_ipc_perm = perm;
+		dst->env_ipc_npages = 1;
+	} else {
+		dst->env_ipc_perm = 0;
+	}
+
+	ipc_idle_remove(dst);
+	ipc_caller_remove(dst);
+	dst->env_ipc_recving = 0;
+	dst->env_ipc_from = src->env_id;
+	dst->env_ipc_value = value;
+	dst->env_tf.tf_regs.reg_rax = 0;
+
+	// A guest receives the value in rsi.
+	if (dst->env_type == ENV_TYPE_GUEST)
+		dst->env_tf.tf_regs.reg_rsi = value;
+
+	// A caller now waits for dst's reply, whichever member of an
+	// endpoint dst is.
+	if (src->env_ipc_recving && src->env_ipc_recvfrom)
+		ipc_caller_add(src, dst);
+	return 0;
+}
+
+// Is 'dst' blocked receiving a message that 'src' may send?  An env
+// in sys_ipc_call() only receives once its own message has gone.
+bool
+ipc_recving_from(struct Env *dst, struct Env *src)
+{
+	envid_t from = dst->env_ipc_recvfrom;
+
+	return dst->env_ipc_recving && !dst->env_ipc_sendto &&
+		(!from || from == src->env_id ||
+		 (src->env_ipc_endpoint && from == src->env_ipc_endpoint->env_id));
+}
+
+// Which env should receive a message addressed to 'dst'?  If dst is an
+// endpoint with idle members, one of them, preferring one that last
+// ran on this CPU, so the sender's data is still in its cache;
+// otherwise dst itself.
+struct Env *
+ipc_endpoint_pick(struct Env *dst)
+{
+	struct Env *m;
+
+	if (dst->env_ipc_endpoint != dst || !dst->env_ipc_idle_head)
+		return dst;
+	for (m = dst->env_ipc_idle_head; m; m = m->env_ipc_idle_next)
+		if (m->env_cpunum == cpunum())
+			return m;
+	return dst->env_ipc_idle_head;
+}
+
+// Make 'm' a member of curenv's endpoint, which curenv becomes if it
+// is not one already.  Only the endpoint adds members, so no env can
+// take the messages sent to another without its consent.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if m is already a member of another endpoint, or curenv
+//		is a member of an endpoint other than its own.
+int
+ipc_join(struct Env *m)
+{
+	struct Env *ep = curenv;
+
+	if (ep->env_ipc_endpoint && ep->env_ipc_endpoint != ep)
+		return -E_INVAL;
+	if (m->env_ipc_endpoint && m->env_ipc_endpoint != ep)
+		return -E_INVAL;
+	ep->env_ipc_endpoint = ep;
+	if (m == ep || m->env_ipc_endpoint == ep)
+		return 0;
+	m->env_ipc_endpoint = ep;
+	m->env_ipc_member_next = ep->env_ipc_members;
+	ep->env_ipc_members = m;
+	// m may already be blocked in an open receive: hand it a message
+	// waiting for the endpoint, or else make it idle.
+	if (m->env_ipc_recving && !m->env_ipc_recvfrom && !m->env_ipc_sendto) {
+		if (!ipc_recv_waiting(m))
+			ipc_idle_add(m);
+		else if (m->env_status == ENV_NOT_RUNNABLE)
+			sched_wakeup(m);
+	}
+	return 0;
+}
+
+// Take sender 's' off the queue it is waiting on.
+static void
+ipc_waitq_remove(struct Env *s)
+{
+	struct Env *dst = s->env_ipc_sendto;
+	struct Env *prev = NULL, *cur;
+
+	for (cur = dst->env_ipc_waitq_head; cur != s; cur = cur->env_ipc_waitq_next) {
+		assert(cur);
+		prev = cur;
+	}
+	if (prev)
+		prev->env_ipc_waitq_next = s->env_ipc_waitq_next;
+	else
+		dst->env_ipc_waitq_head = s->env_ipc_waitq_next;
+	if (dst->env_ipc_waitq_tail == s)
+		dst->env_ipc_waitq_tail = prev;
+
+	s->env_ipc_waitq_next = NULL;
+	s->env_ipc_sendto = NULL;
+	if (s->env_ipc_send_timed) {
+		s->env_ipc_send_timed = false;
+		ipc_ntimeouts--;
+	}
+}
+
+// Take sender 's' off its queue and make its sys_ipc_send() return 'r'.
+// A sender in sys_ipc_call() whose message went through stays blocked,
+// now waiting for the reply.
+static void
+ipc_send_finish(struct Env *s, int r)
+{
+	ipc_waitq_remove(s);
+	if (r == 0 && s->env_ipc_recving)
+		return;
+	s->env_ipc_recving = 0;
+	s->env_tf.tf_regs.reg_rax = r;
+	if (s->env_status == ENV_NOT_RUNNABLE)
+		sched_wakeup(s);
+}
+
+// 's' is being made runnable by sys_env_set_status while it waits on a
+// queue.  Take it off the queue, so that no receiver takes its message
+// later, and make its send fail with -E_IPC_NOT_RECV.
+void
+ipc_send_cancel(struct Env *s)
+{
+	ipc_waitq_remove(s);
+	s->env_ipc_recving = 0;
+	s->env_tf.tf_regs.reg_rax = -E_IPC_NOT_RECV;
+}
+
+// Queue curenv, with its message, at the tail of dst's queue of
+// senders and give up the CPU.
+static void __attribute__((noreturn))
+ipc_send_block(struct Env *dst, uint32_t value, void *srcva,
+	       unsigned perm, unsigned timeout_ms)
+{
+	unsigned deadline;
+
+	curenv->env_ipc_send_value = value;
+	curenv->env_ipc_send_srcva = srcva;
+	curenv->env_ipc_send_perm = perm;
+	if (timeout_ms) {
+		deadline = time_msec() + timeout_ms;
+		if (!ipc_ntimeouts || (int) (deadline - ipc_next_deadline) < 0)
+			ipc_next_deadline = deadline;
+		ipc_ntimeouts++;
+		curenv->env_ipc_send_deadline = deadline;
+		curenv->env_ipc_send_timed = true;
+	}
+
+	curenv->env_ipc_sendto = dst;
+	curenv->env_ipc_waitq_next = NULL;
+	if (dst->env_ipc_waitq_tail)
+		dst->env_ipc_waitq_tail->env_ipc_waitq_next = curenv;
+	else
+		dst->env_ipc_waitq_head = curenv;
+	dst->env_ipc_waitq_tail = curenv;
+
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	sched_yield();
+}
+
+// Send a message from curenv to 'dst', blocking until dst receives it.
+// If dst is already receiving, the message is delivered at once.
+// Otherwise curenv joins the tail of dst's queue of senders and gives
+// up the CPU; the system call returns when dst takes the message, or
+// with -E_IPC_NOT_RECV once 'timeout_ms' milliseconds have passed,
+// if 'timeout_ms' is not 0.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if dst is curenv.
+//	-E_INVAL if srcva < UTOP and the page cannot be sent with 'perm'.
+//	-E_IPC_NOT_RECV if the timeout expired.
+//	-E_BAD_ENV if dst was destroyed before it received the message.
+//	-E_NO_MEM if there's not enough memory to map the page in dst.
+int
+ipc_send_wait(struct Env *dst, uint32_t value, void *srcva,
+	      unsigned perm, unsigned timeout_ms)
+{
+	struct Env *rcv;
+	int r;
+
+	if (dst == curenv)
+		return -E_INVAL;
+	// Check the pages now, so the sender hears about a bad page
+	// without having to wait for the receiver.
+	if ((r = ipc_send_prepare(srcva, perm)) < 0)
+		return r;
+
+	rcv = ipc_endpoint_pick(dst);
+	if (!ipc_recving_from(rcv, curenv))
+		ipc_send_block(dst, value, srcva, perm, timeout_ms);
+	if ((r = ipc_deliver(curenv, rcv, value, srcva, perm)) < 0)
+		return r;
+	sched_wakeup(rcv);
+	return 0;
+}
+
+// Send a message from curenv to 'dst' as for ipc_send_wait(), then
+// wait for dst's reply, to be received at 'dstva'.  Messages from
+// other envs wait until the reply has arrived.  If dst was already
+// receiving, this CPU switches straight to it.
+//
+// Returns < 0 on error, as for ipc_send_wait(), and does not return
+// on success: the system call returns 0 when the reply arrives, or
+// -E_BAD_ENV if dst is destroyed first.
+int
+ipc_call(struct Env *dst, uint32_t value, void *srcva, unsigned perm,
+	 void *dstva)
+{
+	struct Env *rcv;
+	int r;
+
+	if (dst == curenv)
+		return -E_INVAL;
+	if ((r = ipc_set_dstva(curenv, dstva)) < 0)
+		return r;
+	if ((r = ipc_send_prepare(srcva, perm)) < 0)
+		return r;
+
+	curenv->env_ipc_recving = 1;
+	curenv->env_ipc_recvfrom = dst->env_id;
+	rcv = ipc_endpoint_pick(dst);
+	if (!ipc_recving_from(rcv, curenv))
+		ipc_send_block(dst, value, srcva, perm, 0);
+	if ((r = ipc_deliver(curenv, rcv, value, srcva, perm)) < 0) {
+		curenv->env_ipc_recving = 0;
+		return r;
+	}
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	sched_handoff(rcv);
+}
+
+// Reply to 'to', if it is not NULL, then receive the next message at
+// 'dstva' as for sys_ipc_recv().  The reply never blocks: if 'to' is
+// no longer waiting for one, it is dropped, and if it cannot be
+// delivered, to's sys_ipc_call() fails with the error instead.  If no
+// message is waiting, this CPU switches straight to 'to'.
+//
+// Returns 0 if a message was waiting, or -E_INVAL, without replying,
+// if 'dstva' is not valid; otherwise does not return, and the system
+// call returns 0 when a message arrives.
+int
+ipc_reply_recv(struct Env *to, uint32_t value, void *srcva, unsigned perm,
+	       void *dstva)
+{
+	int r;
+
+	if ((r = ipc_set_dstva(curenv, dstva)) < 0)
+		return r;
+	if (to && ipc_recving_from(to, curenv)) {
+		if ((r = ipc_send_prepare(srcva, perm)) == 0)
+			r = ipc_deliver(curenv, to, value, srcva, perm);
+		if (r < 0) {
+			ipc_caller_remove(to);
+			to->env_ipc_recving = 0;
+			to->env_tf.tf_regs.reg_rax = r;
+		}
+	} else
+		to = NULL;
+
+	curenv->env_ipc_recving = 1;
+	curenv->env_ipc_recvfrom = 0;
+	if (ipc_recv_waiting(curenv)) {
+		if (to)
+			sched_wakeup(to);
+		return 0;
+	}
+	ipc_idle_add(curenv);
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	if (to)
+		sched_handoff(to);
+	sched_yield();
+}
+
+// Receive a message at 'dstva', as for sys_ipc_recv().  Returns 0 if
+// one was waiting, or -E_INVAL if 'dstva' is not valid; otherwise
+// blocks, and the system call returns 0 when a message arrives.
+int
+ipc_recv(void *dstva)
+{
+	int r;
+
+	if ((r = ipc_set_dstva(curenv, dstva)) < 0)
+		return r;
+	curenv->env_ipc_recving = 1;
+	curenv->env_ipc_recvfrom = 0;
+	// Take the message of the first sender blocked in sys_ipc_send,
+	// if there is one, without blocking.
+	if (ipc_recv_waiting(curenv))
+		return 0;
+	ipc_idle_add(curenv);
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	sched_yield();
+}
+
+// Deliver to 'dst' the message of the first sender on q's queue that
+// dst will accept a message from and that can still send, and wake
+// that sender.  Senders whose message can no longer be delivered are
+// woken with the error.
+static bool
+ipc_recv_queued(struct Env *dst, struct Env *q)
+{
+	struct Env *s, *next;
+	int r;
+
+	for (s = q->env_ipc_waitq_head; s; s = next) {
+		next = s->env_ipc_waitq_next;
+		if (!ipc_recving_from(dst, s))
+			continue;
+		r = ipc_deliver(s, dst, s->env_ipc_send_value,
+				s->env_ipc_send_srcva, s->env_ipc_send_perm);
+		ipc_send_finish(s, r);
+		if (r == 0)
+			return true;
+	}
+	return false;
+}
+
+// 'dst' has just started receiving.  If a sender it will accept a
+// message from is waiting for it, or for the endpoint it is a member
+// of, deliver that message.
+//
+// Returns true if a message was delivered, in which case dst need not
+// block.
+bool
+ipc_recv_waiting(struct Env *dst)
+{
+	struct Env *ep = dst->env_ipc_endpoint;
+
+	if (ipc_recv_queued(dst, dst))
+		return true;
+	return ep && ep != dst && ipc_recv_queued(dst, ep);
+}
+
+// Set 'bits' in e's pending notifications.  If e is blocked in
+// sys_ipc_notify_wait(), wake it and hand them over.
+void
+ipc_notify(struct Env *e, uint32_t bits)
+{
+	spin_lock(NOTIFY_LOCK(e));
+	e->env_notify_pending |= bits;
+	if (!e->env_notify_waiting) {
+		spin_unlock(NOTIFY_LOCK(e));
+		return;
+	}
+	e->env_notify_waiting = false;
+	e->env_tf.tf_regs.reg_rax = e->env_notify_pending;
+	e->env_notify_pending = 0;
+	spin_unlock(NOTIFY_LOCK(e));
+	sched_wakeup(e);
+}
+
+// Send 'bits' to the env 'envid' without the big kernel lock, unless
+// that would wake it.  Returns false if envid is blocked in
+// sys_ipc_notify_wait(), and the caller must use ipc_notify() under
+// the lock instead; otherwise true, with 0 or -E_BAD_ENV in *r.
+bool
+ipc_notify_nolock(envid_t envid, uint32_t bits, int *r)
+{
+	struct Env *e;
+
+	if ((*r = envid2env(envid, &e, 0)) < 0)
+		return true;
+	spin_lock(NOTIFY_LOCK(e));
+	// e may have been freed, or its slot reused, since envid2env.
+	if (e->env_id != envid && envid != 0) {
+		spin_unlock(NOTIFY_LOCK(e));
+		*r = -E_BAD_ENV;
+		return true;
+	}
+	if (e->env_notify_waiting) {
+		spin_unlock(NOTIFY_LOCK(e));
+		return false;
+	}
+	e->env_notify_pending |= bits;
+	spin_unlock(NOTIFY_LOCK(e));
+	return true;
+}
+
+// Return and clear curenv's pending notifications, blocking until
+// there are some.
+int
+ipc_notify_wait(void)
+{
+	uint32_t bits;
+
+	spin_lock(NOTIFY_LOCK(curenv));
+	if ((bits = curenv->env_notify_pending)) {
+		curenv->env_notify_pending = 0;
+		spin_unlock(NOTIFY_LOCK(curenv));
+		return bits;
+	}
+	curenv->env_notify_waiting = true;
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	spin_unlock(NOTIFY_LOCK(curenv));
+	sched_yield();
+}
+
+// Return and clear curenv's pending notifications without the big
+// kernel lock.  Returns 0 if there are none, and curenv must block in
+// ipc_notify_wait() instead.
+uint32_t
+ipc_notify_take(void)
+{
+	uint32_t bits;
+
+	spin_lock(NOTIFY_LOCK(curenv));
+	bits = curenv->env_notify_pending;
+	curenv->env_notify_pending = 0;
+	spin_unlock(NOTIFY_LOCK(curenv));
+	return bits;
+}
+
+// 'e' has just been given a new env_id.  Drop any notifications that
+// ipc_notify_nolock() sent its slot's previous env after that was
+// freed.
+void
+ipc_env_alloc(struct Env *e)
+{
+	spin_lock(NOTIFY_LOCK(e));
+	e->env_notify_pending = 0;
+	e->env_notify_waiting = false;
+	spin_unlock(NOTIFY_LOCK(e));
+}
+
+// 'e' is being freed.  Take it off the queue it is waiting on, if any,
+// and fail the sends of everyone waiting for it and the calls of
+// everyone waiting for its reply.  A call to an endpoint waits for the
+// reply of the member that took it, so it fails if that member dies,
+// or if the endpoint dies, which leaves the member's reply nowhere to
+// go.
+void
+ipc_env_free(struct Env *e)
+{
+	struct Env *ep = e->env_ipc_endpoint, **pp, *m, *c, *next;
+
+	if (e->env_ipc_sendto)
+		ipc_waitq_remove(e);
+	ipc_idle_remove(e);
+	ipc_caller_remove(e);
+	while ((c = e->env_ipc_callers))
+		ipc_caller_fail(c);
+	e->env_ipc_recving = 0;
+	spin_lock(NOTIFY_LOCK(e));
+	e->env_notify_pending = 0;
+	e->env_notify_waiting = false;
+	spin_unlock(NOTIFY_LOCK(e));
+	while (e->env_ipc_waitq_head)
+		ipc_send_finish(e->env_ipc_waitq_head, -E_BAD_ENV);
+
+	if (ep && ep != e) {
+		for (pp = &ep->env_ipc_members; *pp != e;
+		     pp = &(*pp)->env_ipc_member_next)
+			assert(*pp);
+		*pp = e->env_ipc_member_next;
+	}
+	// Members of e's endpoint go back to receiving only for
+	// themselves.
+	while ((m = e->env_ipc_members)) {
+		e->env_ipc_members = m->env_ipc_member_next;
+		for (c = m->env_ipc_callers; c; c = next) {
+			next = c->env_ipc_caller_next;
+			if (c->env_ipc_recvfrom == e->env_id)
+				ipc_caller_fail(c);
+		}
+		m->env_ipc_endpoint = NULL;
+		m->env_ipc_idle = false;
+		m->env_ipc_idle_next = NULL;
+		m->env_ipc_member_next = NULL;
+	}
+	e->env_ipc_endpoint = NULL;
+	e->env_ipc_idle_head = NULL;
+	e->env_ipc_member_next = NULL;
+}
+
+// Fail the sends whose timeout has expired.  Called from the
+// scheduler; the scan over all environments only happens when the
+// earliest deadline has passed.
+void
+ipc_timeout_check(void)
+{
+	unsigned now, next = 0;
+	bool found = false;
+	struct Env *s;
+	int i;
+
+	if (!ipc_ntimeouts)
+		return;
+	now = time_msec();
+	if ((int) (ipc_next_deadline - now) > 0)
+		return;
+
+	for (i = 0; i < NENV && ipc_ntimeouts; i++) {
+		s = &envs[i];
+		if (!s->env_ipc_send_timed)
+			continue;
+		if ((int) (s->env_ipc_send_deadline - now) <= 0)
+			ipc_send_finish(s, -E_IPC_NOT_RECV);
+		else if (!found || (int) (s->env_ipc_send_deadline - next) < 0) {
+			next = s->env_ipc_send_deadline;
+			found = true;
+		}
+	}
+	ipc_next_deadline = next;
+}
+
+// Milliseconds until the earliest send timeout, at least 1, or 0 if
+// no send has a timeout.  Idle CPUs keep their timer running for it.
+unsigned
+ipc_timeout_next(void)
+{
+	int left;
+
+	if (!ipc_ntimeouts)
+		return 0;
+	left = ipc_next_deadline - time_msec();
+	return left > 0 ? left : 1;
+}
@@ -0,0 +1,36 @@
+#line 2 "../kern/ipc.h"
+#ifndef JOS_KERN_IPC_H
+#define JOS_KERN_IPC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+
+void ipc_init(void);
+int ipc_set_dstva(struct Env *e, void *dstva);
+int ipc_send_prepare(void *srcva, unsigned perm);
+int ipc_deliver(struct Env *src, struct Env *dst, uint32_t value,
+		void *srcva, unsigned perm);
+bool ipc_recving_from(struct Env *dst, struct Env *src);
+struct Env *ipc_endpoint_pick(struct Env *dst);
+int ipc_join(struct Env *m);
+void ipc_send_cancel(struct Env *s);
+int ipc_send_wait(struct Env *dst, uint32_t value, void *srcva,
+		  unsigned perm, unsigned timeout_ms);
+int ipc_call(struct Env *dst, uint32_t value, void *srcva, unsigned perm,
+	     void *dstva);
+int ipc_reply_recv(struct Env *to, uint32_t value, void *srcva,
+		   unsigned perm, void *dstva);
+int ipc_recv(void *dstva);
+bool ipc_recv_waiting(struct Env *dst);
+void ipc_notify(struct Env *e, uint32_t bits);
+bool ipc_notify_nolock(envid_t envid, uint32_t bits, int *r);
+int ipc_notify_wait(void);
+uint32_t ipc_notify_take(void);
+void ipc_env_alloc(struct Env *e);
+void ipc_env_free(struct Env *e);
+void ipc_timeout_check(void);
+unsigned ipc_timeout_next(void);
+
+#endif /* !JOS_KERN_IPC_H */
@@ -0,0 +1,343 @@
+#line 2 "../kern/kmalloc.c"
+// Allocation of small kernel objects.
+//
+// Objects of up to KMALLOC_SLAB_MAX bytes are rounded up to a power of
+// two size class and carved out of slab pages: single pages from
+// page_alloc, each holding objects of one class.  An object is aligned
+// to its size, so it never crosses a page and is physically contiguous.
+// A slab page's state lives in its struct PageInfo (see PP_SLAB); the
+// slabs of a class with free objects are on its kc_partial list, and
+// a slab goes back to page_free as soon as it is empty.
+//
+// Each CPU keeps a magazine of free objects per class, in front of
+// the slabs, as page_alloc keeps a cache of pages.  kmalloc and kfree
+// only use the magazine, and take kmalloc_lock to move KMAG_BATCH
+// objects between it and the slabs when it runs empty or full.
+//
+// Larger requests get a block of pages from page_alloc_npages, marked
+// PP_KMALLOC so that kfree knows its order.
+
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/kmalloc.h>
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+#define KMEM_MIN_SHIFT	4	// Smallest class: 16 bytes
+#define KMEM_NCLASS	8	// 16 .. KMALLOC_SLAB_MAX bytes
+#define KMEM_SIZE(cls)	((size_t) 1 << (KMEM_MIN_SHIFT + (cls)))
+
+#define KMAG_SIZE	32	// Objects a magazine holds
+#define KMAG_BATCH	16	// Objects moved to or from the slabs at once
+
+static struct KmemClass {
+	struct PageInfo *kc_partial;	// Slabs with free objects
+	unsigned kc_nslabs;		// Slab pages in use
+} kmem_class[KMEM_NCLASS];
+
+// Protects kmem_class and the slab pages.
+static struct spinlock kmalloc_lock = {
+	.name = "kmalloc_lock"
+};
+
+struct KmemMagazine {
+	void *km_obj[KMAG_SIZE];
+	unsigned km_count;
+
+	// Statistics.  An object may be freed on another CPU than the one
+	// that allocated it, so only the sums over all CPUs mean much.
+	uint64_t km_nalloc;	// kmalloc calls
+	uint64_t km_nfree;	// kfree calls
+	uint64_t km_nrefill;	// kmalloc calls that found the magazine empty
+};
+
+static struct KmemCpu {
+	struct KmemMagazine kc_mag[KMEM_NCLASS];
+	uint64_t kc_nlarge;	// Large kmalloc calls
+	int64_t kc_large_pages;	// Pages allocated less pages freed
+} __attribute__((aligned(64))) kmem_cpu[NCPU];
+
+// Take an object of class 'cls' from a slab, starting a new slab if
+// none has a free object.  Returns NULL if out of memory.
+// The caller holds kmalloc_lock.
+static void *
+slab_alloc(int cls)
+{
+	struct KmemClass *kc = &kmem_class[cls];
+	size_t size = KMEM_SIZE(cls), off;
+	struct PageInfo *pp;
+	uint8_t *p;
+	void *obj;
+
+	if (!(pp = kc->kc_partial)) {
+		if (!(pp = page_alloc(0)))
+			return NULL;
+		p = page2kva(pp);
+		for (off = 0; off + size < PGSIZE; off += size)
+			*(void **) (p + off) = p + off + size;
+		*(void **) (p + off) = NULL;
+		pp->pp_flags |= PP_SLAB;
+		pp->pp_order = cls;
+		pp->pp_slab_inuse = 0;
+		pp->pp_slab_free = p;
+		pp->pp_link = NULL;
+		kc->kc_partial = pp;
+		kc->kc_nslabs++;
+	}
+
+	obj = pp->pp_slab_free;
+	pp->pp_slab_free = *(void **) obj;
+	pp->pp_slab_inuse++;
+	if (!pp->pp_slab_free) {
+		// Full: off the partial list.
+		kc->kc_partial = pp->pp_link;
+		pp->pp_link = NULL;
+	}
+	return obj;
+}
+
+// Return an object to its slab, and the slab to page_free if that
+// leaves it empty.  The caller holds kmalloc_lock.
+static void
+slab_free(void *obj)
+{
+	struct PageInfo *pp = pa2page(PADDR(obj)), **pl;
+	struct KmemClass *kc = &kmem_class[pp->pp_order];
+
+	if (!pp->pp_slab_free) {
+		// Was full: back on the partial list.
+		pp->pp_link = kc->kc_partial;
+		kc->kc_partial = pp;
+	}
+	*(void **) obj = pp->pp_slab_free;
+	pp->pp_slab_free = obj;
+	if (--pp->pp_slab_inuse > 0)
+		return;
+
+	for (pl = &kc->kc_partial; *pl != pp; pl = &(*pl)->pp_link)
+		/* do nothing */;
+	*pl = pp->pp_link;
+	pp->pp_link = NULL;
+	pp->pp_slab_free = NULL;
+	pp->pp_flags &= ~PP_SLAB;
+	kc->kc_nslabs--;
+	page_free(pp);
+}
+
+static void *
+kmalloc_large(size_t size, int alloc_flags)
+{
+	struct KmemCpu *kc = &kmem_cpu[cpunum()];
+	struct PageInfo *pp;
+	unsigned order;
+
+	for (order = 0; (PGSIZE << order) < size; order++)
+		if (order == PAGE_MAX_ORDER)
+			return NULL;
+	if (!(pp = page_alloc_npages(order, alloc_flags)))
+		return NULL;
+	pp->pp_flags |= PP_KMALLOC;
+	pp->pp_order = order;
+	kc->kc_nlarge++;
+	kc->kc_large_pages += 1 << order;
+	return page2kva(pp);
+}
+
+//
+// Allocate 'size' bytes of kernel memory, aligned to the smallest
+// power of two at least 'size', up to a page.  If (alloc_flags &
+// ALLOC_ZERO), they are cleared.  Free them with kfree.
+//
+// Returns NULL if out of memory.
+//
+void *
+kmalloc(size_t size, int alloc_flags)
+{
+	struct KmemMagazine *m;
+	void *obj;
+	int cls;
+
+	if (size > KMALLOC_SLAB_MAX)
+		return kmalloc_large(size, alloc_flags);
+
+	for (cls = 0; KMEM_SIZE(cls) < size; cls++)
+		/* do nothing */;
+	m = &kmem_cpu[cpunum()].kc_mag[cls];
+	if (m->km_count == 0) {
+		m->km_nrefill++;
+		spin_lock(&kmalloc_lock);
+		while (m->km_count < KMAG_BATCH && (obj = slab_alloc(cls)))
+			m->km_obj[m->km_count++] = obj;
+		spin_unlock(&kmalloc_lock);
+		if (m->km_count == 0)
+			return NULL;
+	}
+	obj = m->km_obj[--m->km_count];
+	m->km_nalloc++;
+
+	if (alloc_flags & ALLOC_ZERO)
+		memset(obj, 0, size);
+	return obj;
+}
+
+//
+// Free memory from kmalloc.  kfree(NULL) does nothing.
+//
+void
+kfree(void *p)
+{
+	struct KmemCpu *kc = &kmem_cpu[cpunum()];
+	struct PageInfo *pp;
+	struct KmemMagazine *m;
+
+	if (!p)
+		return;
+	pp = pa2page(PADDR(p));
+
+	if (pp->pp_flags & PP_KMALLOC) {
+		if (p != page2kva(pp))
+			panic("kfree: %p is inside a kmalloc block", p);
+		pp->pp_flags &= ~PP_KMALLOC;
+		kc->kc_large_pages -= 1 << pp->pp_order;
+		page_free_npages(pp, pp->pp_order);
+		return;
+	}
+	if (!(pp->pp_flags & PP_SLAB)
+	    || ((uintptr_t) p & (KMEM_SIZE(pp->pp_order) - 1)))
+		panic("kfree: %p is not from kmalloc", p);
+
+	m = &kc->kc_mag[pp->pp_order];
+	if (m->km_count == KMAG_SIZE) {
+		spin_lock(&kmalloc_lock);
+		while (m->km_count > KMAG_SIZE - KMAG_BATCH)
+			slab_free(m->km_obj[--m->km_count]);
+		spin_unlock(&kmalloc_lock);
+	}
+	m->km_obj[m->km_count++] = p;
+	m->km_nfree++;
+}
+
+//
+// Print, for each size class, the slab pages it uses, its objects in
+// use and waiting in magazines, its kmalloc calls and how many of
+// them the magazines satisfied; then the same for large blocks.
+//
+void
+kmalloc_stats(void)
+{
+	uint64_t nalloc, nfree, nrefill, nlarge;
+	int64_t large_pages;
+	unsigned cached;
+	int cls, i;
+
+	cprintf("%-8s %6s %8s %8s %12s %6s\n", "size", "slabs",
+		"in-use", "cached", "allocs", "hit%");
+	for (cls = 0; cls < KMEM_NCLASS; cls++) {
+		nalloc = nfree = nrefill = 0;
+		cached = 0;
+		for (i = 0; i < NCPU; i++) {
+			struct KmemMagazine *m = &kmem_cpu[i].kc_mag[cls];
+
+			nalloc += m->km_nalloc;
+			nfree += m->km_nfree;
+			nrefill += m->km_nrefill;
+			cached += m->km_count;
+		}
+		cprintf("%-8d %6d %8lld %8d %12llu %6d\n", (int) KMEM_SIZE(cls),
+			kmem_class[cls].kc_nslabs, (int64_t) (nalloc - nfree),
+			cached, nalloc,
+			nalloc ? (int) (100 - nrefill * 100 / nalloc) : 0);
+	}
+
+	nlarge = 0;
+	large_pages = 0;
+	for (i = 0; i < NCPU; i++) {
+		nlarge += kmem_cpu[i].kc_nlarge;
+		large_pages += kmem_cpu[i].kc_large_pages;
+	}
+	cprintf("large: %lld pages in use, %llu allocs\n", large_pages, nlarge);
+}
+
+//
+// Check kmalloc and kfree: objects of every size class, refilling and
+// draining the magazines, slabs going back to page_free once empty,
+// large blocks, and ALLOC_ZERO.  Called at boot, before anything else
+// has used kmalloc.
+//
+void
+check_kmalloc(void)
+{
+	struct KmemCpu *kc = &kmem_cpu[cpunum()];
+	struct KmemMagazine *m;
+	struct PageInfo *pp;
+	void *obj[KMAG_SIZE + KMAG_BATCH];
+	uint8_t *c;
+	size_t size, j;
+	int64_t large_pages;
+	int cls, i;
+
+	for (cls = 0; cls < KMEM_NCLASS; cls++) {
+		size = KMEM_SIZE(cls);
+		m = &kc->kc_mag[cls];
+		assert(m->km_count == 0 && kmem_class[cls].kc_nslabs == 0);
+
+		// enough objects to refill the magazine several times; half
+		// of the requests are rounded up to the class
+		for (i = 0; i < KMAG_SIZE + KMAG_BATCH; i++) {
+			assert((obj[i] = kmalloc(i % 2 ? size : size / 2 + 1, 0)));
+			if (i == 0)
+				assert(m->km_count == KMAG_BATCH - 1);
+			assert((uintptr_t) obj[i] % size == 0);
+			pp = pa2page(PADDR(obj[i]));
+			assert((pp->pp_flags & PP_SLAB) && pp->pp_order == cls);
+			memset(obj[i], i, size);
+		}
+		assert(m->km_count == 0);
+		assert(kmem_class[cls].kc_nslabs >= (KMAG_SIZE + KMAG_BATCH) * size / PGSIZE);
+
+		// no two objects overlap
+		for (i = 0; i < KMAG_SIZE + KMAG_BATCH; i++)
+			for (c = obj[i], j = 0; j < size; j++)
+				assert(c[j] == (uint8_t) i);
+
+		// freeing them all overflows the magazine once, which
+		// drains KMAG_BATCH objects back to their slabs
+		for (i = 0; i < KMAG_SIZE + KMAG_BATCH; i++)
+			kfree(obj[i]);
+		assert(m->km_count == KMAG_SIZE);
+
+		// ALLOC_ZERO clears a recycled object
+		assert((c = kmalloc(size, ALLOC_ZERO)) == obj[KMAG_SIZE + KMAG_BATCH - 1]);
+		for (j = 0; j < size; j++)
+			assert(c[j] == 0);
+		kfree(c);
+
+		// once the magazine is drained, every slab is empty and
+		// has gone back to page_free
+		spin_lock(&kmalloc_lock);
+		while (m->km_count > 0)
+			slab_free(m->km_obj[--m->km_count]);
+		spin_unlock(&kmalloc_lock);
+		assert(kmem_class[cls].kc_nslabs == 0 && !kmem_class[cls].kc_partial);
+		for (i = 0; i < KMAG_SIZE + KMAG_BATCH; i++)
+			assert(!(pa2page(PADDR(obj[i]))->pp_flags & PP_SLAB));
+	}
+
+	// a large block is whole pages, zeroed with ALLOC_ZERO
+	large_pages = kc->kc_large_pages;
+	assert((c = kmalloc(3 * PGSIZE, ALLOC_ZERO)));
+	assert(PGOFF(c) == 0);
+	pp = pa2page(PADDR(c));
+	assert((pp->pp_flags & PP_KMALLOC) && pp->pp_order == 2);
+	assert(kc->kc_large_pages == large_pages + 4);
+	for (j = 0; j < 4 * PGSIZE; j++)
+		assert(c[j] == 0);
+	kfree(c);
+	assert(!(pp->pp_flags & PP_KMALLOC));
+	assert(kc->kc_large_pages == large_pages);
+	kfree(NULL);
+
+	cprintf("check_kmalloc() succeeded!\n");
+}
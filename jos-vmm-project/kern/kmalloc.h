@@ -0,0 +1,19 @@
+#line 2 "../kern/kmalloc.h"
+#ifndef JOS_KERN_KMALLOC_H
+#define JOS_KERN_KMALLOC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Largest object that comes from a slab; larger requests get whole
+// pages from page_alloc_npages.
+#define KMALLOC_SLAB_MAX	2048
+
+void *kmalloc(size_t size, int alloc_flags);
+void kfree(void *p);
+void kmalloc_stats(void);
+void check_kmalloc(void);
+
+#endif /* JOS_KERN_KMALLOC_H */
@@ -1,6 +1,10 @@
 #line 2 "../kern/lapic.c"
 // The local APIC manages internal (non-I/O) interrupts.
 // See Chapter 8 & Appendix C of Intel processor manual volume 3.
+//
+// If the CPU has it, the LAPIC runs in x2APIC mode, in which its
+// registers are MSRs rather than uncached MMIO, and an IPI is a single
+// write of the 64-bit ICR.  Otherwise it is driven through xAPIC MMIO.
 
 #include <inc/types.h>
 #include <inc/memlayout.h>
@@ -8,6 +12,7 @@
 #include <inc/mmu.h>
 #include <inc/stdio.h>
 #include <inc/x86.h>
+#include <inc/assert.h>
 #include <kern/pmap.h>
 #include <kern/cpu.h>
 
@@ -43,36 +48,135 @@
 #define TCCR    (0x0390/4)   // Timer Current Count
 #define TDCR    (0x03E0/4)   // Timer Divide Configuration
 
+// The timer counts down at bus frequency.  We don't calibrate it
+// against an external time source; like the old fixed setting of
+// TICR = 10000000 for a 10ms tick, we assume 1000000 counts per ms.
+#define TIMER_COUNTS_PER_MS	1000000
+
+// In x2APIC mode, the register at MMIO offset 16*i is MSR 0x800+i,
+// and the ICR is one 64-bit register with the destination in the high
+// half.
+#define X2APIC_MSR(index)	(0x800 + (index) / 4)
+#define APIC_BASE_MSR		0x1B
+#define APIC_BASE_EN		0x800	// xAPIC global enable
+#define APIC_BASE_EXTD		0x400	// x2APIC mode
+
 physaddr_t lapicaddr;        // Initialized in mpconfig.c
 volatile uint32_t *lapic;
+uint64_t lapic_tsc_per_ms;   // TSC rate, measured in lapic_init()
+static bool x2apic;          // Set by the BSP's lapic_init()
+
+#define LAPIC_BENCH_N	10000
 
 static void
 lapicw(int index, int value)
 {
+	if (x2apic) {
+		write_msr(X2APIC_MSR(index), (uint32_t) value);
+		return;
+	}
 	lapic[index] = value;
 	lapic[ID];  // wait for write to finish, by reading
 }
 
+static uint32_t
+lapicr(int index)
+{
+	if (x2apic)
+		return read_msr(X2APIC_MSR(index));
+	return lapic[index];
+}
+
+// Switch this CPU's LAPIC to x2APIC mode, if it is not there yet.
+static void
+x2apic_enable(void)
+{
+	uint64_t base = read_msr(APIC_BASE_MSR);
+
+	if (!(base & APIC_BASE_EXTD))
+		write_msr(APIC_BASE_MSR, base | APIC_BASE_EN | APIC_BASE_EXTD);
+}
+
+// This CPU's local APIC ID, or 0 if there is no LAPIC.
+static int
+lapic_id(void)
+{
+	if (x2apic) {
+		// An AP asks before its lapic_init().
+		x2apic_enable();
+		return lapicr(ID);
+	}
+	return lapic ? lapic[ID] >> 24 : 0;
+}
+
+// Write the interrupt command register, sending an IPI to the LAPIC
+// with ID 'apicid', or to those that 'icrlo' names in shorthand.
+static void
+lapic_icr(uint32_t apicid, uint32_t icrlo)
+{
+	if (x2apic) {
+		write_msr(X2APIC_MSR(ICRLO), ((uint64_t) apicid << 32) | icrlo);
+		return;
+	}
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, icrlo);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
+
+// Measure how fast the TSC runs against one millisecond of the
+// (masked) timer, so time_msec() can read the time from the TSC
+// instead of counting timer interrupts.
+static void
+lapic_calibrate_tsc(void)
+{
+	uint64_t tsc;
+
+	lapicw(TIMER, MASKED | (IRQ_OFFSET + IRQ_TIMER));
+	lapicw(TICR, TIMER_COUNTS_PER_MS);
+	tsc = read_tsc();
+	while (lapicr(TCCR) != 0)
+		;
+	lapic_tsc_per_ms = read_tsc() - tsc;
+}
+
 void
 lapic_init(void)
 {
+#ifndef VMM_GUEST
+	uint32_t ecx;
+#endif
+
 	if (!lapicaddr)
 		return;
 
 	// lapicaddr is the physical address of the LAPIC's 4K MMIO
 	// region.  Map it in to virtual memory so we can access it.
+	// In x2APIC mode it is unused, but lapic still says we have one.
 	lapic = mmio_map_region(lapicaddr, 4096);
 
+#ifndef VMM_GUEST
+	// The VMM does not emulate the x2APIC MSRs for a guest kernel.
+	if (thiscpu == bootcpu) {
+		cpuid(1, NULL, NULL, &ecx, NULL);
+		x2apic = ecx & (1 << 21);
+	}
+	if (x2apic)
+		x2apic_enable();
+#endif
+
 	// Enable local APIC; set spurious interrupt vector.
 	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
 
-	// The timer repeatedly counts down at bus frequency
-	// from lapic[TICR] and then issues an interrupt.  
-	// If we cared more about precise timekeeping,
-	// TICR would be calibrated using an external time source.
+	// The timer runs in one-shot mode: it counts down once at bus
+	// frequency from lapic[TICR] and then issues an interrupt.
+	// The scheduler arms it for a timeslice each time it dispatches
+	// an environment, and leaves it stopped while the CPU is idle.
 	lapicw(TDCR, X1);
-	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
-	lapicw(TICR, 10000000); 
+	if (thiscpu == bootcpu)
+		lapic_calibrate_tsc();
+	lapicw(TIMER, IRQ_OFFSET + IRQ_TIMER);
+	lapicw(TICR, 0);
 
 	// Leave LINT0 of the BSP enabled so that it can get
 	// interrupts from the 8259A chip.
@@ -89,7 +193,7 @@ lapic_init(void)
 
 	// Disable performance counter overflow interrupts
 	// on machines that provide that interrupt entry.
-	if (((lapic[VER]>>16) & 0xFF) >= 4)
+	if (((lapicr(VER)>>16) & 0xFF) >= 4)
 		lapicw(PCINT, MASKED);
 
 	// Map error interrupt to IRQ_ERROR.
@@ -103,21 +207,42 @@ lapic_init(void)
 	lapicw(EOI, 0);
 
 	// Send an Init Level De-Assert to synchronize arbitration ID's.
-	lapicw(ICRHI, 0);
-	lapicw(ICRLO, BCAST | INIT | LEVEL);
-	while(lapic[ICRLO] & DELIVS)
-		;
+	// x2APIC has no arbitration IDs, and does not allow it.
+	if (!x2apic)
+		lapic_icr(0, BCAST | INIT | LEVEL);
 
 	// Enable interrupts on the APIC (but not on the processor).
 	lapicw(TPR, 0);
 }
 
+#ifdef VMM_GUEST
 int
 cpunum(void)
 {
-	if (lapic)
-		return lapic[ID] >> 24;
-	return 0;
+	return lapic_id();
+}
+#endif
+
+// Point this CPU's GS base at its struct CpuInfo, found from its local
+// APIC ID (CPU 0 until the LAPIC is mapped), so that thiscpu and
+// cpunum() read memory rather than the LAPIC.  The user's GS base, 0,
+// waits in KERNEL_GS_BASE; swapgs exchanges the two whenever the CPU
+// enters the kernel from user mode or returns to it.  Loading the GS
+// selector clears its base, so call this again after doing so.
+void
+cpu_init_gs(void)
+{
+#ifndef VMM_GUEST
+	int i = lapic_id();
+	struct CpuInfo *c = &cpus[i];
+
+	static_assert(offsetof(struct CpuInfo, cpu_self) == CPU_SELF);
+	static_assert(offsetof(struct CpuInfo, cpu_kstacktop) == CPU_KSTACKTOP);
+	c->cpu_self = c;
+	c->cpu_kstacktop = KSTACKTOP - i * (KSTKSIZE + KSTKGAP);
+	write_msr(GS_BASE_MSR, (uint64_t) c);
+	write_msr(KERNEL_GS_BASE_MSR, 0);
+#endif
 }
 
 // Acknowledge interrupt.
@@ -156,10 +281,10 @@ lapic_startap(uint8_t apicid, uint32_t addr)
 
 	// "Universal startup algorithm."
 	// Send INIT (level-triggered) interrupt to reset other CPU.
-	lapicw(ICRHI, apicid << 24);
-	lapicw(ICRLO, INIT | LEVEL | ASSERT);
+	lapic_icr(apicid, INIT | LEVEL | ASSERT);
 	microdelay(200);
-	lapicw(ICRLO, INIT | LEVEL);
+	if (!x2apic)
+		lapic_icr(apicid, INIT | LEVEL);
 	microdelay(100);    // should be 10ms, but too slow in Bochs!
 
 	// Send startup IPI (twice!) to enter code.
@@ -168,16 +293,76 @@ lapic_startap(uint8_t apicid, uint32_t addr)
 	// should be ignored, but it is part of the official Intel algorithm.
 	// Bochs complains about the second one.  Too bad for Bochs.
 	for (i = 0; i < 2; i++) {
-		lapicw(ICRHI, apicid << 24);
-		lapicw(ICRLO, STARTUP | (addr >> 12));
+		lapic_icr(apicid, STARTUP | (addr >> 12));
 		microdelay(200);
 	}
 }
 
+// Arm the timer to interrupt this CPU once, 'ms' milliseconds
+// from now.
+void
+lapic_timer_oneshot(uint32_t ms)
+{
+	if (!lapic)
+		return;
+	if (ms == 0)
+		ms = 1;
+	if (ms > 0xffffffff / TIMER_COUNTS_PER_MS)
+		ms = 0xffffffff / TIMER_COUNTS_PER_MS;
+	lapicw(TICR, ms * TIMER_COUNTS_PER_MS);
+}
+
+// Stop this CPU's timer.
+void
+lapic_timer_stop(void)
+{
+	if (lapic)
+		lapicw(TICR, 0);
+}
+
+// Is this CPU's timer still counting down?
+bool
+lapic_timer_pending(void)
+{
+	return lapic && lapicr(TCCR) != 0;
+}
+
+// Send an interrupt to the CPU with local APIC ID 'apicid'.
+void
+lapic_ipi_cpu(int apicid, int vector)
+{
+	lapic_icr(apicid, FIXED | vector);
+}
+
 void
 lapic_ipi(int vector)
 {
-	lapicw(ICRLO, OTHERS | FIXED | vector);
-	while (lapic[ICRLO] & DELIVS)
-		;
+	lapic_icr(0, OTHERS | FIXED | vector);
+}
+
+// Time EOIs, and IPIs sent by this CPU to itself, for the monitor's
+// lapicbench command.  The IPIs use IRQ_TLB, which is harmless when
+// nothing is asked of this CPU; they arrive as one interrupt once
+// interrupts are next enabled.
+void
+lapic_bench(void)
+{
+	uint64_t tsc, eoi, ipi;
+	int i;
+
+	if (!lapic) {
+		cprintf("No local APIC\n");
+		return;
+	}
+	tsc = read_tsc();
+	for (i = 0; i < LAPIC_BENCH_N; i++)
+		lapic_eoi();
+	eoi = read_tsc() - tsc;
+	tsc = read_tsc();
+	for (i = 0; i < LAPIC_BENCH_N; i++)
+		lapic_ipi_cpu(lapic_id(), IRQ_OFFSET + IRQ_TLB);
+	ipi = read_tsc() - tsc;
+	cprintf("%s: EOI %d cycles, self-IPI %d cycles\n",
+		x2apic ? "x2APIC" : "xAPIC", (int) (eoi / LAPIC_BENCH_N),
+		(int) (ipi / LAPIC_BENCH_N));
 }
@@ -15,6 +15,10 @@
 #line 16 "../kern/monitor.c"
 #include <kern/trap.h>
 #line 18 "../kern/monitor.c"
+#include <kern/spinlock.h>
+#include <kern/sched.h>
+#include <kern/cpu.h>
+#include <kern/kmalloc.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -34,6 +38,10 @@ static struct Command commands[] = {
 	{ "kerninfo", "Display information about the kernel", mon_kerninfo },
 #line 36 "../kern/monitor.c"
 	{ "backtrace", "Display a stack backtrace", mon_backtrace },
+	{ "lockstat", "Display spinlock contention statistics ('lockstat reset' clears them)", mon_lockstat },
+	{ "timeslice", "Display or set the scheduler timeslice in ms", mon_timeslice },
+	{ "lapicbench", "Time local APIC EOIs and IPIs on this CPU", mon_lapicbench },
+	{ "kmstat", "Display kmalloc statistics", mon_kmstat },
 #line 39 "../kern/monitor.c"
 #ifdef VMM_GUEST
 	{ "exit", "Exit VMM guest", mon_exit },
@@ -170,6 +178,46 @@ unknown_cfa:
 	return 0;
 }
 
+int
+mon_lockstat(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc > 1 && strcmp(argv[1], "reset") == 0)
+		spin_lockstat_reset();
+	else
+		spin_lockstat_print();
+	return 0;
+}
+
+int
+mon_timeslice(int argc, char **argv, struct Trapframe *tf)
+{
+	long ms;
+
+	if (argc > 1) {
+		if ((ms = strtol(argv[1], NULL, 0)) <= 0) {
+			cprintf("Usage: timeslice [ms]\n");
+			return 0;
+		}
+		sched_timeslice_ms = ms;
+	}
+	cprintf("timeslice %u ms\n", sched_timeslice_ms);
+	return 0;
+}
+
+int
+mon_lapicbench(int argc, char **argv, struct Trapframe *tf)
+{
+	lapic_bench();
+	return 0;
+}
+
+int
+mon_kmstat(int argc, char **argv, struct Trapframe *tf)
+{
+	kmalloc_stats();
+	return 0;
+}
+
 #line 177 "../kern/monitor.c"
 int
 mon_exit(int argc, char** argv, struct Trapframe* tf)
@@ -14,6 +14,8 @@
 #include <kern/env.h>
 #line 17 "../kern/pmap.c"
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/kmalloc.h>
 #line 19 "../kern/pmap.c"
 
 extern uint64_t pml4phys;
@@ -28,7 +30,84 @@ static size_t npages_basemem;	// Amount of base memory (in pages)
 pml4e_t *boot_pml4e;		// Kernel's initial page directory
 physaddr_t boot_cr3;		// Physical address of boot time page directory
 struct PageInfo *pages;		// Physical page state array
-static struct PageInfo *page_free_list;	// Free list of physical pages
+
+// A page of zeroes that sys_page_alloc maps read-only with PTE_ZERO in
+// place of a new page; see page_lazy_alloc.  It can be mapped more
+// times than pp_ref counts, so it is pinned: its pp_ref stays at 1, and
+// page_insert and page_decref leave it alone.
+struct PageInfo *zero_page;
+
+// sys_fork shares a lazily allocated PTE_SHARE page that is still the
+// zero page through a LazyShare, and the first env to touch it
+// allocates ls_page for all of them.  A PTE that refers to a LazyShare
+// is not present (see PTE_LAZYSHARE): kmalloc aligns a LazyShare to 16
+// bytes, so its physical address, shifted up by LAZYSHARE_SHIFT, fits
+// in the PTE's address field.
+struct LazyShare {
+	struct PageInfo *ls_page;	// The page, once allocated
+	uint32_t ls_ref;		// PTEs that refer to this
+};
+
+#define LAZYSHARE_SHIFT		8
+#define LAZYSHARE_PTE(ls)	((pte_t) PADDR(ls) << LAZYSHARE_SHIFT)
+#define LAZYSHARE(pte) \
+	((struct LazyShare *) KADDR(PTE_ADDR(pte) >> LAZYSHARE_SHIFT))
+
+// Set by tlb_init_percpu if CR3 loads use PCIDs.
+static bool pcid_enabled;
+
+// Serializes CPUs sending TLB shootdowns; see tlb_shootdown.
+static struct spinlock tlb_lock = {
+	.name = "tlb_lock"
+};
+
+// Free physical memory is managed by a buddy allocator: a free block
+// of 2^i pages, aligned to its size, is on page_free_area[i], and is
+// merged with its buddy when both are free.
+static struct PageInfo *page_free_area[PAGE_MAX_ORDER + 1];
+
+// Protects page_free_area.  Taken on its own, without the big kernel
+// lock, by system calls that only change the caller's address space.
+static struct spinlock page_lock = {
+	.name = "page_lock"
+};
+
+// Single pages are allocated and freed through a cache on each CPU,
+// refilled from and drained to the buddy allocator PAGE_CACHE_BATCH
+// pages at a time, so most page_alloc and page_free calls touch
+// neither page_lock nor another CPU's cache lines.  The kernel is not
+// preemptible, so a CPU's cache needs no lock.
+#define PAGE_CACHE_HIGH		64
+#define PAGE_CACHE_BATCH	16
+
+static struct PageCache {
+	struct PageInfo *pc_list;	// Free pages, linked through pp_link
+	unsigned pc_count;
+	struct PageInfo *pc_zero;	// Pre-zeroed pages from page_zero_pool
+	unsigned pc_nzero;
+} __attribute__((aligned(64))) page_cache[NCPU];
+
+// Pages that idle CPUs have already zeroed, so page_alloc(ALLOC_ZERO)
+// need not clear a page on the fault or fork path.  Filled up to
+// PAGE_ZERO_POOL_MAX pages by page_zero_idle; protected by page_lock.
+// page_alloc takes them from its CPU's pc_zero, which it refills from
+// the pool PAGE_CACHE_BATCH pages at a time, as it does pc_list.
+#define PAGE_ZERO_POOL_MAX	256
+
+static struct PageInfo *page_zero_pool;
+static unsigned page_zero_count;
+
+// PML4s of freed user address spaces, kept by pml4e_free for
+// pml4e_alloc: each still shares the kernel's half, maps itself at
+// UVPT, and has an empty PDPE for the user half, so a new environment
+// starts with neither to allocate nor to zero.  One cache per CPU,
+// with no lock, like page_cache.
+#define PML4_CACHE_MAX		4
+
+static struct Pml4Cache {
+	pml4e_t *pc_pml4e[PML4_CACHE_MAX];
+	unsigned pc_count;
+} __attribute__((aligned(64))) pml4_cache[NCPU];
 
 // --------------------------------------------------------------
 // Detect machine's physical memory setup.
@@ -186,11 +265,19 @@ i386_detect_memory(void)
 static void mem_init_mp(void);
 #line 189 "../kern/pmap.c"
 static void boot_map_region(pml4e_t *pml4e, uintptr_t va, size_t size, physaddr_t pa, int perm);
-static void check_page_free_list(bool only_low_memory);
+static void boot_map_region_large(pml4e_t *pml4e, uintptr_t va, size_t size, physaddr_t pa, int perm);
+static void tlb_forget(physaddr_t cr3, bool keep_current);
+static void tlb_gather(physaddr_t cr3, uintptr_t start, uintptr_t end);
+static void tlb_page_decref(struct PageInfo *pp);
+static void page_free_unref(struct PageInfo *pp);
+static void lazyshare_decref(pte_t pte);
+static void check_page_free_list(void);
 static void check_page_alloc(void);
+static void check_page_zero(void);
 static void check_boot_pml4e(pml4e_t *pml4e);
 static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
 static void page_check(void);
+static void check_page_large(void);
 static void page_initpp(struct PageInfo *pp);
 // This simple physical memory allocator is used only while JOS is setting
 // up its virtual memory system.  page_alloc() is the real allocator.
@@ -203,7 +290,7 @@ static void page_initpp(struct PageInfo *pp);
 //
 // If we're out of memory, boot_alloc should panic.
 // This function may ONLY be used during initialization,
-// before the page_free_list list has been set up.
+// before the buddy allocator has been set up.
 static void *
 boot_alloc(uint32_t n)
 {
@@ -339,7 +426,7 @@ x64_vm_init(void)
 	//     Permissions: kernel RW, user NONE
 	// Your code goes here:
 #line 354 "../kern/pmap.c"
-	boot_map_region(boot_pml4e, KSTACKTOP-KSTKSIZE, KSTKSIZE, PADDR(bootstack), PTE_W|PTE_P);
+	boot_map_region(boot_pml4e, KSTACKTOP-KSTKSIZE, KSTKSIZE, PADDR(bootstack), PTE_W|PTE_P|PTE_G);
 #line 357 "../kern/pmap.c"
 
 #line 359 "../kern/pmap.c"
@@ -351,7 +438,9 @@ x64_vm_init(void)
 	// Permissions: kernel RW, user NONE
 	// Your code goes here: 
 #line 367 "../kern/pmap.c"
-	boot_map_region(boot_pml4e, KERNBASE, npages*PGSIZE, 0, PTE_W|PTE_P);
+	// The kernel's mappings are the same in every address space, so
+	// they are global and survive CR3 loads.
+	boot_map_region_large(boot_pml4e, KERNBASE, npages*PGSIZE, 0, PTE_W|PTE_P|PTE_G);
 #line 370 "../kern/pmap.c"
 	// Check that the initial page directory has been set up correctly.
 #line 372 "../kern/pmap.c"
@@ -364,7 +453,20 @@ x64_vm_init(void)
 	// Permissions: kernel RW, user NONE
 	pdpe_t *pdpe = KADDR(PTE_ADDR(pml4e[1]));
 	pde_t *pgdir = KADDR(PTE_ADDR(pdpe[0]));
+
+	if (!(zero_page = page_alloc(ALLOC_ZERO)))
+		panic("x64_vm_init: no memory for the zero page");
+	zero_page->pp_ref++;
+
 	lcr3(boot_cr3);
+	tlb_init_percpu();
+
+	// All of physical memory is mapped now, so the checks can touch
+	// every free page.
+	check_page_free_list();
+	check_page_alloc();
+	check_page_zero();
+	check_page_large();
 }
 
 
@@ -398,7 +500,7 @@ mem_init_mp(void)
 	for (i = 0; i < NCPU; i++) {
 		kstacktop = KSTACKTOP - (KSTKSIZE + KSTKGAP) * i;
 		boot_map_region(boot_pml4e, kstacktop - KSTKSIZE, KSTKSIZE,
-				PADDR(percpu_kstacks[i]), PTE_P|PTE_W);
+				PADDR(percpu_kstacks[i]), PTE_P|PTE_W|PTE_G);
 	}
 #line 425 "../kern/pmap.c"
 }
@@ -414,8 +516,142 @@ mem_init_mp(void)
 // Initialize page structure and memory free list.
 // After this is done, NEVER use boot_alloc again.  ONLY use the page
 // allocator functions below to allocate and deallocate physical
-// memory via the page_free_list.
+// memory via the buddy allocator.
 //
+// Put the free block of 2^order pages at 'pp' on its free list.
+static void
+buddy_push(struct PageInfo *pp, unsigned order)
+{
+	pp->pp_order = order;
+	pp->pp_flags |= PP_BUDDY;
+	pp->pp_prev = NULL;
+	pp->pp_link = page_free_area[order];
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp;
+	page_free_area[order] = pp;
+}
+
+// Take the free block at 'pp' off its free list.
+static void
+buddy_unlink(struct PageInfo *pp)
+{
+	if (pp->pp_prev)
+		pp->pp_prev->pp_link = pp->pp_link;
+	else
+		page_free_area[pp->pp_order] = pp->pp_link;
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp->pp_prev;
+	pp->pp_link = pp->pp_prev = NULL;
+	pp->pp_flags &= ~PP_BUDDY;
+}
+
+// Allocate a block of 2^order pages, splitting a larger block if there
+// is none of that size.  Returns NULL if there is no block big enough.
+// The caller holds page_lock.
+static struct PageInfo *
+buddy_alloc(unsigned order)
+{
+	struct PageInfo *pp;
+	unsigned o;
+
+	for (o = order; o <= PAGE_MAX_ORDER && !page_free_area[o]; o++)
+		/* do nothing */;
+	if (o > PAGE_MAX_ORDER)
+		return NULL;
+	pp = page_free_area[o];
+	buddy_unlink(pp);
+	// Give back the upper half until the block is the right size.
+	while (o > order) {
+		o--;
+		buddy_push(pp + (1 << o), o);
+	}
+	return pp;
+}
+
+// Free the block of 2^order pages at 'pp', merging it with its buddy
+// for as long as the buddy is free too.  The caller holds page_lock,
+// or is page_init.
+static void
+buddy_free(struct PageInfo *pp, unsigned order)
+{
+	ppn_t pn = page2ppn(pp), bn;
+	struct PageInfo *b;
+
+	for (; order < PAGE_MAX_ORDER; order++) {
+		bn = pn ^ (1 << order);
+		if (bn + (1 << order) > npages)
+			break;
+		b = &pages[bn];
+		if (!(b->pp_flags & PP_BUDDY) || b->pp_order != order)
+			break;
+		buddy_unlink(b);
+		pn &= ~(1 << order);
+	}
+	buddy_push(&pages[pn], order);
+}
+
+// Take a page off the pre-zeroed pool, or return NULL if it is empty.
+// The caller holds page_lock.
+static struct PageInfo *
+page_zero_pop(void)
+{
+	struct PageInfo *pp;
+
+	if ((pp = page_zero_pool)) {
+		page_zero_pool = pp->pp_link;
+		page_zero_count--;
+		pp->pp_link = NULL;
+	}
+	return pp;
+}
+
+// Move up to 'n' pages from the buddy allocator into cache 'pc'.
+// Pre-zeroed pages are used only once the buddy allocator runs dry.
+static void
+page_cache_refill(struct PageCache *pc, unsigned n)
+{
+	struct PageInfo *pp;
+
+	spin_lock(&page_lock);
+	for (; n > 0 && ((pp = buddy_alloc(0)) || (pp = page_zero_pop())); n--) {
+		pp->pp_link = pc->pc_list;
+		pc->pc_list = pp;
+		pc->pc_count++;
+	}
+	spin_unlock(&page_lock);
+}
+
+// Move up to 'n' pages from the pre-zeroed pool into cache 'pc'.
+static void
+page_cache_refill_zero(struct PageCache *pc, unsigned n)
+{
+	struct PageInfo *pp;
+
+	spin_lock(&page_lock);
+	for (; n > 0 && (pp = page_zero_pop()); n--) {
+		pp->pp_link = pc->pc_zero;
+		pc->pc_zero = pp;
+		pc->pc_nzero++;
+	}
+	spin_unlock(&page_lock);
+}
+
+// Give up to 'n' pages from cache 'pc' back to the buddy allocator.
+static void
+page_cache_drain(struct PageCache *pc, unsigned n)
+{
+	struct PageInfo *pp;
+
+	spin_lock(&page_lock);
+	for (; n > 0 && (pp = pc->pc_list); n--) {
+		pc->pc_list = pp->pp_link;
+		pc->pc_count--;
+		pp->pp_link = NULL;
+		buddy_free(pp, 0);
+	}
+	spin_unlock(&page_lock);
+}
+
 void
 page_init(void)
 {
@@ -428,7 +664,6 @@ page_init(void)
 	void *nextfree = boot_alloc(0);
 	size_t i;
 	int inuse;
-	struct PageInfo* last = NULL;
 	for (i = 0; i < npages; i++) {
 		// Off-limits until proven otherwise.
 		inuse = 1;
@@ -453,13 +688,8 @@ page_init(void)
 
 		pages[i].pp_ref = inuse;
 		pages[i].pp_link = NULL;
-		if (!inuse) {
-			if (last)
-				last->pp_link = &pages[i];
-			else
-				page_free_list = &pages[i];
-			last = &pages[i];
-		}
+		if (!inuse)
+			buddy_free(&pages[i], 0);
 
 	}
 
@@ -482,14 +712,37 @@ struct PageInfo *
 page_alloc(int alloc_flags)
 {
 #line 540 "../kern/pmap.c"
-	struct PageInfo *pp = page_free_list;
-	if (pp) {
-		//cprintf("alloc new page: struct page %x va %x pa %x \n", pp, page2kva(pp), page2pa(pp));
-		page_free_list = page_free_list->pp_link;
-		pp->pp_link = NULL;
-		if (alloc_flags & ALLOC_ZERO)
-			memset(page2kva(pp), 0, PGSIZE);
+	struct PageCache *pc = &page_cache[cpunum()];
+	struct PageInfo *pp;
+
+	if (alloc_flags & ALLOC_ZERO) {
+		if (!pc->pc_zero && page_zero_count)
+			page_cache_refill_zero(pc, PAGE_CACHE_BATCH);
+		if ((pp = pc->pc_zero)) {
+			pc->pc_zero = pp->pp_link;
+			pc->pc_nzero--;
+			pp->pp_link = NULL;
+			return pp;
+		}
 	}
+	if (!pc->pc_list)
+		page_cache_refill(pc, PAGE_CACHE_BATCH);
+	if (!pc->pc_list && pc->pc_zero) {
+		// Nothing else is left: use this CPU's pre-zeroed pages.
+		pc->pc_list = pc->pc_zero;
+		pc->pc_count = pc->pc_nzero;
+		pc->pc_zero = NULL;
+		pc->pc_nzero = 0;
+	}
+	if (!(pp = pc->pc_list))
+		return NULL;
+	//cprintf("alloc new page: struct page %x va %x pa %x \n", pp, page2kva(pp), page2pa(pp));
+	pc->pc_list = pp->pp_link;
+	pc->pc_count--;
+	pp->pp_link = NULL;
+
+	if (alloc_flags & ALLOC_ZERO)
+		memset(page2kva(pp), 0, PGSIZE);
 	return pp;
 #line 552 "../kern/pmap.c"
 }
@@ -512,26 +765,369 @@ void
 page_free(struct PageInfo *pp)
 {
 #line 572 "../kern/pmap.c"
+	struct PageCache *pc = &page_cache[cpunum()];
+
 	if (pp->pp_ref || pp->pp_link) {
 		warn("page_free: attempt to free mapped page");
 		return;		/* be conservative and assume page is still used */
 	}
-	pp->pp_link = page_free_list;
-	page_free_list = pp;
-	pp->pp_ref = 0;
+	pp->pp_link = pc->pc_list;
+	pc->pc_list = pp;
+	if (++pc->pc_count > PAGE_CACHE_HIGH)
+		page_cache_drain(pc, PAGE_CACHE_BATCH);
 #line 584 "../kern/pmap.c"
 }
 
+//
+// Allocates 2^order physically contiguous pages, aligned to their
+// total size, and returns the PageInfo of the first; the others follow
+// it in 'pages'.  alloc_flags is as for page_alloc, and ALLOC_ZERO
+// clears every page.  The pages have no references, and may be freed
+// one at a time with page_free or all at once with page_free_npages.
+//
+// Returns NULL if order > PAGE_MAX_ORDER or there is no free block
+// that large.
+//
+struct PageInfo *
+page_alloc_npages(unsigned order, int alloc_flags)
+{
+	struct PageCache *pc = &page_cache[cpunum()];
+	struct PageInfo *pp;
+
+	if (order == 0)
+		return page_alloc(alloc_flags);
+	if (order > PAGE_MAX_ORDER)
+		return NULL;
+
+	spin_lock(&page_lock);
+	pp = buddy_alloc(order);
+	spin_unlock(&page_lock);
+	if (!pp && (pc->pc_count || pc->pc_nzero || page_zero_count)) {
+		// This CPU's cached pages, or the pre-zeroed ones, may
+		// complete a block.
+		page_cache_drain(pc, pc->pc_count);
+		spin_lock(&page_lock);
+		while ((pp = pc->pc_zero)) {
+			pc->pc_zero = pp->pp_link;
+			pp->pp_link = NULL;
+			buddy_free(pp, 0);
+		}
+		pc->pc_nzero = 0;
+		while ((pp = page_zero_pop()))
+			buddy_free(pp, 0);
+		pp = buddy_alloc(order);
+		spin_unlock(&page_lock);
+	}
+
+	if (pp && (alloc_flags & ALLOC_ZERO))
+		memset(page2kva(pp), 0, PGSIZE << order);
+	return pp;
+}
+
+//
+// Return the 2^order pages at 'pp', from page_alloc_npages, to the
+// free lists.  None of them may still be referenced.
+//
+void
+page_free_npages(struct PageInfo *pp, unsigned order)
+{
+	size_t i;
+
+	if (order == 0) {
+		page_free(pp);
+		return;
+	}
+	for (i = 0; i < (1 << order); i++)
+		if (pp[i].pp_ref || pp[i].pp_link) {
+			warn("page_free_npages: attempt to free mapped page");
+			return;
+		}
+	spin_lock(&page_lock);
+	buddy_free(pp, order);
+	spin_unlock(&page_lock);
+}
+
+//
+// Zero one free page for the pre-zeroed pool, if it is not full.
+// Called by idle CPUs from sched_halt, without the big kernel lock.
+// The page is cleared with non-temporal stores, so filling the pool
+// does not evict the cache lines of whatever runs next.
+//
+// Returns 1 if a page was zeroed, 0 if the pool is full or there are
+// no free pages.
+//
+int
+page_zero_idle(void)
+{
+	struct PageInfo *pp;
+	uint64_t *p, *end;
+
+	if (page_zero_count >= PAGE_ZERO_POOL_MAX)
+		return 0;
+	spin_lock(&page_lock);
+	pp = buddy_alloc(0);
+	spin_unlock(&page_lock);
+	if (!pp)
+		return 0;
+
+	p = page2kva(pp);
+	for (end = p + PGSIZE / sizeof(*p); p < end; p += 4)
+		asm volatile("movnti %1, 0(%0)\n\t"
+			     "movnti %1, 8(%0)\n\t"
+			     "movnti %1, 16(%0)\n\t"
+			     "movnti %1, 24(%0)"
+			     : : "r" (p), "r" (0UL) : "memory");
+	// The zeroes must be visible before the page can be handed out.
+	asm volatile("sfence" : : : "memory");
+
+	spin_lock(&page_lock);
+	pp->pp_link = page_zero_pool;
+	page_zero_pool = pp;
+	page_zero_count++;
+	spin_unlock(&page_lock);
+	return 1;
+}
+
+//
+// Return the page of the LazyShare 'ls', allocating it if no env has
+// touched it yet.  Returns NULL if out of memory.
+//
+static struct PageInfo *
+lazyshare_page(struct LazyShare *ls)
+{
+	struct PageInfo *pp;
+
+	if ((pp = ls->ls_page))
+		return pp;
+	if (!(pp = page_alloc(ALLOC_ZERO)))
+		return NULL;
+	pp->pp_ref = 1;
+	// Another env sharing it may be allocating it on another CPU.
+	if (!__sync_bool_compare_and_swap(&ls->ls_page, NULL, pp)) {
+		pp->pp_ref = 0;
+		page_free(pp);
+		pp = ls->ls_page;
+	}
+	return pp;
+}
+
+// Drop the reference of the PTE 'pte', no longer in any page table,
+// to its LazyShare.
+static void
+lazyshare_decref(pte_t pte)
+{
+	struct LazyShare *ls = LAZYSHARE(pte);
+
+	if (__sync_sub_and_fetch(&ls->ls_ref, 1) != 0)
+		return;
+	if (ls->ls_page)
+		page_decref(ls->ls_page);
+	kfree(ls);
+}
+
+//
+// Share the lazily allocated PTE_SHARE page '*pte', which maps the
+// zero page or refers to a LazyShare already, with another address
+// space without allocating it.  '*pte' is made to refer to a
+// LazyShare if it does not, and the caller flushes the TLB.
+//
+// Returns the PTE for the other address space, or 0 if out of memory.
+//
+pte_t
+page_lazy_share(pte_t *pte)
+{
+	struct LazyShare *ls;
+
+	if (*pte & PTE_P) {
+		if (!(ls = kmalloc(sizeof(struct LazyShare), 0)))
+			return 0;
+		ls->ls_page = NULL;
+		ls->ls_ref = 1;
+		*pte = LAZYSHARE_PTE(ls) | (*pte & (PTE_U | PTE_SHARE | PTE_ZERO));
+	} else
+		ls = LAZYSHARE(*pte);
+	__sync_fetch_and_add(&ls->ls_ref, 1);
+	return *pte;
+}
+
+//
+// If 'va' is mapped to the zero page with PTE_ZERO, as sys_page_alloc
+// does for a lazily allocated page, and 'perm' has PTE_W, replace the
+// mapping with a new zeroed page, writable, with the same permissions
+// otherwise.  If 'va' refers to a LazyShare, map its page writable,
+// whatever 'perm'.  The caller holds the address space's env_vm_lock.
+//
+// Returns 1 if it did, 0 if 'va' is not a lazily allocated page, or
+// -E_NO_MEM.
+//
+int
+page_lazy_alloc(pml4e_t *pml4e, void *va, int perm)
+{
+	struct PageInfo *pp;
+	pte_t *pte;
+	int r;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if ((pte = pml4e_walk(pml4e, va, 0)) && PTE_LAZYSHARE(*pte)) {
+		if (!(pp = lazyshare_page(LAZYSHARE(*pte))))
+			return -E_NO_MEM;
+		r = page_insert(pml4e, pp, va,
+				(*pte & (PTE_U | PTE_SHARE)) | PTE_P | PTE_W);
+		return r < 0 ? r : 1;
+	}
+	if (!(perm & PTE_W) || page_lookup(pml4e, va, &pte) != zero_page ||
+	    !(*pte & PTE_ZERO))
+		return 0;
+	if (!(pp = page_alloc(ALLOC_ZERO)))
+		return -E_NO_MEM;
+	r = page_insert(pml4e, pp, va, (*pte & PTE_SYSCALL & ~PTE_ZERO) | PTE_W);
+	if (r < 0) {
+		page_free(pp);
+		return r;
+	}
+	return 1;
+}
+
+//
+// Handle an access with 'perm' to 'va' in 'env' that may have faulted
+// on a lazily allocated page.  Returns as page_lazy_alloc.
+//
+int
+page_lazy_fault(struct Env *env, void *va, int perm)
+{
+	int r;
+
+	env_vm_lock(env);
+	r = page_lazy_alloc(env->env_pml4e, va, perm);
+	env_vm_unlock(env);
+	return r;
+}
+
+//
+// Allocates a 2MB page, to be mapped with page_insert and PTE_PS.
+// Its first PageInfo stands for the whole page: it holds the reference
+// count, and the page is freed whole when the count drops to zero.
+//
+struct PageInfo *
+page_alloc_large(int alloc_flags)
+{
+	struct PageInfo *pp;
+
+	if ((pp = page_alloc_npages(PAGE_LARGE_ORDER, alloc_flags)))
+		pp->pp_flags |= PP_LARGE;
+	return pp;
+}
+
 //
 // Decrement the reference count on a page,
 // freeing it if there are no more refs.
+// Shared pages can be unmapped by several CPUs at once,
+// so the count is updated atomically.
 //
 void
 page_decref(struct PageInfo* pp)
 {
-	if (--pp->pp_ref == 0)
+	if (pp == zero_page)
+		return;
+	if (__sync_sub_and_fetch(&pp->pp_ref, 1) == 0)
+		page_free_unref(pp);
+}
+
+// Free a page, 2MB or not, whose last reference is gone.
+static void
+page_free_unref(struct PageInfo *pp)
+{
+	if (pp->pp_flags & PP_LARGE) {
+		pp->pp_flags &= ~PP_LARGE;
+		page_free_npages(pp, PAGE_LARGE_ORDER);
+	} else
 		page_free(pp);
 }
+
+//
+// Allocate the PML4 of a new user address space, with a reference,
+// from this CPU's cache if it has one.  The kernel's half is shared
+// with boot_pml4e, the PML4 maps itself read-only at UVPT, and nothing
+// is mapped below UTOP.
+//
+// Returns NULL if out of memory.
+//
+pml4e_t *
+pml4e_alloc(void)
+{
+	struct Pml4Cache *pc = &pml4_cache[cpunum()];
+	struct PageInfo *pp;
+	pml4e_t *pml4e;
+
+	if (pc->pc_count)
+		return pc->pc_pml4e[--pc->pc_count];
+
+	if (!(pp = page_alloc(ALLOC_ZERO)))
+		return NULL;
+	pp->pp_ref++;
+	pml4e = page2kva(pp);
+	pml4e[1] = boot_pml4e[1];
+	pml4e[PML4(UVPT)] = page2pa(pp) | PTE_P | PTE_U;
+	return pml4e;
+}
+
+//
+// Free the user address space 'pml4e', which no CPU may be running:
+// drop the reference of every page mapped below UTOP, free the page
+// tables, and then free the PML4 or keep it for pml4e_alloc.
+//
+// The page-table pages are walked directly, rather than unmapping
+// each page with page_remove, and one tlb_flush covers the whole
+// address space.
+//
+void
+pml4e_free(pml4e_t *pml4e)
+{
+	struct Pml4Cache *pc = &pml4_cache[cpunum()];
+	physaddr_t cr3 = PADDR(pml4e);
+	pdpe_t *pdpe = NULL;
+	pde_t *pgdir;
+	pte_t *pt;
+	int i, j, k;
+
+	tlb_flush(pml4e);
+	// User mappings all live under the first PML4 entry.
+	if (pml4e[0] & PTE_P)
+		pdpe = KADDR(PTE_ADDR(pml4e[0]));
+	for (i = 0; pdpe && i < NPDPENTRIES; i++) {
+		if (!(pdpe[i] & PTE_P))
+			continue;
+		pgdir = KADDR(PTE_ADDR(pdpe[i]));
+		for (j = 0; j < NPDENTRIES; j++) {
+			if (!(pgdir[j] & PTE_P))
+				continue;
+			// The page table, or a 2MB page.
+			if (!(pgdir[j] & PTE_PS)) {
+				pt = KADDR(PTE_ADDR(pgdir[j]));
+				for (k = 0; k < NPTENTRIES; k++)
+					if (pt[k] & PTE_P)
+						tlb_page_decref(pa2page(PTE_ADDR(pt[k])));
+					else if (PTE_LAZYSHARE(pt[k]))
+						lazyshare_decref(pt[k]);
+			}
+			tlb_page_decref(pa2page(PTE_ADDR(pgdir[j])));
+		}
+		tlb_page_decref(pa2page(PTE_ADDR(pdpe[i])));
+		pdpe[i] = 0;
+	}
+
+	// If another CPU has yet to flush the address space, the PML4 and
+	// the PDPE must wait for tlb_shootdown too.
+	if (pc->pc_count < PML4_CACHE_MAX && thiscpu->cpu_tlb_gather.tr_cr3 != cr3) {
+		pc->pc_pml4e[pc->pc_count++] = pml4e;
+		return;
+	}
+	if (pdpe) {
+		pml4e[0] = 0;
+		tlb_page_decref(pa2page(PADDR(pdpe)));
+	}
+	tlb_page_decref(pa2page(cr3));
+}
 // Given a pml4 pointer, pml4e_walk returns a pointer
 // to the page table entry (PTE) for linear address 'va'
 // This requires walking the 4-level page table structure
@@ -622,6 +1218,9 @@ pdpe_walk(pdpe_t *pdpe,const void *va,int create){
 // a pointer to the page table entry (PTE). 
 // The programming logic and the hints are the same as pml4e_walk
 // and pdpe_walk.
+//
+// If 'va' is in a 2MB page, there is no PTE: pgdir_walk returns a
+// pointer to the page directory entry, which has PTE_PS set.
 
 pte_t *
 pgdir_walk(pde_t *pgdir, const void *va, int create)
@@ -629,6 +1228,8 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 #line 695 "../kern/pmap.c"
 	if (pgdir) {
 		pte_t *pte  = (pte_t *)pgdir [PDX(va)];
+		if ((physaddr_t)pte & PTE_PS)
+			return &pgdir [PDX(va)];
 		if (!((physaddr_t)pte & PTE_P) && create) {
 			struct PageInfo *page   = NULL;
 			if ((page = page_alloc(ALLOC_ZERO))) {
@@ -670,15 +1271,109 @@ boot_map_region(pml4e_t *pml4e, uintptr_t la, size_t size, physaddr_t pa, int pe
 		if (pte != NULL) {
 			*pte    = PTE_ADDR(addr)|perm|PTE_P;
 		}
-		pml4e [PML4(la+i)]   = pml4e [PML4(la+i)]|perm|PTE_P;
+		// PTE_G is only for the last level.
+		pml4e [PML4(la+i)]   = pml4e [PML4(la+i)]|(perm&~PTE_G)|PTE_P;
 		pdpe                 = (pdpe_t *)KADDR(PTE_ADDR(pml4e[PML4(la + i)]));
-		pdpe[PDPE(la+i)]     = pdpe[PDPE(la+i)]|perm|PTE_P;
+		pdpe[PDPE(la+i)]     = pdpe[PDPE(la+i)]|(perm&~PTE_G)|PTE_P;
 		pde                  = (pde_t *) KADDR(PTE_ADDR(pdpe[PDPE(la+i)]));
-		pde[PDX(la+i)]       = pde[PDX(la+i)]|perm|PTE_P;
+		pde[PDX(la+i)]       = pde[PDX(la+i)]|(perm&~PTE_G)|PTE_P;
 	}
 #line 750 "../kern/pmap.c"
 }
 
+// Return the table that the paging-structure entry '*e' points to,
+// allocating it first if it is not present and 'create' is set.
+// Returns NULL if it is not present and cannot be created.
+static void *
+pmap_next_level(uint64_t *e, int create)
+{
+	struct PageInfo *page;
+
+	if (!(*e & PTE_P)) {
+		if (!create || !(page = page_alloc(ALLOC_ZERO)))
+			return NULL;
+		page->pp_ref += 1;
+		*e = page2pa(page)|PTE_U|PTE_W|PTE_P;
+	}
+	return KADDR(PTE_ADDR(*e));
+}
+
+// Return a pointer to the page directory entry for 'va', creating the
+// tables above it if 'create' is set, or NULL if they do not exist.
+static pde_t *
+pde_walk(pml4e_t *pml4e, const void *va, int create)
+{
+	pdpe_t *pdpe;
+	pde_t *pgdir;
+
+	if (!(pdpe = pmap_next_level(&pml4e[PML4(va)], create)))
+		return NULL;
+	if (!(pgdir = pmap_next_level(&pdpe[PDPE(va)], create)))
+		return NULL;
+	return &pgdir[PDX(va)];
+}
+
+//
+// Like boot_map_region, but use a 2MB page for each 2MB-aligned 2MB
+// of the range whose physical address is also 2MB-aligned, and 4KB
+// pages for the rest.  This keeps the direct map of physical memory
+// down to one TLB entry per 2MB.
+//
+static void
+boot_map_region_large(pml4e_t *pml4e, uintptr_t la, size_t size, physaddr_t pa, int perm)
+{
+	pde_t *pde;
+	size_t i;
+
+	for (i = 0; i < size; ) {
+		if ((la + i) % PTSIZE == 0 && (pa + i) % PTSIZE == 0 &&
+		    size - i >= PTSIZE) {
+			if (!(pde = pde_walk(pml4e, (void *) (la + i), 1)))
+				panic("boot_map_region_large: out of memory");
+			*pde = (pa + i)|perm|PTE_P|PTE_PS;
+			i += PTSIZE;
+		} else {
+			boot_map_region(pml4e, la + i, PGSIZE, pa + i, perm);
+			i += PGSIZE;
+		}
+	}
+}
+
+// Map the 2MB page 'pp', from page_alloc_large, at 'va', which must be
+// 2MB-aligned.  Anything mapped in the 2MB at 'va' is unmapped first,
+// and a page table there is freed.
+static int
+page_insert_large(pml4e_t *pml4e, struct PageInfo *pp, void *va, int perm)
+{
+	struct PageInfo *ptpage;
+	pde_t *pde;
+	pte_t *pt;
+	int i;
+
+	if (!(pp->pp_flags & PP_LARGE) || (uintptr_t) va % PTSIZE)
+		return -E_INVAL;
+	if (!(pde = pde_walk(pml4e, va, 1)))
+		return -E_NO_MEM;
+	if ((*pde & PTE_P) && !(*pde & PTE_PS)) {
+		ptpage = pa2page(PTE_ADDR(*pde));
+		pt = page2kva(ptpage);
+		for (i = 0; i < NPTENTRIES; i++)
+			if ((pt[i] & PTE_P) || PTE_LAZYSHARE(pt[i]))
+				page_remove(pml4e, (uint8_t *) va + i * PGSIZE);
+		*pde = 0;
+		// The page table may be cached as well as its entries.
+		tlb_flush(pml4e);
+		tlb_page_decref(ptpage);
+	}
+	// Take the new reference first, in case pp is already mapped here.
+	__sync_fetch_and_add(&pp->pp_ref, 1);
+	if (*pde & PTE_P)
+		page_remove(pml4e, va);
+	*pde = page2pa(pp)|perm|PTE_P|PTE_PS;
+	tlb_invalidate(pml4e, va);
+	return 0;
+}
+
 //
 // Map the physical page 'pp' at virtual address 'va'.
 // The permissions (the low 12 bits) of the page table entry
@@ -691,6 +1386,10 @@ boot_map_region(pml4e_t *pml4e, uintptr_t la, size_t size, physaddr_t pa, int pe
 //   - pp->pp_ref should be incremented if the insertion succeeds.
 //   - The TLB must be invalidated if a page was formerly present at 'va'.
 //
+// If perm includes PTE_PS, pp must come from page_alloc_large, and it
+// is mapped as a 2MB page; see page_insert_large.  Otherwise 'va' must
+// not be in a 2MB page: unmap that first.
+//
 // Corner-case hint: Make sure to consider what happens when the same
 // pp is re-inserted at the same virtual address in the same pgdir.
 // However, try not to distinguish this case in your code, as this
@@ -700,6 +1399,7 @@ boot_map_region(pml4e_t *pml4e, uintptr_t la, size_t size, physaddr_t pa, int pe
 // RETURNS:
 //   0 on success
 //   -E_NO_MEM, if page table couldn't be allocated
+//   -E_INVAL, if va is in a 2MB page and perm does not include PTE_PS
 //
 // Hint: The TA solution is implemented using pml4e_walk, page_remove,
 // and page2pa.
@@ -710,8 +1410,14 @@ page_insert(pml4e_t *pml4e, struct PageInfo *pp, void *va, int perm)
 #line 781 "../kern/pmap.c"
 	pdpe_t *pdpe;
 	pde_t *pde;
+	pte_t lazy;
+	if (pml4e && pp && (perm & PTE_PS))
+		return page_insert_large(pml4e, pp, va, perm);
 	if (pml4e && pp) {
 		pte_t *pte  = pml4e_walk(pml4e, va, 1);
+		// A 4KB page cannot replace part of a 2MB page.
+		if (pte != NULL && (*pte & PTE_PS))
+			return -E_INVAL;
 		if (pte != NULL) {
 			pml4e [PML4(va)] = pml4e [PML4(va)]|(perm&(~PTE_AVAIL));
 			pdpe = (pdpe_t *)KADDR(PTE_ADDR(pml4e[PML4(va)]));
@@ -725,9 +1431,14 @@ page_insert(pml4e_t *pml4e, struct PageInfo *pp, void *va, int perm)
 			} else if (*pte & PTE_P) {
 				page_remove(pml4e, va);
 			}
-			pp->pp_ref  += 1;
+			lazy = *pte;
+			if (pp != zero_page)
+				__sync_fetch_and_add(&pp->pp_ref, 1);
 			*pte    = page2pa(pp)|perm|PTE_P;
 			tlb_invalidate(pml4e, va);
+			// Only now, as pp may be the LazyShare's page.
+			if (PTE_LAZYSHARE(lazy))
+				lazyshare_decref(lazy);
 			return 0;
 		}else
 			return -E_NO_MEM;
@@ -745,6 +1456,9 @@ page_insert(pml4e_t *pml4e, struct PageInfo *pp, void *va, int perm)
 //
 // Return NULL if there is no page mapped at va.
 //
+// If va is in a 2MB page, return the first PageInfo of the 2MB page,
+// and store the page directory entry, with PTE_PS set, in pte_store.
+//
 // Hint: the TA solution uses pml4e_walk and pa2page.
 //
 struct PageInfo *
@@ -766,6 +1480,7 @@ page_lookup(pml4e_t *pml4e, void *va, pte_t **pte_store)
 //
 // Unmaps the physical page at virtual address 'va'.
 // If there is no physical page at that address, silently does nothing.
+// If va is in a 2MB page, all of the 2MB page is unmapped.
 //
 // Details:
 //   - The ref count on the physical page should decrement.
@@ -782,12 +1497,17 @@ void
 page_remove(pml4e_t *pml4e, void *va)
 {
 #line 861 "../kern/pmap.c"
-	pte_t *pte;
+	pte_t *pte, lazy;
 	struct PageInfo *page   = page_lookup(pml4e, va, &pte);
 	if (page != NULL) {
-		tlb_invalidate(pml4e, va);
-		page_decref(page);
+		// Clear the PTE before the page can go back on the free list.
 		*pte    = 0;
+		tlb_invalidate(pml4e, va);
+		tlb_page_decref(page);
+	} else if ((pte = pml4e_walk(pml4e, va, 0)) && PTE_LAZYSHARE(*pte)) {
+		lazy = *pte;
+		*pte = 0;
+		lazyshare_decref(lazy);
 	}
 #line 871 "../kern/pmap.c"
 }
@@ -795,6 +1515,8 @@ page_remove(pml4e_t *pml4e, void *va)
 //
 // Invalidate a TLB entry, but only if the page tables being
 // edited are the ones currently in use by the processor.
+// Other CPUs that have pml4e loaded are sent the invalidation
+// later, by tlb_shootdown.
 //
 void
 tlb_invalidate(pml4e_t *pml4e, void *va)
@@ -804,9 +1526,261 @@ tlb_invalidate(pml4e_t *pml4e, void *va)
 	assert(pml4e!=NULL);
 	if (!curenv || curenv->env_pml4e == pml4e)
 		invlpg(va);
+	if (pml4e == boot_pml4e)
+		return;
+	// Other CPUs, and this one if pml4e is not loaded, may still hold
+	// the old entry under a PCID.
+	if (pcid_enabled)
+		tlb_forget(PADDR(pml4e), true);
+	tlb_gather(PADDR(pml4e), ROUNDDOWN((uintptr_t) va, PGSIZE),
+		   ROUNDDOWN((uintptr_t) va, PGSIZE) + PGSIZE);
 #line 889 "../kern/pmap.c"
 }
 
+// --------------------------------------------------------------
+// Process-context identifiers.
+//
+// With CR4_PCIDE, TLB entries are tagged with the PCID in CR3, so a
+// CR3 load need not flush them: an env that runs again finds its
+// translations still cached.  Each CPU hands out its NPCID PCIDs
+// round-robin, and cpu_pcid_cr3 records which address space each one
+// caches.  A PCID is flushed when it is given to a new address space,
+// so stale entries can only be a problem while the record stands;
+// whenever an address space's mappings change, every record of it is
+// dropped except the one in use by the CPU making the change, which
+// invalidates the entries itself.  PCID 0 is never recorded, and is
+// flushed by every CR3 load that uses it, as without PCIDs.
+//
+// The kernel's mappings are global (PTE_G), and stay cached across
+// all CR3 loads.
+// --------------------------------------------------------------
+
+// Enable global pages and, if the CPU has them, PCIDs on this CPU.
+// CR3 must have no PCID yet.
+void
+tlb_init_percpu(void)
+{
+#ifndef VMM_GUEST
+	uint32_t ecx;
+
+	lcr4(rcr4() | CR4_PGE);
+	cpuid(1, NULL, NULL, &ecx, NULL);
+	if (ecx & (1 << 17)) {
+		lcr4(rcr4() | CR4_PCIDE);
+		pcid_enabled = true;
+	}
+#endif
+}
+
+// Drop every CPU's record of caching address space 'cr3', except this
+// CPU's current one if 'keep_current'.
+static void
+tlb_forget(physaddr_t cr3, bool keep_current)
+{
+	unsigned cur = 0, i;
+	int n;
+
+	if (keep_current && PTE_ADDR(rcr3()) == cr3)
+		cur = rcr3() & CR3_PCID;
+	for (n = 0; n < ncpu; n++)
+		for (i = 0; i < NPCID; i++)
+			if (cpus[n].cpu_pcid_cr3[i] == cr3 &&
+			    !(n == cpunum() && i + 1 == cur))
+				cpus[n].cpu_pcid_cr3[i] = 0;
+}
+
+// Flush every cached translation of the address space 'pml4e', on all
+// CPUs, for changes that tlb_invalidate of a single page cannot cover.
+void
+tlb_flush(pml4e_t *pml4e)
+{
+	physaddr_t cr3 = PADDR(pml4e);
+
+	if (pcid_enabled)
+		tlb_forget(cr3, true);
+	if (PTE_ADDR(rcr3()) == cr3)
+		lcr3(rcr3());
+	tlb_gather(cr3, 0, ~(uintptr_t) 0);
+}
+
+// Switch this CPU to the address space 'cr3', reusing the
+// translations it has cached under a PCID if it has any.
+void
+tlb_load(physaddr_t cr3)
+{
+	struct CpuInfo *c = thiscpu;
+	unsigned i;
+
+	c->cpu_cr3 = cr3;
+	// The kernel's own mappings are global, so boot_cr3 needs no PCID.
+	if (!pcid_enabled || cr3 == boot_cr3) {
+		lcr3(cr3);
+		return;
+	}
+	for (i = 0; i < NPCID; i++)
+		if (c->cpu_pcid_cr3[i] == cr3) {
+			lcr3(cr3 | (i + 1) | CR3_NOFLUSH);
+			return;
+		}
+	i = c->cpu_pcid_next++ % NPCID;
+	c->cpu_pcid_cr3[i] = cr3;
+	// Without CR3_NOFLUSH, this drops what the PCID held before.
+	lcr3(cr3 | (i + 1));
+}
+
+// --------------------------------------------------------------
+// TLB shootdown.
+//
+// A CPU that changes the mappings of an address space another CPU
+// has loaded must get that CPU to drop its stale entries.  Rather
+// than interrupt it for every page, tlb_invalidate gathers the pages
+// changed in cpu_tlb_gather, and tlb_shootdown sends them all at
+// once before the kernel returns to user mode or halts: once per
+// system call or SYS_batch.  Pages unmapped in the meantime are not
+// freed until then, since the other CPUs may still be using them.
+//
+// The range is left in each target CPU's cpu_tlb_req, and the target
+// flushes it in tlb_shootdown_recv, with invlpg if it is at most
+// TLB_RANGE_MAX pages and by reloading CR3 if not.  Only a target
+// running user code is sent an IRQ_TLB interrupt and waited for.  A
+// target in the kernel does the flush when it enters the kernel's
+// big lock or returns to user mode, whichever is first; until then it
+// does not use the address space's user mappings.  cpu_in_user is set
+// before checking for a request, and a request is posted before
+// checking cpu_in_user, so a target cannot go back to user mode
+// without either seeing the request or being waited for.
+// --------------------------------------------------------------
+
+#define TLB_RANGE_MAX	16
+
+// Add [start, end) of the address space 'cr3' to the flushes this
+// CPU will send, if another CPU has it loaded.
+static void
+tlb_gather(physaddr_t cr3, uintptr_t start, uintptr_t end)
+{
+	struct TlbRange *g = &thiscpu->cpu_tlb_gather;
+	int me = cpunum(), n;
+
+	for (n = 0; n < ncpu; n++)
+		if (n != me && cpus[n].cpu_cr3 == cr3)
+			break;
+	if (n == ncpu)
+		return;
+	if (g->tr_cr3 && g->tr_cr3 != cr3)
+		tlb_shootdown();
+	if (!g->tr_cr3) {
+		g->tr_cr3 = cr3;
+		g->tr_start = start;
+		g->tr_end = end;
+	} else {
+		g->tr_start = MIN(g->tr_start, start);
+		g->tr_end = MAX(g->tr_end, end);
+	}
+}
+
+// Drop a reference to a page that was just unmapped.  If that frees
+// it while other CPUs may still have it in their TLBs, it is freed
+// only once tlb_shootdown has flushed them.
+static void
+tlb_page_decref(struct PageInfo *pp)
+{
+	struct CpuInfo *c = thiscpu;
+
+	if (pp == zero_page || __sync_sub_and_fetch(&pp->pp_ref, 1) != 0)
+		return;
+	if (!c->cpu_tlb_gather.tr_cr3) {
+		page_free_unref(pp);
+		return;
+	}
+	pp->pp_link = c->cpu_tlb_free;
+	c->cpu_tlb_free = pp;
+}
+
+// Send the flushes this CPU has gathered to the CPUs that have the
+// address space loaded, wait for those running user code to do them,
+// and free the pages they held.
+void
+tlb_shootdown(void)
+{
+	struct CpuInfo *c = thiscpu, *t;
+	struct TlbRange *g = &c->cpu_tlb_gather;
+	struct PageInfo *pp;
+	bool wait[NCPU];
+	int n;
+
+	if (!g->tr_cr3)
+		return;
+	spin_lock(&tlb_lock);
+	for (n = 0; n < ncpu; n++) {
+		t = &cpus[n];
+		wait[n] = t != c && t->cpu_cr3 == g->tr_cr3;
+		if (!wait[n])
+			continue;
+		// Add to a request the target has not taken yet.  If it
+		// takes it while we write, it will see cpu_tlb_pending
+		// set again and flush the whole range a second time.
+		if (t->cpu_tlb_pending && t->cpu_tlb_req.tr_cr3 == g->tr_cr3) {
+			t->cpu_tlb_req.tr_start =
+				MIN(t->cpu_tlb_req.tr_start, g->tr_start);
+			t->cpu_tlb_req.tr_end =
+				MAX(t->cpu_tlb_req.tr_end, g->tr_end);
+		} else
+			t->cpu_tlb_req = *g;
+		mfence();
+		t->cpu_tlb_pending = 1;
+	}
+	mfence();
+	for (n = 0; n < ncpu; n++) {
+		if (wait[n] && !cpus[n].cpu_in_user)
+			wait[n] = false;
+		if (wait[n])
+			lapic_ipi_cpu(cpus[n].cpu_id, IRQ_OFFSET + IRQ_TLB);
+	}
+	for (n = 0; n < ncpu; n++)
+		while (wait[n] && cpus[n].cpu_tlb_pending)
+			asm volatile("pause");
+	spin_unlock(&tlb_lock);
+
+	g->tr_cr3 = 0;
+	while ((pp = c->cpu_tlb_free)) {
+		c->cpu_tlb_free = pp->pp_link;
+		pp->pp_link = NULL;
+		page_free_unref(pp);
+	}
+}
+
+// Do the flush another CPU has asked of this one, if any.
+void
+tlb_shootdown_recv(void)
+{
+	struct CpuInfo *c = thiscpu;
+	uintptr_t va;
+
+	if (!c->cpu_tlb_pending || !xchg(&c->cpu_tlb_pending, 0))
+		return;
+	mfence();
+	// Any other address space is flushed when it is next loaded.
+	if (PTE_ADDR(rcr3()) != c->cpu_tlb_req.tr_cr3)
+		return;
+	if (c->cpu_tlb_req.tr_end - c->cpu_tlb_req.tr_start >
+	    TLB_RANGE_MAX * PGSIZE)
+		lcr3(rcr3());
+	else
+		for (va = c->cpu_tlb_req.tr_start;
+		     va < c->cpu_tlb_req.tr_end; va += PGSIZE)
+			invlpg((void *) va);
+}
+
+// Note that this CPU is about to run user code, or has stopped.
+// Either way, do any flush that was asked of it.
+void
+tlb_set_user(bool in_user)
+{
+	thiscpu->cpu_in_user = in_user;
+	mfence();
+	tlb_shootdown_recv();
+}
+
 #line 892 "../kern/pmap.c"
 //
 // Reserve size bytes in the MMIO region and map [pa,pa+size) at this
@@ -885,6 +1859,11 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 	}
 	while(va<endva){
 		ptep = pml4e_walk(env->env_pml4e,va,0);
+		// The kernel is about to write to a lazily allocated page, or
+		// to touch one that fork shared before it had a page.
+		if (ptep && (*ptep & PTE_ZERO) &&
+		    page_lazy_fault(env, (void *) va, perm) > 0)
+			ptep = pml4e_walk(env->env_pml4e,va,0);
 		if (!ptep || (*ptep & (perm | PTE_P)) != (perm | PTE_P)) {
 			user_mem_check_addr = (uintptr_t) va;
 			return -E_FAULT;
@@ -920,40 +1899,52 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 // --------------------------------------------------------------
 
 //
-// Check that the pages on the page_free_list are reasonable.
+// Take every free page, so that page_alloc fails, and return them in a
+// list linked through pp_link.  check_return_free_pages gives them
+// back.
 //
+static struct PageInfo *
+check_steal_free_pages(void)
+{
+	struct PageInfo *pp, *fl = NULL;
+
+	while ((pp = page_alloc(0))) {
+		pp->pp_link = fl;
+		fl = pp;
+	}
+	return fl;
+}
 
 static void
-check_page_free_list(bool only_low_memory)
+check_return_free_pages(struct PageInfo *fl)
 {
 	struct PageInfo *pp;
-	unsigned pdx_limit = only_low_memory ? 1 : NPDENTRIES;
+
+	while ((pp = fl)) {
+		fl = pp->pp_link;
+		pp->pp_link = NULL;
+		page_free(pp);
+	}
+}
+
+//
+// Check that the free pages are reasonable.
+//
+
+static void
+check_page_free_list(void)
+{
+	struct PageInfo *pp, *page_free_list = check_steal_free_pages();
 	uint64_t nfree_basemem = 0, nfree_extmem = 0;
 	char *first_free_page;
 
 	if (!page_free_list)
 		panic("'page_free_list' is a null pointer!");
 
-	if (only_low_memory) {
-		// Move pages with lower addresses first in the free
-		// list, since entry_pgdir does not map all pages.
-		struct PageInfo *pp1, *pp2;
-		struct PageInfo **tp[2] = { &pp1, &pp2 };
-		for (pp = page_free_list; pp; pp = pp->pp_link) {
-			int pagetype = PDX(page2pa(pp)) >= pdx_limit;
-			*tp[pagetype] = pp;
-			tp[pagetype] = &pp->pp_link;
-		}
-		*tp[1] = 0;
-		*tp[0] = pp2;
-		page_free_list = pp1;
-	}
-
 	// if there's a page that shouldn't be on the free list,
 	// try to make sure it eventually causes trouble.
 	for (pp = page_free_list; pp; pp = pp->pp_link)
-		if (PDX(page2pa(pp)) < pdx_limit)
-			memset(page2kva(pp), 0x97, 128);
+		memset(page2kva(pp), 0x97, 128);
 
 	first_free_page = (char *) boot_alloc(0);
 	for (pp = page_free_list; pp; pp = pp->pp_link) {
@@ -980,6 +1971,7 @@ check_page_free_list(bool only_low_memory)
 	}
 
 	assert(nfree_extmem > 0);
+	check_return_free_pages(page_free_list);
 }
 
 
@@ -999,11 +1991,12 @@ check_page_alloc(void)
 	// if there's a page that shouldn't be on
 	// the free list, try to make sure it
 	// eventually causes trouble.
-	for (pp0 = page_free_list, nfree = 0; pp0; pp0 = pp0->pp_link) {
+	fl = check_steal_free_pages();
+	for (pp0 = fl, nfree = 0; pp0; pp0 = pp0->pp_link) {
 		memset(page2kva(pp0), 0x97, PGSIZE);
 	}
 
-	for (pp0 = page_free_list, nfree = 0; pp0; pp0 = pp0->pp_link) {
+	for (pp0 = fl, nfree = 0; pp0; pp0 = pp0->pp_link) {
 		// check that we didn't corrupt the free list itself
 		assert(pp0 >= pages);
 		assert(pp0 < pages + npages);
@@ -1014,6 +2007,7 @@ check_page_alloc(void)
 		assert(page2pa(pp0) != EXTPHYSMEM - PGSIZE);
 		assert(page2pa(pp0) != EXTPHYSMEM);
 	}
+	check_return_free_pages(fl);
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
 	assert((pp0 = page_alloc(0)));
@@ -1027,8 +2021,7 @@ check_page_alloc(void)
 	assert(page2pa(pp2) < npages*PGSIZE);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	fl = check_steal_free_pages();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -1056,16 +2049,59 @@ check_page_alloc(void)
 		assert(c[i] == 0);
 
 	// give free list back
-	page_free_list = fl;
+	check_return_free_pages(fl);
 
 	// free the pages we took
 	page_free(pp0);
 	page_free(pp1);
 	page_free(pp2);
 
+	// contiguous blocks are aligned to their size, and are zeroed
+	assert((pp = page_alloc_npages(4, ALLOC_ZERO)));
+	assert(page2ppn(pp) % 16 == 0);
+	c = page2kva(pp);
+	for (i = 0; i < 16 * PGSIZE; i++)
+		assert(c[i] == 0);
+	assert(!page_alloc_npages(PAGE_MAX_ORDER + 1, 0));
+	page_free_npages(pp, 4);
+
+	// freed halves merge back into the block they were split from
+	assert((pp = page_alloc_npages(PAGE_MAX_ORDER, 0)));
+	page_free_npages(pp, PAGE_MAX_ORDER - 1);
+	page_free_npages(pp + (1 << (PAGE_MAX_ORDER - 1)), PAGE_MAX_ORDER - 1);
+	assert(pp->pp_flags & PP_BUDDY);
+	assert(pp->pp_order == PAGE_MAX_ORDER);
+
 	cprintf("check_page_alloc() succeeded!\n");
 }
 
+//
+// Check the pre-zeroed page pool.  It must still be empty, as it is
+// until the other CPUs start and go idle.
+//
+static void
+check_page_zero(void)
+{
+	struct PageInfo *pp0, *pp1;
+	char *c;
+	int i;
+
+	// pages zeroed by idle CPUs are handed out first by ALLOC_ZERO,
+	// through this CPU's share of them
+	assert(page_zero_count == 0 && page_zero_idle() && page_zero_idle());
+	assert((pp0 = page_alloc(ALLOC_ZERO)));
+	assert(page_zero_count == 0 && page_cache[cpunum()].pc_nzero == 1);
+	assert((pp1 = page_alloc(ALLOC_ZERO)));
+	assert(page_cache[cpunum()].pc_nzero == 0);
+	c = page2kva(pp0);
+	for (i = 0; i < PGSIZE; i++)
+		assert(c[i] == 0);
+	page_free(pp0);
+	page_free(pp1);
+
+	cprintf("check_page_zero() succeeded!\n");
+}
+
 //
 // Checks that the kernel part of virtual address space
 // has been setup roughly correctly (by x64_vm_init()).
@@ -1163,6 +2199,8 @@ check_va2pa(pml4e_t *pml4e, uintptr_t va)
 	pde = &pde[PDX(va)];
 	if (!(*pde & PTE_P))
 		return ~0;
+	if (*pde & PTE_PS)
+		return PTE_ADDR(*pde) + (va & (PTSIZE - 1) & ~(PGSIZE - 1));
 	pte = (pte_t*) KADDR(PTE_ADDR(*pde));
 	// cprintf(" %x %x " , pte, *pte);
 	if (!(pte[PTX(va)] & PTE_P))
@@ -1202,8 +2240,7 @@ page_check(void)
 	assert(pp5 && pp5 != pp4 && pp5 != pp3 && pp5 != pp2 && pp5 != pp1 && pp5 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = NULL;
+	fl = check_steal_free_pages();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -1337,7 +2374,7 @@ page_check(void)
 	boot_pml4e[0] = 0;
 
 	// give free list back
-	page_free_list = fl;
+	check_return_free_pages(fl);
 
 	// free the pages we took
 	page_decref(pp0);
@@ -1381,3 +2418,39 @@ page_check(void)
 	cprintf("check_page() succeeded!\n");
 }
 
+// check page_insert, page_lookup and page_remove of 2MB pages
+static void
+check_page_large(void)
+{
+	struct PageInfo *pp, *ppl;
+	pdpe_t *pdpe;
+	pte_t *ptep;
+	void *va;
+
+	// the page tables below are freed again at the end
+	assert(!boot_pml4e[0]);
+	assert((ppl = page_alloc_large(0)));
+	va = (void*) (4 * PTSIZE);
+	assert(page_insert(boot_pml4e, ppl, va + PGSIZE, PTE_W|PTE_PS) == -E_INVAL);
+	assert(page_insert(boot_pml4e, ppl, va, PTE_W|PTE_PS) == 0);
+	assert(ppl->pp_ref == 1);
+	assert(check_va2pa(boot_pml4e, (uintptr_t) va + 5 * PGSIZE) == page2pa(ppl) + 5 * PGSIZE);
+	assert(page_lookup(boot_pml4e, va + 5 * PGSIZE, &ptep) == ppl);
+	assert(*ptep & PTE_PS);
+	// a 4KB page cannot replace part of it
+	assert((pp = page_alloc(0)));
+	assert(page_insert(boot_pml4e, pp, va + 5 * PGSIZE, PTE_W) == -E_INVAL);
+	assert(ppl->pp_ref == 1 && pp->pp_ref == 0);
+	page_free(pp);
+	// removing any page of it removes and frees all of it
+	page_remove(boot_pml4e, va + 5 * PGSIZE);
+	assert(check_va2pa(boot_pml4e, (uintptr_t) va) == ~0);
+	assert(ppl->pp_ref == 0 && !(ppl->pp_flags & PP_LARGE));
+	pdpe = KADDR(PTE_ADDR(boot_pml4e[0]));
+	page_decref(pa2page(PTE_ADDR(pdpe[0])));
+	page_decref(pa2page(PTE_ADDR(boot_pml4e[0])));
+	boot_pml4e[0] = 0;
+
+	cprintf("check_page_large() succeeded!\n");
+}
+
@@ -19,6 +19,7 @@ extern struct PageInfo *pages;
 extern size_t npages;
 
 extern pml4e_t *boot_pml4e;
+extern struct PageInfo *zero_page;
 
 
 /* This macro takes a kernel virtual address -- an address that points above
@@ -51,17 +52,38 @@ enum {
 	ALLOC_ZERO = 1<<0,
 };
 
+// Largest block page_alloc_npages can return: 2^PAGE_MAX_ORDER pages.
+#define PAGE_MAX_ORDER	10
+
+// Order of the blocks that back 2MB pages.
+#define PAGE_LARGE_ORDER	(PTSHIFT - PGSHIFT)
+
 void    x64_vm_init();
 
 void	page_init(void);
 struct PageInfo * page_alloc(int alloc_flags);
 void	page_free(struct PageInfo *pp);
+struct PageInfo *page_alloc_npages(unsigned order, int alloc_flags);
+void	page_free_npages(struct PageInfo *pp, unsigned order);
+struct PageInfo *page_alloc_large(int alloc_flags);
+pml4e_t *pml4e_alloc(void);
+void	pml4e_free(pml4e_t *pml4e);
+int	page_zero_idle(void);
+int	page_lazy_alloc(pml4e_t *pml4e, void *va, int perm);
+int	page_lazy_fault(struct Env *env, void *va, int perm);
+pte_t	page_lazy_share(pte_t *pte);
 int	page_insert(pml4e_t *pml4e, struct PageInfo *pp, void *va, int perm);
 void	page_remove(pml4e_t *pml4e, void *va);
 struct PageInfo *page_lookup(pml4e_t *pml4e, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
 
 void	tlb_invalidate(pml4e_t *pml4e, void *va);
+void	tlb_flush(pml4e_t *pml4e);
+void	tlb_load(physaddr_t cr3);
+void	tlb_init_percpu(void);
+void	tlb_shootdown(void);
+void	tlb_shootdown_recv(void);
+void	tlb_set_user(bool in_user);
 
 #line 67 "../kern/pmap.h"
 void *	mmio_map_region(physaddr_t pa, size_t size);
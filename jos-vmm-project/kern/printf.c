@@ -5,7 +5,13 @@
 #include <inc/types.h>
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
+#include <kern/spinlock.h>
 
+// Keeps output from different CPUs from interleaving.  CPUs handling
+// lock-free system calls print without holding the big kernel lock.
+static struct spinlock cons_lock = {
+	.name = "cons_lock"
+};
 
 static void
 putch(int ch, int *cnt)
@@ -17,11 +23,20 @@ putch(int ch, int *cnt)
 int
 vcprintf(const char *fmt, va_list ap)
 {
+	extern char *panicstr;
 	int cnt = 0;
+	bool locked;
 	va_list aq;
+
+	// Never wait for the lock once we have panicked: the panicking
+	// CPU may already hold it.
+	if ((locked = !panicstr))
+		spin_lock(&cons_lock);
 	va_copy(aq,ap);
 	vprintfmt((void*)putch, &cnt, fmt, aq);
 	va_end(aq);
+	if (locked)
+		spin_unlock(&cons_lock);
 	return cnt;
 
 }
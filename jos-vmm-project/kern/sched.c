@@ -1,10 +1,13 @@
 #line 2 "../kern/sched.c"
 #include <inc/assert.h>
+#include <inc/error.h>
 #include <inc/x86.h>
 #include <kern/spinlock.h>
 #include <kern/env.h>
 #include <kern/pmap.h>
+#include <kern/fpu.h>
 #include <kern/monitor.h>
+#include <kern/ipc.h>
 
 void sched_halt(void);
 
@@ -28,54 +31,346 @@ vmxon() {
 #endif
 #line 30 "../kern/sched.c"
 
-// Choose a user environment to run and run it.
+// Per-CPU queues of runnable environments.  An environment is on a run
+// queue exactly when its status is ENV_RUNNABLE; env_status changes go
+// through sched_enqueue() and sched_dequeue() to keep it that way.
+// The queues are protected by the big kernel lock.
+//
+// Each queue is kept sorted by env_vruntime, the CPU time an env has
+// used scaled down by its weight, so the env at the head is the one
+// furthest behind its fair share.
+struct RunQueue {
+	struct Env *rq_head;
+	struct Env *rq_tail;
+	int rq_len;
+};
+
+static struct RunQueue runqueues[NCPU];
+
+// Length of the timeslice, in milliseconds, that env_run() arms the
+// local APIC timer with when it dispatches an environment.
+// Settable from the kernel monitor with 'timeslice', or at build
+// time with -DSCHED_TIMESLICE_MS=n.
+#ifndef SCHED_TIMESLICE_MS
+#define SCHED_TIMESLICE_MS	10
+#endif
+unsigned sched_timeslice_ms = SCHED_TIMESLICE_MS;
+
+// Most pages an idle CPU zeroes for the page allocator before halting.
+#define SCHED_ZERO_BATCH	64
+
+// Virtual time of the system: the largest env_vruntime dispatched so
+// far.  Envs that have been asleep are brought forward to just behind
+// it when they wake, so sleeping does not bank unbounded CPU credit.
+static uint64_t sched_max_vruntime;
+
+// How much credit, in TSC cycles, a waking env keeps: one timeslice.
+static uint64_t
+sched_wakeup_credit(void)
+{
+	uint64_t per_ms = lapic_tsc_per_ms ? lapic_tsc_per_ms : 1000000;
+
+	return sched_timeslice_ms * per_ms;
+}
+
+// Return the vruntime 'n' slices of credit behind the system's.
+static uint64_t
+sched_vruntime_floor(int n)
+{
+	uint64_t credit = n * sched_wakeup_credit();
+
+	if (sched_max_vruntime < credit)
+		return 0;
+	return sched_max_vruntime - credit;
+}
+
+// Set up the scheduling state of a newly allocated environment.
+// It starts level with the system's virtual time.
 void
-sched_yield(void)
+sched_env_init(struct Env *e)
 {
-	struct Env *idle;
-	int i, j, k, r;
+	e->env_weight = ENV_WEIGHT_DEFAULT;
+	e->env_sched_flags = 0;
+	e->env_affinity = ~0;
+	e->env_vruntime = sched_max_vruntime;
+	e->env_cputime = 0;
+	e->env_dispatched = 0;
+}
 
-	// Determine the starting point for the search.
-	if (curenv)
-		i = curenv-envs;
+// Charge 'e' for the CPU time it has used since it was last charged.
+static void
+sched_charge(struct Env *e)
+{
+	uint64_t now = read_tsc();
+	uint64_t delta = now - e->env_dispatched;
+
+	e->env_dispatched = now;
+	e->env_cputime += delta;
+	e->env_vruntime += delta * ENV_WEIGHT_DEFAULT / e->env_weight;
+}
+
+// May 'e' run on 'cpu'?  Guests only run on the CPU matching their
+// vCPU number; other environments wherever env_affinity allows.
+static bool
+sched_allowed(struct Env *e, int cpu)
+{
+#ifndef VMM_GUEST
+	if (e->env_type == ENV_TYPE_GUEST)
+		return e->env_vmxinfo.vcpunum == cpu;
+#endif
+	return (e->env_affinity & (1 << cpu)) != 0;
+}
+
+// The CPU whose run queue 'e' belongs on.  Environments go back to the
+// CPU they last ran on, if they still may, to find their working set
+// still in its cache; guests are pinned to their vCPU.
+static int
+sched_env_cpu(struct Env *e)
+{
+	int i;
+
+#ifndef VMM_GUEST
+	if (e->env_type == ENV_TYPE_GUEST)
+		return e->env_vmxinfo.vcpunum % ncpu;
+#endif
+	if (e->env_cpunum >= 0 && e->env_cpunum < ncpu &&
+	    sched_allowed(e, e->env_cpunum))
+		return e->env_cpunum;
+	if (sched_allowed(e, cpunum()))
+		return cpunum();
+	for (i = 0; i < ncpu; i++)
+		if (sched_allowed(e, i))
+			return i;
+	return cpunum();
+}
+
+// Idle CPUs sleep with their timer stopped, so they have to be woken
+// when there is work for them.  Prefer the CPU whose queue 'e' is on;
+// otherwise wake any halted CPU that may run 'e' and let it steal it.
+static void
+sched_kick(struct Env *e)
+{
+	int cpu = e->env_rq_cpu;
+	int i;
+
+	if (cpus[cpu].cpu_status != CPU_HALTED) {
+		for (i = 0; i < ncpu; i++)
+			if (cpus[i].cpu_status == CPU_HALTED &&
+			    sched_allowed(e, i))
+				break;
+		if (i == ncpu)
+			return;
+		cpu = i;
+	}
+	if (cpu != cpunum())
+		lapic_ipi_cpu(cpus[cpu].cpu_id, IRQ_OFFSET + IRQ_RESCHED);
+}
+
+// Add 'e' to its run queue in vruntime order, first bringing its
+// vruntime forward to at least 'floor'.
+static void
+sched_enqueue_floor(struct Env *e, uint64_t floor)
+{
+	struct RunQueue *rq;
+	struct Env *prev;
+
+	if (e->env_rq_cpu >= 0)
+		return;
+	if (e->env_vruntime < floor)
+		e->env_vruntime = floor;
+
+	e->env_rq_cpu = sched_env_cpu(e);
+	rq = &runqueues[e->env_rq_cpu];
+	// Preempted envs usually belong near the tail, so search from there.
+	prev = rq->rq_tail;
+	while (prev && prev->env_vruntime > e->env_vruntime)
+		prev = prev->env_rq_prev;
+	e->env_rq_prev = prev;
+	e->env_rq_next = prev ? prev->env_rq_next : rq->rq_head;
+	if (e->env_rq_next)
+		e->env_rq_next->env_rq_prev = e;
 	else
-		i = NENV-1;
-	//cprintf("sched_yield searching from %d\n", i);
-
-	// Loop through all the environments at most once.
-	for (j = 1; j <= NENV; j++) {
-		k = (j + i) % NENV;
-		// If this environment is runnable, run it.
-		if (envs[k].env_status == ENV_RUNNABLE) {
+		rq->rq_tail = e;
+	if (prev)
+		prev->env_rq_next = e;
+	else
+		rq->rq_head = e;
+	rq->rq_len++;
+	sched_kick(e);
+}
+
+// Add 'e' to its run queue.  Called whenever an environment becomes
+// ENV_RUNNABLE.
+void
+sched_enqueue(struct Env *e)
+{
+	sched_enqueue_floor(e, sched_vruntime_floor(1));
+}
+
+// Make 'e', which was waiting for an IPC, runnable.  Envs that asked
+// for ENV_SCHED_WAKEBOOST go ahead of every env that has been running,
+// and the CPU they are queued on is told to reschedule right away
+// rather than at the end of its current timeslice.
+void
+sched_wakeup(struct Env *e)
+{
+	uint64_t floor;
+	int cpu;
+
+	e->env_status = ENV_RUNNABLE;
+	if (!(e->env_sched_flags & ENV_SCHED_WAKEBOOST)) {
+		sched_enqueue(e);
+		return;
+	}
+	floor = sched_vruntime_floor(2);
+	if (e->env_vruntime > floor)
+		e->env_vruntime = floor;
+	sched_enqueue_floor(e, floor);
+
+	cpu = e->env_rq_cpu;
+	if (cpu == cpunum())
+		thiscpu->cpu_resched = true;
+	else if (cpus[cpu].cpu_status == CPU_STARTED)
+		lapic_ipi_cpu(cpus[cpu].cpu_id, IRQ_OFFSET + IRQ_RESCHED);
+}
+
+// Remove 'e' from whatever run queue it is on.  Called whenever an
+// environment stops being ENV_RUNNABLE.
+void
+sched_dequeue(struct Env *e)
+{
+	struct RunQueue *rq;
+
+	if (e->env_rq_cpu < 0)
+		return;
+	rq = &runqueues[e->env_rq_cpu];
+	if (e->env_rq_prev)
+		e->env_rq_prev->env_rq_next = e->env_rq_next;
+	else
+		rq->rq_head = e->env_rq_next;
+	if (e->env_rq_next)
+		e->env_rq_next->env_rq_prev = e->env_rq_prev;
+	else
+		rq->rq_tail = e->env_rq_prev;
+	e->env_rq_next = e->env_rq_prev = NULL;
+	e->env_rq_cpu = -1;
+	rq->rq_len--;
+}
+
+// Return the first environment on run queue 'cpu' that may run on
+// this CPU, or NULL.
+static struct Env *
+sched_pick_from(int cpu)
+{
+	struct Env *e;
+
+	for (e = runqueues[cpu].rq_head; e; e = e->env_rq_next)
+		if (sched_allowed(e, cpunum()))
+			return e;
+	return NULL;
+}
+
+// Return the next environment this CPU should run, or NULL.
+// Our own queue is tried first.  If it has nothing for us, rather
+// than go idle we steal from the other CPUs' queues, busiest first.
+static struct Env *
+sched_pick(void)
+{
+	struct Env *e;
+	uint32_t tried;
+	int i, busiest;
+
+	if ((e = sched_pick_from(cpunum())) != NULL)
+		return e;
+
+	tried = 1 << cpunum();
+	while (1) {
+		busiest = -1;
+		for (i = 0; i < ncpu; i++)
+			if (!(tried & (1 << i)) && runqueues[i].rq_len > 0 &&
+			    (busiest < 0 ||
+			     runqueues[i].rq_len > runqueues[busiest].rq_len))
+				busiest = i;
+		if (busiest < 0)
+			return NULL;
+		if ((e = sched_pick_from(busiest)) != NULL)
+			return e;
+		tried |= 1 << busiest;
+	}
+}
+
+// Restrict 'e' to the CPUs in 'mask'.  If it is queued or running
+// somewhere it may no longer run, move it.
+int
+sched_set_affinity(struct Env *e, uint32_t mask)
+{
+	int cpu;
+
+	if (!(mask & ((1 << ncpu) - 1)))
+		return -E_INVAL;
+	e->env_affinity = mask;
+
+	if (e->env_rq_cpu >= 0 && !sched_allowed(e, e->env_rq_cpu)) {
+		sched_dequeue(e);
+		sched_enqueue(e);
+	}
+	cpu = e->env_cpunum;
+	if (e->env_status == ENV_RUNNING && !sched_allowed(e, cpu)) {
+		if (cpu == cpunum())
+			thiscpu->cpu_resched = true;
+		else
+			lapic_ipi_cpu(cpus[cpu].cpu_id,
+				      IRQ_OFFSET + IRQ_RESCHED);
+	}
+	return 0;
+}
+
+// Choose a user environment to run and run it.  Unless 'yield',
+// curenv keeps the CPU as long as no env that may run here is further
+// behind its fair share.
+static void
+sched_schedule(bool yield)
+{
+	struct Env *e;
+	int r;
+
+	if (curenv)
+		sched_charge(curenv);
+	thiscpu->cpu_resched = false;
+	ipc_timeout_check();
+
+	while ((e = sched_pick()) != NULL) {
+		if (!yield && curenv && curenv->env_status == ENV_RUNNING &&
+		    sched_allowed(curenv, cpunum()) &&
+		    curenv->env_vruntime <= e->env_vruntime)
+			break;
 #ifndef VMM_GUEST
-			// only need to call vmxon() if the env to run is a guest
-			// this actually causes the autograder to fail on start vmxon,
-			// but it's correct
-			if (envs[k].env_type == ENV_TYPE_GUEST) {
-				// only run this env if it has the right vCPU number
-				// there might be another env we can run instead, so continue
-				// rather than return
-				if (envs[k].env_vmxinfo.vcpunum != cpunum()) {
-					continue;
-				}
-				r = vmxon();
-				// vmxon can fail; if it does, destroy the env and try the next one
-				if (r < 0) {
-					env_destroy(&envs[k]);
-					continue;
-				}
+		// only need to call vmxon() if the env to run is a guest
+		if (e->env_type == ENV_TYPE_GUEST) {
+			r = vmxon();
+			// vmxon can fail; if it does, destroy the env and try the next one
+			if (r < 0) {
+				env_destroy(e);
+				continue;
 			}
-#endif
-			env_run(&envs[k]);
 		}
+#endif
+		if (e->env_vruntime > sched_max_vruntime)
+			sched_max_vruntime = e->env_vruntime;
+		env_run(e);
 	}
 
+	// Nothing else to run, or curenv is still due the CPU.  Keep
+	// running curenv, unless it has been moved off this CPU, in which
+	// case its new CPU will pick it up.
+	if (curenv && curenv->env_status == ENV_RUNNING &&
+	    !sched_allowed(curenv, cpunum())) {
+		curenv->env_status = ENV_RUNNABLE;
+		sched_enqueue(curenv);
+	}
 	if (curenv && curenv->env_status == ENV_RUNNING) {
 #ifndef VMM_GUEST
-		if (envs[k].env_type == ENV_TYPE_GUEST) {
-			// if (curenv->env_vmxinfo.vcpunum != cpunum()) {
-			// 	return;
-			// }
+		if (curenv->env_type == ENV_TYPE_GUEST) {
 			r = vmxon();
 			if (r < 0) {
 				env_destroy(curenv);
@@ -89,33 +384,90 @@ sched_yield(void)
 	sched_halt();
 }
 
+// Reschedule: at the end of a timeslice, when curenv blocks or exits,
+// or when another env needs this CPU.
+void
+sched_yield(void)
+{
+	sched_schedule(false);
+}
+
+// curenv gives up the CPU: run any other env that may run here, even
+// one that is ahead of curenv in vruntime.
+void
+sched_yield_cpu(void)
+{
+	sched_schedule(true);
+}
+
+// Switch this CPU straight from curenv, which has just blocked in an
+// IPC call or reply, to 'e', which the IPC has just made ready to run,
+// without searching the run queues: the partner of an IPC should run
+// next, and on the CPU whose cache holds the message.  If 'e' may not
+// run here, wake it the usual way and reschedule.
+void
+sched_handoff(struct Env *e)
+{
+	uint64_t floor;
+
+	if (e->env_status != ENV_NOT_RUNNABLE ||
+	    e->env_type == ENV_TYPE_GUEST || !sched_allowed(e, cpunum())) {
+		if (e->env_status == ENV_NOT_RUNNABLE)
+			sched_wakeup(e);
+		sched_yield();
+	}
+
+	if (curenv)
+		sched_charge(curenv);
+	thiscpu->cpu_resched = false;
+	floor = sched_vruntime_floor(1);
+	if (e->env_vruntime < floor)
+		e->env_vruntime = floor;
+	if (e->env_vruntime > sched_max_vruntime)
+		sched_max_vruntime = e->env_vruntime;
+	env_run(e);
+}
+
 
 
-// Halt this CPU when there is nothing to do. Wait until the
-// timer interrupt wakes it up. This function never returns.
+// Halt this CPU when there is nothing to do. Wait until an
+// interrupt wakes it up. This function never returns.
 //
 void
 sched_halt(void)
 {
+	struct Env *e;
 	int i;
 
 	// For debugging and testing purposes, if there are no runnable
 	// environments in the system, then drop into the kernel monitor.
-	for (i = 0; i < NENV; i++) {
-		if ((envs[i].env_status == ENV_RUNNABLE ||
-		     envs[i].env_status == ENV_RUNNING ||
-		     envs[i].env_status == ENV_DYING))
+	for (i = 0; i < ncpu; i++) {
+		e = cpus[i].cpu_env;
+		if (runqueues[i].rq_len > 0 ||
+		    (e && (e->env_status == ENV_RUNNING ||
+			   e->env_status == ENV_DYING)))
 			break;
 	}
-	if (i == NENV) {
+	if (i == ncpu && !ipc_timeout_next()) {
 		cprintf("No runnable environments in the system!\n");
 		while (1)
 			monitor(NULL);
 	}
 
 	// Mark that no environment is running on this CPU
+	fpu_switch_out();
 	curenv = NULL;
-	lcr3(PADDR(boot_pml4e));
+	tlb_shootdown();
+	tlb_load(boot_cr3);
+
+	// There is nothing to preempt, so don't take timer interrupts,
+	// except to time out blocked IPC sends.  Otherwise we sleep
+	// until a device interrupt or until another CPU sends us a
+	// reschedule IPI from sched_enqueue().
+	if ((i = ipc_timeout_next()) != 0)
+		lapic_timer_oneshot(i);
+	else
+		lapic_timer_stop();
 
 	// Mark that this CPU is in the HALT state, so that when
 	// timer interupts come in, we know we should re-acquire the
@@ -125,6 +477,14 @@ sched_halt(void)
 	// Release the big kernel lock as if we were "leaving" the kernel
 	unlock_kernel();
 
+	// Zero free pages for page_alloc(ALLOC_ZERO) while there is
+	// nothing else to do, but stop once an env is queued here.
+	// Interrupts are still off, so do a bounded amount of work.
+	for (i = 0; i < SCHED_ZERO_BATCH; i++)
+		if (*(volatile int *) &runqueues[cpunum()].rq_len ||
+		    !page_zero_idle())
+			break;
+
 	// Reset stack pointer, enable interrupts and then halt.
 	asm volatile (
 		"movq $0, %%rbp\n"
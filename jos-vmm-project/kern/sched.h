@@ -7,7 +7,19 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/env.h>
+
+extern unsigned sched_timeslice_ms;
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
+void sched_yield_cpu(void) __attribute__((noreturn));
+
+void sched_env_init(struct Env *e);
+void sched_enqueue(struct Env *e);
+void sched_dequeue(struct Env *e);
+void sched_wakeup(struct Env *e);
+void sched_handoff(struct Env *e) __attribute__((noreturn));
+int sched_set_affinity(struct Env *e, uint32_t mask);
 
 #endif	// !JOS_KERN_SCHED_H
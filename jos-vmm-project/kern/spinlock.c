@@ -12,11 +12,12 @@
 
 // The big kernel lock
 struct spinlock kernel_lock = {
-#ifdef DEBUG_SPINLOCK
 	.name = "kernel_lock"
-#endif
 };
 
+// Every lock that has ever been acquired, for spin_lockstat_print().
+static struct spinlock *lock_list;
+
 #ifdef DEBUG_SPINLOCK
 // Record the current call stack in pcs[] by following the %ebp chain.
 static void
@@ -35,23 +36,35 @@ get_caller_pcs(uint64_t pcs[])
 	for (; i < 10; i++)
 		pcs[i] = 0;
 }
+#endif
 
 // Check whether this CPU is holding the lock.
 static int
 holding(struct spinlock *lock)
 {
-	return lock->locked && lock->cpu == thiscpu;
+	return lock->owner != lock->next && lock->cpu == thiscpu;
+}
+
+// Add lk to lock_list the first time it is used.  Statically
+// initialized locks never go through __spin_initlock, so this
+// can't be done there.
+static void
+spin_list(struct spinlock *lk)
+{
+	if (lk->listed || __sync_lock_test_and_set(&lk->listed, 1))
+		return;
+	do {
+		lk->link = lock_list;
+	} while (!__sync_bool_compare_and_swap(&lock_list, lk->link, lk));
 }
-#endif
 
 void
 __spin_initlock(struct spinlock *lk, char *name)
 {
-	lk->locked = 0;
-#ifdef DEBUG_SPINLOCK
+	lk->next = 0;
+	lk->owner = 0;
 	lk->name = name;
 	lk->cpu = 0;
-#endif
 }
 
 // Acquire the lock.
@@ -61,40 +74,58 @@ __spin_initlock(struct spinlock *lk, char *name)
 void
 spin_lock(struct spinlock *lk)
 {
-#ifdef DEBUG_SPINLOCK
+	uint32_t ticket;
+	uint64_t spin = 0;
+	bool contended;
+
 	if (holding(lk))
 		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
-#endif
+	spin_list(lk);
 
-	// The xchg is atomic.
-	// It also serializes, so that reads after acquire are not
-	// reordered before it. 
-	while (xchg(&lk->locked, 1) != 0)
-		asm volatile ("pause");
+	// Take a ticket and wait for our turn.  The locked add is
+	// atomic and serializes, so reads after the acquire are not
+	// reordered before it.
+	ticket = __sync_fetch_and_add(&lk->next, 1);
+	if ((contended = (lk->owner != ticket))) {
+		spin = read_tsc();
+		while (lk->owner != ticket)
+			asm volatile ("pause");
+		spin = read_tsc() - spin;
+	}
+	asm volatile ("" : : : "memory");
 
-	// Record info about lock acquisition for debugging.
-#ifdef DEBUG_SPINLOCK
+	// We hold the lock, so the statistics are ours to update.
 	lk->cpu = thiscpu;
+	lk->nacquire++;
+	if (contended) {
+		lk->ncontended++;
+		lk->spin_cycles += spin;
+	}
+#ifdef DEBUG_SPINLOCK
 	get_caller_pcs(lk->pcs);
 #endif
+	lk->hold_start = read_tsc();
 }
 
 // Release the lock.
 void
 spin_unlock(struct spinlock *lk)
 {
-#ifdef DEBUG_SPINLOCK
+	uint64_t hold;
+
 	if (!holding(lk)) {
+		if (!lk->cpu)
+			cprintf("CPU %d cannot release %s: not held by any CPU\n",
+				cpunum(), lk->name);
+		else
+			cprintf("CPU %d cannot release %s: held by CPU %d\n",
+				cpunum(), lk->name, lk->cpu->cpu_id);
+#ifdef DEBUG_SPINLOCK
 		int i;
-		uint32_t pcs[10];
-		// Nab the acquiring EIP chain before it gets released
+		uint64_t pcs[10];
+		// Nab the acquiring RIP chain before it gets released
 		memmove(pcs, lk->pcs, sizeof pcs);
-		if (!lk->cpu) 
-                        cprintf("CPU %d cannot release %s: not held by any CPU\nAcquired at:", 
-                                cpunum(), lk->name);
-                else 
-			cprintf("CPU %d cannot release %s: held by CPU %d\nAcquired at:", 
-				cpunum(), lk->name, lk->cpu->cpu_id);
+		cprintf("Acquired at:");
 		for (i = 0; i < 10 && pcs[i]; i++) {
 			struct Ripdebuginfo info;
 			if (debuginfo_rip(pcs[i], &info) >= 0)
@@ -105,21 +136,71 @@ spin_unlock(struct spinlock *lk)
 			else
 				cprintf("  %08x\n", pcs[i]);
 		}
+#endif
 		panic("spin_unlock");
 	}
 
+	hold = read_tsc() - lk->hold_start;
+	if (hold > lk->max_hold)
+		lk->max_hold = hold;
+#ifdef DEBUG_SPINLOCK
 	lk->pcs[0] = 0;
-	lk->cpu = 0;
 #endif
+	lk->cpu = 0;
+
+	// Hand the lock to the next ticket.  Only the holder writes
+	// 'owner', but the locked add keeps the stores from the
+	// critical section from being reordered after the release.
+	__sync_fetch_and_add(&lk->owner, 1);
+}
+
+// Print the contention statistics of every lock that has been used.
+// Locks that share a name (e.g. the per-env locks) are summed into
+// one line, with the largest of their maximum hold times.
+void
+spin_lockstat_print(void)
+{
+	struct spinlock *lk, *lk2;
+	uint64_t nacquire, ncontended, spin_cycles, max_hold;
+	int n;
+
+	cprintf("%-16s %5s %12s %12s %14s %12s\n", "lock", "count",
+		"acquires", "contended", "spin-cycles", "max-hold");
+	for (lk = lock_list; lk; lk = lk->link) {
+		// Skip names we have already printed.
+		for (lk2 = lock_list; lk2 != lk; lk2 = lk2->link)
+			if (strcmp(lk2->name, lk->name) == 0)
+				break;
+		if (lk2 != lk)
+			continue;
+
+		n = 0;
+		nacquire = ncontended = spin_cycles = max_hold = 0;
+		for (lk2 = lk; lk2; lk2 = lk2->link) {
+			if (strcmp(lk2->name, lk->name) != 0)
+				continue;
+			n++;
+			nacquire += lk2->nacquire;
+			ncontended += lk2->ncontended;
+			spin_cycles += lk2->spin_cycles;
+			if (lk2->max_hold > max_hold)
+				max_hold = lk2->max_hold;
+		}
+		cprintf("%-16s %5d %12llu %12llu %14llu %12llu\n", lk->name, n,
+			nacquire, ncontended, spin_cycles, max_hold);
+	}
+}
 
-	// The xchg serializes, so that reads before release are 
-	// not reordered after it.  The 1996 PentiumPro manual (Volume 3,
-	// 7.2) says reads can be carried out speculatively and in
-	// any order, which implies we need to serialize here.
-	// But the 2007 Intel 64 Architecture Memory Ordering White
-	// Paper says that Intel 64 and IA-32 will not move a load
-	// after a store. So lock->locked = 0 would work here.
-	// The xchg being asm volatile ensures gcc emits it after
-	// the above assignments (and after the critical section).
-	xchg(&lk->locked, 0);
+// Clear the contention statistics of every lock.
+void
+spin_lockstat_reset(void)
+{
+	struct spinlock *lk;
+
+	for (lk = lock_list; lk; lk = lk->link) {
+		lk->nacquire = 0;
+		lk->ncontended = 0;
+		lk->spin_cycles = 0;
+		lk->max_hold = 0;
+	}
 }
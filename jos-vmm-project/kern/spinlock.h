@@ -4,17 +4,32 @@
 
 #include <inc/types.h>
 
-// Comment this to disable spinlock debugging
-#define DEBUG_SPINLOCK
+// Uncomment this to record the call stack of each lock acquisition
+//#define DEBUG_SPINLOCK
 
 // Mutual exclusion lock.
+//
+// This is a ticket lock: each CPU that wants the lock takes the next
+// ticket and waits for 'owner' to reach it, so waiters are served in
+// FIFO order and spin reading a shared line instead of writing it.
 struct spinlock {
-	unsigned locked;       // Is the lock held?
+	volatile uint32_t next;	// Next ticket to hand out
+	volatile uint32_t owner;	// Ticket that holds the lock
+	char *name;		// Name of lock.
+	struct CpuInfo *cpu;	// The CPU holding the lock.
+
+	// Contention statistics, updated while the lock is held.
+	// TSC-based, so they are in cycles.
+	uint64_t nacquire;	// Number of acquisitions
+	uint64_t ncontended;	// Acquisitions that had to wait
+	uint64_t spin_cycles;	// Total cycles spent waiting
+	uint64_t max_hold;	// Longest time the lock was held
+	uint64_t hold_start;	// When the current holder acquired it
+	struct spinlock *link;	// Next lock in the list of all locks
+	bool listed;		// On the list of all locks?
 
 #ifdef DEBUG_SPINLOCK
 	// For debugging:
-	char *name;            // Name of lock.
-	struct CpuInfo *cpu;   // The CPU holding the lock.
 	uintptr_t pcs[10];     // The call stack (an array of program counters)
 	                       // that locked the lock.
 #endif
@@ -23,6 +38,8 @@ struct spinlock {
 void __spin_initlock(struct spinlock *lk, char *name);
 void spin_lock(struct spinlock *lk);
 void spin_unlock(struct spinlock *lk);
+void spin_lockstat_print(void);
+void spin_lockstat_reset(void);
 
 #define spin_initlock(lock)   __spin_initlock(lock, #lock)
 
@@ -16,12 +16,17 @@
 #include <kern/console.h>
 #include <kern/sched.h>
 #include <kern/time.h>
+#include <kern/ipc.h>
 #include <kern/e1000.h>
 #ifndef VMM_GUEST
 #include <vmm/ept.h>
 #include <vmm/vmx.h>
 #endif
 
+// Does envid name the calling environment?
+#define SYSCALL_SELF(envid) \
+    ((envid_t) (envid) == 0 || (envid_t) (envid) == curenv->env_id)
+
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
 // Destroys the environment on memory errors.
@@ -74,7 +79,7 @@ sys_env_destroy(envid_t envid)
 static void
 sys_yield(void)
 {
-    sched_yield();
+    sched_yield_cpu();
 }
 
 // Allocate a new environment.
@@ -90,13 +95,151 @@ sys_exofork(void)
     if ((r = env_alloc(&e, curenv->env_id)) < 0)
         return r;
     e->env_status = ENV_NOT_RUNNABLE;
+    sched_dequeue(e);
+    e->env_affinity = curenv->env_affinity;
+    e->env_tf = curenv->env_tf;
+    e->env_tf.tf_regs.reg_rax = 0;
+    return e->env_id;
+}
+
+// Create a child environment whose address space is a copy-on-write
+// duplicate of the current one, in one pass over the page tables.
+// Writable pages are marked PTE_COW, read-only in both envs; PTE_SHARE
+// and read-only pages are shared as they are, and lazily allocated
+// PTE_SHARE pages without a page yet stay without one.  Writable 2MB
+// pages that are not PTE_SHARE are copied into the child at once.  Faults on the
+// COW pages go to the page fault upcall, which the child inherits, and
+// the child gets a fresh user exception stack.  The child starts out
+// runnable, returning 0 from this call.
+//
+// Returns envid of new environment, or < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_fork(void)
+{
+    struct Env *e;
+    struct PageInfo *pp, *cpp;
+    pdpe_t *pdpe;
+    pde_t *pgdir;
+    pte_t *pt, *cpt;
+    uint64_t pdpeno, pdeno, pteno;
+    void *va;
+    int r;
+
+    if ((r = env_alloc(&e, curenv->env_id)) < 0)
+        return r;
+    e->env_status = ENV_NOT_RUNNABLE;
+    sched_dequeue(e);
+    e->env_affinity = curenv->env_affinity;
     e->env_tf = curenv->env_tf;
     e->env_tf.tf_regs.reg_rax = 0;
+    e->env_pgfault_upcall = curenv->env_pgfault_upcall;
+
+    // User mappings all live under the first PML4 entry, below
+    // UMAPTOP: the syscalls refuse to map anything above it.  Skip the
+    // subtrees that have nothing mapped.
+    env_vm_lock(curenv);
+    pdpe = KADDR(PTE_ADDR(curenv->env_pml4e[0]));
+    for (pdpeno = 0; pdpeno < NPDPENTRIES; pdpeno++) {
+        if (!(pdpe[pdpeno] & PTE_P))
+            continue;
+        pgdir = KADDR(PTE_ADDR(pdpe[pdpeno]));
+        for (pdeno = 0; pdeno < NPDENTRIES; pdeno++) {
+            if (!(pgdir[pdeno] & PTE_P))
+                continue;
+            if (pgdir[pdeno] & PTE_PS) {
+                // 2MB pages are not copied on write: the child gets its
+                // own copy of a writable one now.
+                va = PGADDR((uint64_t) 0, pdpeno, pdeno, 0, 0);
+                pp = pa2page(PTE_ADDR(pgdir[pdeno]));
+                if ((pgdir[pdeno] & (PTE_W | PTE_COW)) && !(pgdir[pdeno] & PTE_SHARE)) {
+                    if (!(cpp = page_alloc_large(0))) {
+                        r = -E_NO_MEM;
+                        goto fail;
+                    }
+                    memcpy(page2kva(cpp), page2kva(pp), PTSIZE);
+                    pp = cpp;
+                } else
+                    cpp = NULL;
+                if ((r = page_insert(e->env_pml4e, pp, va,
+                                     PTE_PS | (pgdir[pdeno] & PTE_SYSCALL))) < 0) {
+                    if (cpp) {
+                        cpp->pp_flags &= ~PP_LARGE;
+                        page_free_npages(cpp, PAGE_LARGE_ORDER);
+                    }
+                    goto fail;
+                }
+                continue;
+            }
+            pt = KADDR(PTE_ADDR(pgdir[pdeno]));
+            cpt = NULL;
+            for (pteno = 0; pteno < NPTENTRIES; pteno++) {
+                if ((pt[pteno] & (PTE_P | PTE_U)) != (PTE_P | PTE_U) &&
+                    !PTE_LAZYSHARE(pt[pteno]))
+                    continue;
+                va = PGADDR((uint64_t) 0, pdpeno, pdeno, pteno, 0);
+                if (va == (void*) (UXSTACKTOP - PGSIZE))
+                    continue;
+                // Find the child's page table once per parent page table.
+                if (!cpt && !(cpt = pml4e_walk(e->env_pml4e, PGADDR((uint64_t) 0, pdpeno, pdeno, 0, 0), 1))) {
+                    r = -E_NO_MEM;
+                    goto fail;
+                }
+                // Lazily allocated pages are shared as the zero page.
+                // PTE_SHARE ones must end up with the same page in both
+                // envs, so they share a LazyShare until either touches
+                // them; see page_lazy_share.
+                if (PTE_LAZYSHARE(pt[pteno]) ||
+                    ((pt[pteno] & (PTE_SHARE | PTE_ZERO)) == (PTE_SHARE | PTE_ZERO) &&
+                     PTE_ADDR(pt[pteno]) == page2pa(zero_page))) {
+                    if (!(cpt[pteno] = page_lazy_share(&pt[pteno]))) {
+                        r = -E_NO_MEM;
+                        goto fail;
+                    }
+                    continue;
+                }
+                if ((pt[pteno] & (PTE_W | PTE_COW)) && !(pt[pteno] & PTE_SHARE))
+                    pt[pteno] = (pt[pteno] & ~PTE_W) | PTE_COW;
+                pp = pa2page(PTE_ADDR(pt[pteno]));
+                if (pp != zero_page)
+                    __sync_fetch_and_add(&pp->pp_ref, 1);
+                cpt[pteno] = PTE_ADDR(pt[pteno]) | (pt[pteno] & PTE_SYSCALL);
+            }
+        }
+    }
+
+    if (page_lookup(curenv->env_pml4e, (void*) (UXSTACKTOP - PGSIZE), NULL)) {
+        if (!(pp = page_alloc(ALLOC_ZERO))) {
+            r = -E_NO_MEM;
+            goto fail;
+        }
+        if ((r = page_insert(e->env_pml4e, pp, (void*) (UXSTACKTOP - PGSIZE),
+                             PTE_P | PTE_U | PTE_W)) < 0) {
+            page_free(pp);
+            goto fail;
+        }
+    }
+    env_vm_unlock(curenv);
+
+    // Our own writable mappings may still be cached in the TLB.
+    tlb_flush(curenv->env_pml4e);
+
+    e->env_status = ENV_RUNNABLE;
+    sched_enqueue(e);
     return e->env_id;
+
+fail:
+    env_vm_unlock(curenv);
+    tlb_flush(curenv->env_pml4e);
+    env_destroy(e);
+    return r;
 }
 
 // Set envid's env_status to status, which must be ENV_RUNNABLE
-// or ENV_NOT_RUNNABLE.
+// or ENV_NOT_RUNNABLE.  An env made runnable while it is queued in
+// sys_ipc_send leaves the queue, and its send fails with
+// -E_IPC_NOT_RECV.
 //
 // Returns 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
@@ -112,10 +255,61 @@ sys_env_set_status(envid_t envid, int status)
         return r;
     if (status != ENV_RUNNABLE && status != ENV_NOT_RUNNABLE)
         return -E_INVAL;
+    if (status == ENV_RUNNABLE && e->env_ipc_sendto)
+        ipc_send_cancel(e);
     e->env_status = status;
+    if (status == ENV_RUNNABLE)
+        sched_enqueue(e);
+    else
+        sched_dequeue(e);
+    return 0;
+}
+
+// Set envid's fair-share scheduling parameters.  'weight' sets envid's
+// share of the CPU relative to other envs (ENV_WEIGHT_DEFAULT is an
+// ordinary env's); 'flags' is a set of ENV_SCHED_* flags.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if weight is 0 or above ENV_WEIGHT_MAX, or flags
+//		contains unknown bits.
+static int
+sys_env_set_sched(envid_t envid, uint32_t weight, uint32_t flags)
+{
+    struct Env *e;
+    int r;
+
+    if ((r = envid2env(envid, &e, 1)) < 0)
+        return r;
+    if (weight == 0 || weight > ENV_WEIGHT_MAX)
+        return -E_INVAL;
+    if (flags & ~ENV_SCHED_WAKEBOOST)
+        return -E_INVAL;
+    e->env_weight = weight;
+    e->env_sched_flags = flags;
     return 0;
 }
 
+// Pin envid to the CPUs whose bits are set in 'cpumask'.  Children
+// created with sys_exofork inherit the mask.  Guests always run on
+// the CPU of their vCPU, whatever their mask.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if cpumask contains none of the system's CPUs.
+static int
+sys_env_set_affinity(envid_t envid, uint32_t cpumask)
+{
+    struct Env *e;
+    int r;
+
+    if ((r = envid2env(envid, &e, 1)) < 0)
+        return r;
+    return sched_set_affinity(e, cpumask);
+}
+
 // Set envid's trap frame to 'tf'.
 // tf is modified to make sure that user environments always run at code
 // protection level 3 (CPL 3) with interrupts enabled.
@@ -132,8 +326,17 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 
     user_mem_assert(curenv, tf, sizeof(struct Trapframe), PTE_U);
     ltf = *tf;
+    // Only user segments, and no I/O privilege beyond the caller's.
+    // Clear the trap number so env_pop_tf() never returns through
+    // this frame with SYSRET.
     ltf.tf_eflags |= FL_IF;
-    ltf.tf_cs |= 3;
+    ltf.tf_eflags &= ~FL_IOPL_MASK | (curenv->env_tf.tf_eflags & FL_IOPL_MASK);
+    ltf.tf_cs = GD_UT | 3;
+    ltf.tf_ss = GD_UD | 3;
+    ltf.tf_ds = GD_UD | 3;
+    ltf.tf_es = GD_UD | 3;
+    ltf.tf_trapno = 0;
+    ltf.tf_err = 0;
 
     if ((r = envid2env(envid, &e, 1)) < 0)
         return r;
@@ -169,11 +372,18 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 //
 // perm -- PTE_U | PTE_P must be set, PTE_AVAIL | PTE_W may or may not be set,
 //         but no other bits may be set.  See PTE_SYSCALL in inc/mmu.h.
+//         As an exception, PTE_PS may be set to allocate a 2MB page,
+//         which replaces everything mapped in the 2MB at 'va'.
+//         With PTE_ZERO, no page is allocated yet: 'va' maps the shared
+//         zero page read-only, and gets a page of its own on the first
+//         write if perm includes PTE_W.
 //
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
-//	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_INVAL if va >= UMAPTOP, or va is not page-aligned.
+//	-E_INVAL if (perm & PTE_PS) and va is not 2MB-aligned, or
+//		!(perm & PTE_PS) and va is in a 2MB page.
 //	-E_INVAL if perm is inappropriate (see above).
 //	-E_NO_MEM if there's no memory to allocate the new page,
 //		or to allocate any necessary page tables.
@@ -186,14 +396,40 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 
     if ((r = envid2env(envid, &e, 1)) < 0)
         return r;
-    if ((~perm & (PTE_U|PTE_P)) || (perm & ~PTE_SYSCALL))
+    if ((~perm & (PTE_U|PTE_P)) || (perm & ~(PTE_SYSCALL|PTE_PS)))
         return -E_INVAL;
-    if (va >= (void*) UTOP)
+    if (va >= (void*) UMAPTOP)
         return -E_INVAL;
-    if (!(pp = page_alloc(ALLOC_ZERO)))
+    if ((perm & (PTE_PS|PTE_ZERO)) == (PTE_PS|PTE_ZERO))
+        return -E_INVAL;
+    if (perm & PTE_ZERO) {
+        // Remember PTE_W only as PTE_ZERO.
+        if (perm & PTE_W)
+            perm &= ~PTE_W;
+        else
+            perm &= ~PTE_ZERO;
+        env_vm_lock(e);
+        r = page_insert(e->env_pml4e, zero_page, va, perm);
+        env_vm_unlock(e);
+        return r;
+    }
+    if (perm & PTE_PS) {
+        if ((uintptr_t) va % PTSIZE || (uintptr_t) va + PTSIZE > UMAPTOP)
+            return -E_INVAL;
+        pp = page_alloc_large(ALLOC_ZERO);
+    } else
+        pp = page_alloc(ALLOC_ZERO);
+    if (!pp)
         return -E_NO_MEM;
-    if ((r = page_insert(e->env_pml4e, pp, va, perm)) < 0) {
-        page_free(pp);
+    env_vm_lock(e);
+    r = page_insert(e->env_pml4e, pp, va, perm);
+    env_vm_unlock(e);
+    if (r < 0) {
+        if (perm & PTE_PS) {
+            pp->pp_flags &= ~PP_LARGE;
+            page_free_npages(pp, PAGE_LARGE_ORDER);
+        } else
+            page_free(pp);
         return r;
     }
     return 0;
@@ -203,28 +439,32 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 // at 'dstva' in dstenvid's address space with permission 'perm'.
 // Perm has the same restrictions as in sys_page_alloc, except
 // that it also must not grant write access to a read-only
-// page.
+// page.  PTE_PS must be set if, and only if, srcva is in a 2MB
+// page; then the whole 2MB page is mapped.
 //
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if srcenvid and/or dstenvid doesn't currently exist,
 //		or the caller doesn't have permission to change one of them.
-//	-E_INVAL if srcva >= UTOP or srcva is not page-aligned,
-//		or dstva >= UTOP or dstva is not page-aligned.
+//	-E_INVAL if srcva >= UMAPTOP or srcva is not page-aligned,
+//		or dstva >= UMAPTOP or dstva is not page-aligned.
 //	-E_INVAL is srcva is not mapped in srcenvid's address space.
 //	-E_INVAL if perm is inappropriate (see sys_page_alloc).
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
 //		address space.
+//	-E_INVAL if (perm & PTE_PS) does not match srcva's mapping, or
+//		if (perm & PTE_PS) and srcva or dstva is not 2MB-aligned, or
+//		if !(perm & PTE_PS) and dstva is in a 2MB page.
 //	-E_NO_MEM if there's no memory to allocate any necessary page tables.
 static int
 sys_page_map(envid_t srcenvid, void *srcva,
          envid_t dstenvid, void *dstva, int perm)
 {
     int r;
-    struct Env *es, *ed;
+    struct Env *es, *ed, *e1, *e2;
     struct PageInfo *pp;
     pte_t *ppte;
 
-    if (srcva >= (void*) UTOP || dstva >= (void*) UTOP)
+    if (srcva >= (void*) UMAPTOP || dstva >= (void*) UMAPTOP)
         return -E_INVAL;
     if (srcva != ROUNDDOWN(srcva, PGSIZE) || dstva != ROUNDDOWN(dstva, PGSIZE))
         return -E_INVAL;
@@ -232,24 +472,50 @@ sys_page_map(envid_t srcenvid, void *srcva,
     if ((r = envid2env(srcenvid, &es, 1)) < 0
             || (r = envid2env(dstenvid, &ed, 1)) < 0)
         return r;
-    if ((~perm & (PTE_U|PTE_P)) || (perm & ~PTE_SYSCALL))
-        return -E_INVAL;
-    if ((pp = page_lookup(es->env_pml4e, srcva, &ppte)) == 0)
+    if ((~perm & (PTE_U|PTE_P)) || (perm & ~(PTE_SYSCALL|PTE_PS)))
         return -E_INVAL;
-    if ((perm & PTE_W) && !(*ppte & PTE_W))
+    if ((perm & PTE_PS) && ((uintptr_t) srcva % PTSIZE || (uintptr_t) dstva % PTSIZE
+                            || (uintptr_t) dstva + PTSIZE > UMAPTOP))
         return -E_INVAL;
-    if ((r = page_insert(ed->env_pml4e, pp, dstva, perm)) < 0)
-        return r;
-    return 0;
+
+    // Lock both address spaces, lower env first to avoid deadlock.
+    e1 = MIN(es, ed);
+    e2 = MAX(es, ed);
+    env_vm_lock(e1);
+    if (e2 != e1)
+        env_vm_lock(e2);
+    pp = page_lookup(es->env_pml4e, srcva, &ppte);
+    // A shared page, or one mapped writable, needs a page of its own
+    // before it is mapped twice.  One that sys_fork shared before it
+    // had a page is not mapped at all until it gets it.
+    if ((!pp || pp == zero_page) &&
+            (r = page_lazy_alloc(es->env_pml4e, srcva,
+                                 pp && (*ppte & PTE_SHARE) ? PTE_W : perm)) > 0)
+        pp = page_lookup(es->env_pml4e, srcva, &ppte);
+    if (r < 0)
+        /* out of memory */;
+    else if (pp == 0)
+        r = -E_INVAL;
+    else if ((perm & PTE_W) && !(*ppte & PTE_W))
+        r = -E_INVAL;
+    else if ((perm & PTE_PS) != (*ppte & PTE_PS))
+        r = -E_INVAL;
+    else
+        r = page_insert(ed->env_pml4e, pp, dstva, perm);
+    if (e2 != e1)
+        env_vm_unlock(e2);
+    env_vm_unlock(e1);
+    return r;
 }
 
 // Unmap the page of memory at 'va' in the address space of 'envid'.
-// If no page is mapped, the function silently succeeds.
+// If no page is mapped, the function silently succeeds.  If 'va' is
+// in a 2MB page, the whole 2MB page is unmapped.
 //
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
-//	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_INVAL if va >= UMAPTOP, or va is not page-aligned.
 static int
 sys_page_unmap(envid_t envid, void *va)
 {
@@ -258,9 +524,11 @@ sys_page_unmap(envid_t envid, void *va)
 
     if ((r = envid2env(envid, &e, 1)) < 0)
         return r;
-    if (va >= (void*) UTOP || PGOFF(va))
+    if (va >= (void*) UMAPTOP || PGOFF(va))
         return -E_INVAL;
+    env_vm_lock(e);
     page_remove(e->env_pml4e, va);
+    env_vm_unlock(e);
     return 0;
 }
 
@@ -287,6 +555,10 @@ sys_page_unmap(envid_t envid, void *va)
 // then no page mapping is transferred, but no error occurs.
 // The ipc only happens when no errors occur.
 //
+// If perm includes IPC_SG, srcva instead points to a struct IpcSg listing
+// the pages to send, which are mapped one after another at the target's
+// dstva (see sys_ipc_recv), and env_ipc_npages is set to their number.
+//
 // When the environment is a guest (Lab 8, aka the VMM assignment only),
 // srcva should be assumed to be converted to a host virtual address (in
 // the kernel address range).  You will need to add a special case to allow
@@ -305,6 +577,9 @@ sys_page_unmap(envid_t envid, void *va)
 //		address space.
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in the
 //		current environment's address space.
+//	-E_INVAL if (perm & IPC_SG) and the list of pages is invalid, or
+//		holds more pages than the target's window.
+//	-E_FAULT if (perm & IPC_SG) and srcva is not readable.
 //	-E_NO_MEM if there's not enough memory to map srcva in envid's
 //		address space.
 static int
@@ -312,85 +587,19 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 {
     int r;
     struct Env *e;
-    struct PageInfo *pp;
-    pte_t *ppte;
+
     if ((r = envid2env(envid, &e, 0)) < 0)
         return r;
-    if (!e->env_ipc_recving) {
+    e = ipc_endpoint_pick(e);
+    if (!ipc_recving_from(e, curenv)) {
         /* cprintf("[%08x] not recieving!\n", e->env_id); */
         return -E_IPC_NOT_RECV;
     }
-
-    /*  Hint: check if environment is ENV_TYPE_GUEST or not, and if the source or destination 
-     *  is using normal page, use page_insert. Use ept_page_insert() wherever possible. */
-    /* Your code here */
-
-    //If the curenv type is GUEST and the destination va is below UTOP, 
-    //it means that the guest is sending a message to the host and it should insert a page in the host's page table.
-    if(curenv->env_type == ENV_TYPE_GUEST && e->env_ipc_dstva < (void*) UTOP) {
-        pp = pa2page(PADDR(srcva));
-        r = page_insert(e->env_pml4e, pp, e->env_ipc_dstva, perm);
-        if (r < 0) {
-            cprintf("[%08x] sys_ipc_try_send page_insert failure!\n", e->env_id);
-            return -E_INVAL;
-        }
-
-    //If the dest environment is GUEST and the source va is below UTOP, 
-    //it means that the host is sending a message to the guest and it should insert a page in the EPT.
-    } else if(e->env_type == ENV_TYPE_GUEST && srcva < (void*) UTOP) {
-// ept_page_insert fails compile w/o VMM GUEST check
-#ifndef VMM_GUEST
-        pp = page_lookup(curenv->env_pml4e, srcva, &ppte);
-        if(pp == NULL) {
-            cprintf("[%08x] sys_ipc_try_send page_lookup failure!\n", e->env_id);
-            return -E_INVAL;
-        }
-
-        r = ept_page_insert(e->env_pml4e, pp, e->env_ipc_dstva, __EPTE_FULL);
-        if (r < 0) {
-            cprintf("[%08x] sys_ipc_try_send ept_page_insert failure!\n", e->env_id);
-            return -E_INVAL;
-        }
-#endif
-} else if (srcva < (void*) UTOP && e->env_ipc_dstva < (void*) UTOP) {        
-        if ((~perm & (PTE_U|PTE_P)) || (perm & ~PTE_SYSCALL)) {
-            cprintf("[%08x] bad perm %x in sys_ipc_try_send\n", curenv->env_id, perm);
-            return -E_INVAL;
-        }
-
-        pp = page_lookup(curenv->env_pml4e, srcva, &ppte);
-        if (pp == 0) {
-            cprintf("[%08x] page_lookup %08x failed in sys_ipc_try_send\n", curenv->env_id, srcva);
-            return -E_INVAL;
-        }
-
-        if ((perm & PTE_W) && !(*ppte & PTE_W)) {
-            cprintf("[%08x] attempt to send read-only page read-write in sys_ipc_try_send\n", curenv->env_id);
-            return -E_INVAL;
-        }
-
-        r = page_insert(e->env_pml4e, pp, e->env_ipc_dstva, perm);
-        if (r < 0) {
-            cprintf("[%08x] page_insert %08x failed in sys_ipc_try_send (%e)\n", curenv->env_id, srcva, r);
-            return r;
-        }
-
-        e->env_ipc_perm = perm;
-    } else {
-        e->env_ipc_perm = 0;
-    }
-
-    e->env_ipc_recving = 0;
-    e->env_ipc_from = curenv->env_id;
-    e->env_ipc_value = value;
-    e->env_tf.tf_regs.reg_rax = 0;
-    e->env_status = ENV_RUNNABLE;
-
-    // at the end of this function, if the dest environment is GUEST, then the rsi register of the trapframe should be set with 'value'
-    if(e->env_type == ENV_TYPE_GUEST) {
-		e->env_tf.tf_regs.reg_rsi = value;
-	}
-
+    if ((perm & IPC_SG) && (r = ipc_send_prepare(srcva, perm)) < 0)
+        return r;
+    if ((r = ipc_deliver(curenv, e, value, srcva, perm)) < 0)
+        return r;
+    sched_wakeup(e);
     return 0;
 }
 
@@ -400,24 +609,148 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 //
 // If 'dstva' is < UTOP, then you are willing to receive a page of data.
 // 'dstva' is the virtual address at which the sent page should be mapped.
+// IPC_WINDOW(va, n) accepts up to n pages, sent with IPC_SG, at va:
+// the low bits of an unaligned 'dstva' below UTOP hold n - 1, so a
+// page-aligned 'dstva' is a window of one page.
 //
 // This function only returns on error, but the system call will eventually
 // return 0 on success.
 // Return < 0 on error.  Errors are:
-//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_INVAL if dstva < UTOP but the window does not fit below UMAPTOP.
 static int
 sys_ipc_recv(void *dstva)
 {
     if (curenv->env_ipc_recving)
         panic("already recving!");
 
-    curenv->env_ipc_recving = 1;
-    curenv->env_ipc_dstva = dstva;
-    curenv->env_status = ENV_NOT_RUNNABLE;
-    sched_yield();
+    return ipc_recv(dstva);
+}
+
+// Send 'value' (and the page at 'srcva' with 'perm', as for
+// sys_ipc_try_send) to the target env 'envid', blocking until the
+// target receives it.  If the target is not receiving, the caller
+// waits behind any other senders already waiting for it, and the
+// target takes their messages in the order they were sent.
+//
+// If 'timeout_ms' is not 0, give up after that many milliseconds.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist, or is
+//		destroyed before it receives the message.
+//	-E_IPC_NOT_RECV if the timeout expired.
+//	-E_INVAL if envid is the caller.
+//	-E_INVAL if srcva < UTOP and the page cannot be sent with 'perm'
+//		(see sys_ipc_try_send).
+//	-E_NO_MEM if there's not enough memory to map srcva in envid's
+//		address space.
+static int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+             unsigned timeout_ms)
+{
+    int r;
+    struct Env *e;
+
+    if ((r = envid2env(envid, &e, 0)) < 0)
+        return r;
+    return ipc_send_wait(e, value, srcva, perm, timeout_ms);
+}
+
+// Send 'value' (and the page at 'srcva' with 'perm') to the target env
+// 'envid' as for sys_ipc_send, then wait for its reply as for
+// sys_ipc_recv(dstva), in one system call.  Only the target's reply is
+// received; other senders wait until it has arrived.  If the target is
+// already waiting for a request, this CPU runs it straight away.
+//
+// Returns 0 when the reply arrives, < 0 on error.  Errors are as for
+// sys_ipc_send and sys_ipc_recv, and:
+//	-E_BAD_ENV if the target is destroyed before it replies.
+static int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+             void *dstva)
+{
+    int r;
+    struct Env *e;
+
+    if ((r = envid2env(envid, &e, 0)) < 0)
+        return r;
+    return ipc_call(e, value, srcva, perm, dstva);
+}
+
+// Reply to the env 'envid', blocked in sys_ipc_call, with 'value' (and
+// the page at 'srcva' with 'perm'), then receive the next request as
+// for sys_ipc_recv(dstva), in one system call.  The reply does not
+// block: it is dropped if 'envid' is 0, no longer exists, or is not
+// waiting for it.  If no request is waiting, this CPU runs the env
+// replied to straight away.
+//
+// Returns 0 when a request arrives, or an error as for sys_ipc_recv,
+// in which case nothing is replied.
+static int
+sys_ipc_reply_recv(envid_t envid, uint32_t value, void *srcva,
+                   unsigned perm, void *dstva)
+{
+    struct Env *e = NULL;
+
+    if (curenv->env_ipc_recving)
+        panic("already recving!");
+    if (envid && envid2env(envid, &e, 0) < 0)
+        e = NULL;
+    return ipc_reply_recv(e, value, srcva, perm, dstva);
+}
+
+// Set the notification bits 'bits' of the env 'envid', waking it if
+// it is blocked in sys_ipc_notify_wait.  Never blocks.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist.
+//	-E_INVAL if bits has bit 31 set, which could not be returned by
+//		sys_ipc_notify_wait.
+static int
+sys_ipc_notify(envid_t envid, uint32_t bits)
+{
+    int r;
+    struct Env *e;
+
+    if (bits & 0x80000000)
+        return -E_INVAL;
+    if ((r = envid2env(envid, &e, 0)) < 0)
+        return r;
+    ipc_notify(e, bits);
     return 0;
 }
 
+// Make 'member', which must be the caller or its child, a member of
+// the caller's endpoint: from now on 'member' also receives messages
+// sent to the caller, sharing them with the endpoint's other members,
+// and its replies are accepted by the endpoint's callers.  A server
+// forks workers and adds them to serve its clients from several CPUs.
+// Only the endpoint adds members, so an env cannot join another's
+// endpoint on its own.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment member doesn't currently exist, or the
+//		caller doesn't have permission to change it.
+//	-E_INVAL if member is already a member of another endpoint, or
+//		the caller is a member of another endpoint.
+static int
+sys_ipc_join(envid_t member)
+{
+    int r;
+    struct Env *e;
+
+    if ((r = envid2env(member, &e, 1)) < 0)
+        return r;
+    return ipc_join(e);
+}
+
+// Block until another env sends us notifications with sys_ipc_notify,
+// unless some are already pending.  Returns the bits, and clears them.
+static int
+sys_ipc_notify_wait(void)
+{
+    return ipc_notify_wait();
+}
+
 
 // Return the current time.
 static int
@@ -545,12 +878,76 @@ static envid_t
     if ((r = env_guest_alloc(&e, curenv->env_id)) < 0)
         return r;
     e->env_status = ENV_NOT_RUNNABLE;
+    sched_dequeue(e);
     e->env_vmxinfo.phys_sz = gphysz;
     e->env_tf.tf_rip = gRIP;
     return e->env_id;
 }
 #endif //!VMM_GUEST
 
+// Can system call 'num' be part of a batch?  Only calls that return
+// to their caller, and that do not create or destroy environments.
+static bool
+sys_batch_allowed(uint64_t num)
+{
+    switch (num) {
+    case SYS_cputs:
+    case SYS_getenvid:
+    case SYS_page_alloc:
+    case SYS_page_map:
+    case SYS_page_unmap:
+    case SYS_env_set_status:
+    case SYS_env_set_trapframe:
+    case SYS_env_set_pgfault_upcall:
+    case SYS_env_set_sched:
+    case SYS_env_set_affinity:
+    case SYS_ipc_try_send:
+    case SYS_ipc_notify:
+    case SYS_time_msec:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Run the 'n' system calls described by 'calls' in order, in a single
+// kernel entry, storing each one's return value in its sc_ret.  Stops
+// at the first call that fails.  Calls in the batch may remap the
+// pages holding 'calls'; results that could no longer be stored stop
+// the batch with -E_FAULT.
+//
+// Returns the number of calls that succeeded, or < 0 on error.
+// Errors are:
+//	-E_INVAL if n is greater than SYSCALL_BATCH_MAX.
+//	-E_FAULT if 'calls' stopped being writable part way through.
+static int
+sys_batch(struct Syscall *calls, unsigned n)
+{
+    struct Syscall sc;
+    unsigned i;
+
+    if (n > SYSCALL_BATCH_MAX)
+        return -E_INVAL;
+    user_mem_assert(curenv, calls, n * sizeof(struct Syscall), PTE_U | PTE_W);
+
+    for (i = 0; i < n; i++) {
+        if (user_mem_check(curenv, &calls[i], sizeof(sc), PTE_U | PTE_W) < 0)
+            return -E_FAULT;
+        sc = calls[i];
+        if (sys_batch_allowed(sc.sc_num))
+            sc.sc_ret = syscall(sc.sc_num, sc.sc_args[0], sc.sc_args[1],
+                                sc.sc_args[2], sc.sc_args[3], sc.sc_args[4]);
+        else
+            sc.sc_ret = -E_INVAL;
+        if (user_mem_check(curenv, &calls[i].sc_ret, sizeof(sc.sc_ret), PTE_U | PTE_W) < 0)
+            return -E_FAULT;
+        calls[i].sc_ret = sc.sc_ret;
+        if (sc.sc_ret < 0)
+            break;
+    }
+    return i;
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int64_t
 syscall(uint64_t syscallno, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4, uint64_t a5)
@@ -593,6 +990,26 @@ syscall(uint64_t syscallno, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4,
         return sys_net_transmit((const void*)a1, a2);
     case SYS_net_receive:
         return sys_net_receive((void*)a1, a2);
+    case SYS_env_set_sched:
+        return sys_env_set_sched(a1, a2, a3);
+    case SYS_env_set_affinity:
+        return sys_env_set_affinity(a1, a2);
+    case SYS_batch:
+        return sys_batch((struct Syscall*) a1, a2);
+    case SYS_fork:
+        return sys_fork();
+    case SYS_ipc_send:
+        return sys_ipc_send(a1, a2, (void*) a3, a4, a5);
+    case SYS_ipc_call:
+        return sys_ipc_call(a1, a2, (void*) a3, a4, (void*) a5);
+    case SYS_ipc_reply_recv:
+        return sys_ipc_reply_recv(a1, a2, (void*) a3, a4, (void*) a5);
+    case SYS_ipc_notify:
+        return sys_ipc_notify(a1, a2);
+    case SYS_ipc_notify_wait:
+        return sys_ipc_notify_wait();
+    case SYS_ipc_join:
+        return sys_ipc_join(a1);
 #ifndef VMM_GUEST
     case SYS_ept_map:
         return sys_ept_map(a1, (void*) a2, a3, (void*) a4, a5);
@@ -615,6 +1032,90 @@ syscall(uint64_t syscallno, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4,
     }
 }
 
+// Handle the system calls that touch only the calling environment's
+// own state, and notifications that wake no one.  These run before
+// trap() takes the big kernel lock, so they can proceed on every CPU
+// at once; they rely on the page allocator's lock, the caller's
+// address space lock and the notification locks instead.
+//
+// Returns true if the call was handled and its result stored in 'tf',
+// or false if it must go through syscall() under the big kernel lock.
+bool
+syscall_nolock(struct Trapframe *tf)
+{
+    uint64_t a1 = tf->tf_regs.reg_rdx;
+    uint64_t a2 = tf->tf_regs.reg_rcx;
+    uint64_t a3 = tf->tf_regs.reg_rbx;
+    uint64_t a4 = tf->tf_regs.reg_rdi;
+    uint64_t a5 = tf->tf_regs.reg_rsi;
+    int64_t r;
+
+    // A zombie has to be reaped under the lock.
+    if (curenv->env_status != ENV_RUNNING)
+        return false;
+
+    switch (tf->tf_regs.reg_rax) {
+    case SYS_getenvid:
+        r = sys_getenvid();
+        break;
+    case SYS_time_msec:
+        r = sys_time_msec();
+        break;
+    case SYS_cputs:
+        // Hold our mappings steady while the kernel reads the string.
+        // A bad pointer destroys the env, which needs the kernel lock.
+        env_vm_lock(curenv);
+        if (user_mem_check(curenv, (void *) a1, a2, PTE_U) < 0) {
+            env_vm_unlock(curenv);
+            return false;
+        }
+        sys_cputs((const char *) a1, a2);
+        env_vm_unlock(curenv);
+        r = 0;
+        break;
+    case SYS_env_set_pgfault_upcall:
+        if (!SYSCALL_SELF(a1))
+            return false;
+        r = sys_env_set_pgfault_upcall(a1, (void *) a2);
+        break;
+    case SYS_page_alloc:
+        if (!SYSCALL_SELF(a1))
+            return false;
+        r = sys_page_alloc(a1, (void *) a2, a3);
+        break;
+    case SYS_page_map:
+        if (!SYSCALL_SELF(a1) || !SYSCALL_SELF(a3))
+            return false;
+        r = sys_page_map(a1, (void *) a2, a3, (void *) a4, a5);
+        break;
+    case SYS_page_unmap:
+        if (!SYSCALL_SELF(a1))
+            return false;
+        r = sys_page_unmap(a1, (void *) a2);
+        break;
+    case SYS_ipc_notify: {
+        int nr;
+
+        // Only a notification that wakes its target needs the lock.
+        if (a2 & 0x80000000)
+            nr = -E_INVAL;
+        else if (!ipc_notify_nolock(a1, a2, &nr))
+            return false;
+        r = nr;
+        break;
+    }
+    case SYS_ipc_notify_wait:
+        // Only a wait that blocks needs the lock.
+        if (!(r = ipc_notify_take()))
+            return false;
+        break;
+    default:
+        return false;
+    }
+    tf->tf_regs.reg_rax = r;
+    return true;
+}
+
 #ifdef TEST_EPT_MAP
 int
 _export_sys_ept_map(envid_t srcenvid, void *srcva,
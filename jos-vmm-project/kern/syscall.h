@@ -6,7 +6,9 @@
 #endif
 
 #include <inc/syscall.h>
+#include <inc/trap.h>
 
 int64_t syscall(uint64_t num, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4, uint64_t a5);
+bool syscall_nolock(struct Trapframe *tf);
 
 #endif /* !JOS_KERN_SYSCALL_H */
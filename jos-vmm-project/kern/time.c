@@ -1,17 +1,22 @@
 #line 2 "../kern/time.c"
 #include <kern/time.h>
+#include <kern/cpu.h>
 #include <inc/assert.h>
+#include <inc/x86.h>
 
 static unsigned int ticks;
+static uint64_t tsc_base;
 
 void
 time_init(void)
 {
 	ticks = 0;
+	tsc_base = read_tsc();
 }
 
-// This should be called once per timer interrupt.  A timer interrupt
-// fires every 10 ms.
+// This should be called once per timer interrupt on CPU 0.  It keeps
+// the time only if the TSC rate is unknown (no local APIC), in which
+// case we assume the timer interrupt fires every 10 ms.
 void
 time_tick(void)
 {
@@ -23,5 +28,9 @@ time_tick(void)
 unsigned int
 time_msec(void)
 {
+	// The timer is one-shot and stopped on idle CPUs, so timer
+	// interrupts no longer come at a fixed rate; use the TSC.
+	if (lapic_tsc_per_ms)
+		return (read_tsc() - tsc_base) / lapic_tsc_per_ms;
 	return ticks * 10;
 }
@@ -4,6 +4,7 @@
 #include <inc/assert.h>
 
 #include <kern/pmap.h>
+#include <kern/fpu.h>
 #include <kern/trap.h>
 #include <kern/console.h>
 #include <kern/monitor.h>
@@ -69,6 +70,10 @@ static const char *trapname(int trapno)
 		return excnames[trapno];
 	if (trapno == T_SYSCALL)
 		return "System call";
+	if (trapno == IRQ_OFFSET + IRQ_RESCHED)
+		return "Reschedule IPI";
+	if (trapno == IRQ_OFFSET + IRQ_TLB)
+		return "TLB shootdown IPI";
 #line 76 "../kern/trap.c"
 	if (trapno >= IRQ_OFFSET && trapno < IRQ_OFFSET + 16)
 		return "Hardware Interrupt";
@@ -90,7 +95,7 @@ trap_init(void)
 	extern char
 		Xirq0,Xirq1,Xirq2,Xirq3,Xirq4,Xirq5,
 		Xirq6,Xirq7,Xirq8,Xirq9,Xirq10,Xirq11,
-		Xirq12,Xirq13,Xirq14,Xirq15;
+		Xirq12,Xirq13,Xirq14,Xirq15,Xresched,Xtlb;
 #line 98 "../kern/trap.c"
 	int i;
 
@@ -138,6 +143,8 @@ trap_init(void)
 	SETGATE(idt[IRQ_OFFSET + 13], 0, GD_KT, &Xirq13, 0);
 	SETGATE(idt[IRQ_OFFSET + 14], 0, GD_KT, &Xirq14, 0);
 	SETGATE(idt[IRQ_OFFSET + 15], 0, GD_KT, &Xirq15, 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_RESCHED], 0, GD_KT, &Xresched, 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_TLB], 0, GD_KT, &Xtlb, 0);
 #line 145 "../kern/trap.c"
 
 	// Use DPL=3 here because system calls are explicitly invoked
@@ -194,6 +201,19 @@ trap_init_percpu(void)
 
 	// Load the IDT
 	lidt(&idt_pd);
+
+#ifndef VMM_GUEST
+	// Let user environments enter the kernel with SYSCALL as well as
+	// with 'int $T_SYSCALL'.  SYSCALL loads CS from STAR[47:32] and SS
+	// from the following descriptor; SYSRET loads SS and CS from the
+	// two descriptors after STAR[63:48].  Interrupts stay off until
+	// Xsyscall_fast is on the kernel stack.
+	extern char Xsyscall_fast;
+	write_msr(STAR_MSR, ((uint64_t) GD_KD << 48) | ((uint64_t) GD_KT << 32));
+	write_msr(LSTAR_MSR, (uint64_t) &Xsyscall_fast);
+	write_msr(SFMASK_MSR, FL_IF | FL_TF | FL_DF | FL_AC);
+	write_msr(EFER_MSR, read_msr(EFER_MSR) | (1 << EFER_SCE));
+#endif
 }
 
 void
@@ -317,6 +337,18 @@ trap_dispatch(struct Trapframe *tf)
 #line 352 "../kern/trap.c"
 		sched_yield();
 	}
+
+	// Another CPU queued work while we were halted.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_RESCHED) {
+		lapic_eoi();
+		sched_yield();
+	}
+
+	// A TLB shootdown that trap() has already done.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TLB) {
+		lapic_eoi();
+		return;
+	}
 #line 355 "../kern/trap.c"
 
 #line 358 "../kern/trap.c"
@@ -358,6 +390,10 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
+	// Another CPU may be waiting for us to flush our TLB, and may
+	// hold the big kernel lock while it does.
+	tlb_set_user(false);
+
 	// Re-acqurie the big kernel lock if we were halted in
 	// sched_yield()
 	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
@@ -371,14 +407,27 @@ trap(struct Trapframe *tf)
 #line 411 "../kern/trap.c"
 	if ((tf->tf_cs & 3) == 3) {
 		// Trapped from user mode.
+		assert(curenv);
+
+		// System calls that only touch the caller's own state,
+		// and notifications that wake no one, return straight to
+		// it without the big kernel lock.
+		if (tf->tf_trapno == T_SYSCALL && syscall_nolock(tf))
+			env_pop_tf(tf);
+		if (tf->tf_trapno == IRQ_OFFSET + IRQ_TLB) {
+			lapic_eoi();
+			env_pop_tf(tf);
+		}
+		// The env's first use of the FPU since it was switched in.
+		if (tf->tf_trapno == T_DEVICE && fpu_load(curenv) == 0)
+			env_pop_tf(tf);
 #line 414 "../kern/trap.c"
 		// Acquire the big kernel lock before doing any
 		// serious kernel work.
 		// LAB 4: Your code here.
 #line 418 "../kern/trap.c"
 		lock_kernel();
-#line 421 "../kern/trap.c"
-		assert(curenv);
+		tlb_shootdown_recv();
 #line 423 "../kern/trap.c"
 
 		// Garbage collect if current enviroment is a zombie
@@ -409,7 +458,7 @@ trap(struct Trapframe *tf)
 	// If we made it to this point, then no other environment was
 	// scheduled, so we should return to the current environment
 	// if doing so makes sense.
-	if (curenv && curenv->env_status == ENV_RUNNING)
+	if (curenv && curenv->env_status == ENV_RUNNING && !thiscpu->cpu_resched)
 		env_run(curenv);
 	else
 		sched_yield();
@@ -435,6 +484,14 @@ page_fault_handler(struct Trapframe *tf)
 	}
 #line 485 "../kern/trap.c"
 
+	// The first write to a lazily allocated page gets it a page of
+	// its own, and the first touch of one that fork shared before it
+	// had a page gets it that page, without bothering the environment.
+	if (fault_va < UTOP &&
+	    page_lazy_fault(curenv, (void *) fault_va,
+			    (tf->tf_err & FEC_WR) ? PTE_W : 0) > 0)
+		return;
+
 #line 487 "../kern/trap.c"
 	// See if the environment has installed a user page fault handler.
 	if (curenv->env_pgfault_upcall == 0) {
@@ -0,0 +1,47 @@
+#line 2 "../lib/batch.c"
+// Batched system calls: queue up system calls and run them all with a
+// single SYS_batch kernel entry.
+
+#include <inc/lib.h>
+
+// Queue system call 'num' on batch 'b', first running whatever 'b'
+// already holds if it is full.
+// Returns 0 on success, or the error of the first queued call that
+// failed.
+int
+batch_add(struct SyscallBatch *b, int num, uint64_t a1, uint64_t a2,
+	  uint64_t a3, uint64_t a4, uint64_t a5)
+{
+	struct Syscall *sc;
+	int r;
+
+	if (b->sb_n == SYSCALL_BATCH_MAX && (r = batch_flush(b)) < 0)
+		return r;
+	sc = &b->sb_calls[b->sb_n++];
+	sc->sc_num = num;
+	sc->sc_args[0] = a1;
+	sc->sc_args[1] = a2;
+	sc->sc_args[2] = a3;
+	sc->sc_args[3] = a4;
+	sc->sc_args[4] = a5;
+	return 0;
+}
+
+// Run the calls queued on batch 'b', in order, and empty it.
+// Returns 0 if they all succeeded.  Otherwise returns the error of the
+// first call that failed; the calls after it were not run.
+int
+batch_flush(struct SyscallBatch *b)
+{
+	unsigned n = b->sb_n;
+	int r;
+
+	b->sb_n = 0;
+	if (n == 0)
+		return 0;
+	if ((r = sys_batch(b->sb_calls, n)) < 0)
+		return r;
+	if (r < n)
+		return b->sb_calls[r].sc_ret;
+	return 0;
+}
@@ -0,0 +1,149 @@
+#line 2 "../lib/chan.c"
+// Asynchronous message channels between two environments.
+// See inc/chan.h for the layout of the shared page.
+
+#include <inc/lib.h>
+
+// Which end of 'ch' is this environment?
+static int
+chan_side(struct Chan *ch)
+{
+	return ch->ch_end[1].ce_env == thisenv->env_id;
+}
+
+// Allocate a channel page at 'ch', which must be page-aligned, with
+// this environment at end 0, to be woken with notification bit 'bit'.
+// The page is shared with children rather than copied on fork.  Give
+// it to the other end, by IPC or fork, and have that call chan_accept.
+// Returns 0 on success, < 0 on error.
+int
+chan_create(struct Chan *ch, unsigned bit)
+{
+	int r;
+
+	static_assert(sizeof(struct Chan) <= PGSIZE);
+	if (bit > CHAN_MAXBIT)
+		return -E_INVAL;
+	if ((r = sys_page_alloc(0, ch, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		return r;
+	// The new page is zeroed, so both rings start out empty.
+	ch->ch_end[0].ce_bit = bit;
+	ch->ch_end[0].ce_env = thisenv->env_id;
+	return 0;
+}
+
+// Become end 1 of the channel at 'ch', to be woken with notification
+// bit 'bit'.  Messages sent before this are not lost; the creator just
+// cannot wake us until we have accepted.
+// Returns 0 on success, < 0 on error.
+int
+chan_accept(struct Chan *ch, unsigned bit)
+{
+	if (bit > CHAN_MAXBIT || ch->ch_end[1].ce_env)
+		return -E_INVAL;
+	ch->ch_end[1].ce_bit = bit;
+	// The peer must never see our envid with a stale bit.
+	asm volatile("" : : : "memory");
+	ch->ch_end[1].ce_env = thisenv->env_id;
+	return 0;
+}
+
+// Queue 'm' for the other end of 'ch'.  Makes a system call only if
+// the other end is asleep waiting for a message.
+// Returns 0 on success, or -E_NO_MEM if the ring is full.
+int
+chan_send(struct Chan *ch, const struct ChanMsg *m)
+{
+	int peer = !chan_side(ch);
+	struct ChanRing *ring = &ch->ch_ring[peer];
+	uint32_t tail = ring->cr_tail;
+
+	if (tail - ring->cr_head == CHAN_NSLOTS)
+		return -E_NO_MEM;
+	ring->cr_slots[tail % CHAN_NSLOTS] = *m;
+	// x86 does not reorder stores, but the compiler might.
+	asm volatile("" : : : "memory");
+	ring->cr_tail = tail + 1;
+
+	// The new tail must be visible before we look at cr_waiting, or
+	// we could miss the peer deciding to sleep on an empty ring.
+	asm volatile("mfence" : : : "memory");
+	if (ring->cr_waiting && ch->ch_end[peer].ce_env) {
+		ring->cr_waiting = 0;
+		sys_ipc_notify(ch->ch_end[peer].ce_env,
+			       1 << ch->ch_end[peer].ce_bit);
+	}
+	return 0;
+}
+
+// Is there a message waiting for this end of 'ch'?
+bool
+chan_ready(struct Chan *ch)
+{
+	struct ChanRing *ring = &ch->ch_ring[chan_side(ch)];
+
+	return ring->cr_head != ring->cr_tail;
+}
+
+// Take the next message for this end of 'ch' into 'm', without
+// blocking.  Returns true if there was one.
+bool
+chan_poll(struct Chan *ch, struct ChanMsg *m)
+{
+	struct ChanRing *ring = &ch->ch_ring[chan_side(ch)];
+	uint32_t head = ring->cr_head;
+
+	if (head == ring->cr_tail)
+		return false;
+	asm volatile("" : : : "memory");
+	*m = ring->cr_slots[head % CHAN_NSLOTS];
+	// Finish reading the slot before handing it back.
+	asm volatile("" : : : "memory");
+	ring->cr_head = head + 1;
+	return true;
+}
+
+static void
+chan_set_waiting(struct Chan **chs, int n, uint32_t waiting)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		chs[i]->ch_ring[chan_side(chs[i])].cr_waiting = waiting;
+}
+
+static bool
+chan_any_ready(struct Chan **chs, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (chan_ready(chs[i]))
+			return true;
+	return false;
+}
+
+// Block until at least one of the 'n' channels in 'chs' has a message
+// for this end.  A server can wait on all its clients' channels at once.
+void
+chan_wait(struct Chan **chs, int n)
+{
+	while (!chan_any_ready(chs, n)) {
+		chan_set_waiting(chs, n, 1);
+		// Check again now that the peers can see we are waiting,
+		// in case a message arrived before they could.
+		asm volatile("mfence" : : : "memory");
+		if (!chan_any_ready(chs, n))
+			sys_ipc_notify_wait();
+		chan_set_waiting(chs, n, 0);
+	}
+}
+
+// Take the next message for this end of 'ch' into 'm', blocking until
+// there is one.
+void
+chan_recv(struct Chan *ch, struct ChanMsg *m)
+{
+	while (!chan_poll(ch, m))
+		chan_wait(&ch, 1);
+}
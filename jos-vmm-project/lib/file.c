@@ -13,6 +13,19 @@
 
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 
+// Pages of file data sent along with fsipcbuf in a large read or write,
+// so it takes one round trip to the file server.
+#define FSIPC_DATA	((uint8_t *) 0xE0000000)
+
+static envid_t
+fsipc_env(void)
+{
+	static envid_t fsenv;
+	if (fsenv == 0)
+		fsenv = ipc_find_env(ENV_TYPE_FS);
+	return fsenv;
+}
+
 // Send an inter-environment request to the file server, and wait for
 // a reply.  The request body should be in fsipcbuf, and parts of the
 // response may be written back to fsipcbuf.
@@ -22,17 +35,36 @@ union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 static int
 fsipc(unsigned type, void *dstva)
 {
-	static envid_t fsenv;
-	if (fsenv == 0)
-		fsenv = ipc_find_env(ENV_TYPE_FS);
-
 	//static_assert(sizeof(fsipcbuf) == PGSIZE);
 
 	if (debug)
 		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+	return ipc_call(fsipc_env(), type, &fsipcbuf, PTE_P | PTE_W | PTE_U,
+			dstva, NULL);
+}
+
+// Like fsipc, but send the first 'ndata' pages at FSIPC_DATA along with
+// fsipcbuf, which the caller must have staged with ipc_stage().
+static int
+fsipc_data(unsigned type, size_t ndata)
+{
+	struct IpcSg sg;
+
+	if (ndata == 0)
+		return fsipc(type, NULL);
+
+	if (debug)
+		cprintf("[%08x] fsipc %d %08x + %d pages\n", thisenv->env_id,
+			type, *(uint32_t *)&fsipcbuf, ndata);
+
+	sg.is_n = 2;
+	sg.is_ranges[0].ir_va = &fsipcbuf;
+	sg.is_ranges[0].ir_npages = 1;
+	sg.is_ranges[1].ir_va = FSIPC_DATA;
+	sg.is_ranges[1].ir_npages = ndata;
+	return ipc_call(fsipc_env(), type, &sg,
+			PTE_P | PTE_W | PTE_U | IPC_SG, NULL, NULL);
 }
 
 static int devfile_flush(struct Fd *fd);
@@ -125,15 +157,24 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	// bytes read will be written back to fsipcbuf by the file
 	// system server.
 #line 131 "../lib/file.c"
+	size_t ndata = 0;
 	int r;
 
+	// Have the server read anything past the first page straight
+	// into data pages sent with the request.
+	if (n > PGSIZE)
+		ndata = MIN((n - 1) / PGSIZE, FSIPC_MAXPAGES);
+	if ((r = ipc_stage(FSIPC_DATA, ndata)) < 0)
+		return r;
 	fsipcbuf.read.req_fileid = fd->fd_file.id;
 	fsipcbuf.read.req_n = n;
-	if ((r = fsipc(FSREQ_READ, NULL)) < 0)
+	if ((r = fsipc_data(FSREQ_READ, ndata)) < 0)
 		return r;
 	assert(r <= n);
-	assert(r <= PGSIZE);
-	memmove(buf, &fsipcbuf, r);
+	assert(r <= (1 + ndata) * PGSIZE);
+	memmove(buf, &fsipcbuf, MIN(r, PGSIZE));
+	if (r > PGSIZE)
+		memmove((uint8_t *) buf + PGSIZE, FSIPC_DATA, r - PGSIZE);
 	return r;
 #line 145 "../lib/file.c"
 }
@@ -151,13 +192,20 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 	// remember that write is always allowed to write *fewer*
 	// bytes than requested.
 #line 160 "../lib/file.c"
+	size_t first, ndata;
 	int r;
 
-	n = MIN(n, sizeof(fsipcbuf.write.req_buf));
+	// req_buf runs on from the request page into the data pages.
+	n = MIN(n, FSREQ_WRITE_MAX(1 + FSIPC_MAXPAGES));
+	first = MIN(n, FSREQ_WRITE_MAX(1));
+	ndata = ROUNDUP(n - first, PGSIZE) / PGSIZE;
+	if ((r = ipc_stage(FSIPC_DATA, ndata)) < 0)
+		return r;
 	fsipcbuf.write.req_fileid = fd->fd_file.id;
 	fsipcbuf.write.req_n = n;
-	memmove(fsipcbuf.write.req_buf, buf, n);
-	if ((r = fsipc(FSREQ_WRITE, NULL)) < 0)
+	memmove(fsipcbuf.write.req_buf, buf, first);
+	memmove(FSIPC_DATA, (const uint8_t *) buf + first, n - first);
+	if ((r = fsipc_data(FSREQ_WRITE, ndata)) < 0)
 		return r;
 	assert(r <= n);
 	return r;
@@ -10,7 +10,13 @@
 
 // PTE_COW marks copy-on-write page table entries.
 // It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
+// Should fork() have the kernel copy the address space with sys_fork,
+// rather than copy it page by page itself?
+bool fork_in_kernel = true;
+
+// fork() queues the page mappings for the child here and has the
+// kernel make them in batches, rather than trapping twice per page.
+static struct SyscallBatch fork_batch;
 
 //
 // Custom page fault handler - if faulting page is copy-on-write,
@@ -68,7 +74,7 @@ duppage(envid_t envid, unsigned pn)
 
 #line 89 "../lib/fork.c"
 	void *addr;
-	pte_t pte;
+	pte_t pte, perm;
 
 	addr = (void*) (uint64_t)(pn << PGSHIFT);
 	pte = uvpt[pn];
@@ -76,7 +82,13 @@ duppage(envid_t envid, unsigned pn)
 #line 96 "../lib/fork.c"
 	// if the page is just read-only or is library-shared, map it directly.
 	if (!(pte & (PTE_W|PTE_COW)) || (pte & PTE_SHARE)) {
-		if ((r = sys_page_map(0, addr, envid, addr, pte & PTE_SYSCALL)) < 0)
+		perm = pte & PTE_SYSCALL;
+		// A lazily allocated PTE_SHARE page gets its page when it is
+		// mapped, and is writable from then on.
+		if ((pte & (PTE_SHARE|PTE_ZERO)) == (PTE_SHARE|PTE_ZERO))
+			perm = (perm & ~PTE_ZERO) | PTE_P | PTE_W;
+		if ((r = batch_add(&fork_batch, SYS_page_map, 0, (uint64_t) addr,
+				   envid, (uint64_t) addr, perm)) < 0)
 			panic("sys_page_map: %e", r);
 		return 0;
 	}
@@ -95,15 +107,67 @@ duppage(envid_t envid, unsigned pn)
 	// address space, we need to mark it copy-on-write again after
 	// the first sys_page_map, just in case a page fault has caused
 	// us to copy the page in the interim.
+	//
+	// The pages holding fork_batch itself are mapped right away: the
+	// kernel cannot store the batch's results once a call in the batch
+	// has made them copy-on-write.
+
+	if ((uintptr_t) addr < (uintptr_t) (&fork_batch + 1) &&
+	    (uintptr_t) addr + PGSIZE > (uintptr_t) &fork_batch) {
+		if ((r = batch_flush(&fork_batch)) < 0)
+			panic("sys_page_map: %e", r);
+		if ((r = sys_page_map(0, addr, envid, addr, PTE_P|PTE_U|PTE_COW)) < 0)
+			panic("sys_page_map: %e", r);
+		if ((r = sys_page_map(0, addr, 0, addr, PTE_P|PTE_U|PTE_COW)) < 0)
+			panic("sys_page_map: %e", r);
+		return r;
+	}
 
-	if ((r = sys_page_map(0, addr, envid, addr, PTE_P|PTE_U|PTE_COW)) < 0)
+	if ((r = batch_add(&fork_batch, SYS_page_map, 0, (uint64_t) addr,
+			   envid, (uint64_t) addr, PTE_P|PTE_U|PTE_COW)) < 0)
 		panic("sys_page_map: %e", r);
-	if ((r = sys_page_map(0, addr, 0, addr, PTE_P|PTE_U|PTE_COW)) < 0)
+	if ((r = batch_add(&fork_batch, SYS_page_map, 0, (uint64_t) addr,
+			   0, (uint64_t) addr, PTE_P|PTE_U|PTE_COW)) < 0)
 		panic("sys_page_map: %e", r);
 	return r;
 #line 135 "../lib/fork.c"
 }
 
+// Map the 2MB page at page number pn into the target envid at the same
+// virtual address.  2MB pages are not copied on write: a writable one
+// that is not PTE_SHARE is copied into a new 2MB page for envid, through
+// a temporary mapping at UTEMPLARGE, and the rest are shared.
+static void
+duphugepage(envid_t envid, unsigned pn)
+{
+	void *addr = (void *) ((uint64_t) pn << PGSHIFT);
+	pde_t pde = uvpd[pn >> 9];
+	unsigned tn;
+	int i, r;
+
+	if (!(pde & (PTE_W|PTE_COW)) || (pde & PTE_SHARE)) {
+		if ((r = batch_add(&fork_batch, SYS_page_map, 0, (uint64_t) addr,
+				   envid, (uint64_t) addr,
+				   PTE_PS | (pde & PTE_SYSCALL))) < 0)
+			panic("sys_page_map: %e", r);
+		return;
+	}
+
+	// Mapping the copy would unmap whatever is at UTEMPLARGE.
+	tn = PGNUM(UTEMPLARGE);
+	if ((uvpde[tn >> 18] & PTE_P) && (uvpd[tn >> 9] & PTE_P))
+		for (i = 0; i < NPTENTRIES; i++)
+			if ((uvpd[tn >> 9] & PTE_PS) || (uvpt[tn + i] & PTE_P))
+				panic("duphugepage: UTEMPLARGE is in use");
+	if ((r = sys_page_alloc(envid, addr, PTE_PS | (pde & PTE_SYSCALL))) < 0)
+		panic("sys_page_alloc: %e", r);
+	if ((r = sys_page_map(envid, addr, 0, UTEMPLARGE, PTE_P|PTE_U|PTE_W|PTE_PS)) < 0)
+		panic("sys_page_map: %e", r);
+	memmove(UTEMPLARGE, addr, PTSIZE);
+	if ((r = sys_page_unmap(0, UTEMPLARGE)) < 0)
+		panic("sys_page_unmap: %e", r);
+}
+
 //
 // User-level fork with copy-on-write.
 // Set up our page fault handler appropriately.
@@ -129,6 +193,14 @@ fork(void)
 
 	set_pgfault_handler(pgfault);
 
+	// Have the kernel copy our address space in one go?
+	if (fork_in_kernel) {
+		envid = sys_fork();
+		if (envid == 0)
+			thisenv = &envs[ENVX(sys_getenvid())];
+		return envid;
+	}
+
 	// Create a child.
 	envid = sys_exofork();
 	if (envid < 0)
@@ -144,8 +216,14 @@ fork(void)
 			pn += NPTENTRIES;
 			continue;
 		}
+		if (uvpd[pn >> 9] & PTE_PS) {
+			duphugepage(envid, pn);
+			pn += NPTENTRIES;
+			continue;
+		}
 		for (end_pn = pn + NPTENTRIES; pn < end_pn; pn++) {
-			if ((uvpt[pn] & (PTE_P|PTE_U)) != (PTE_P|PTE_U))
+			if ((uvpt[pn] & (PTE_P|PTE_U)) != (PTE_P|PTE_U) &&
+			    !PTE_LAZYSHARE(uvpt[pn]))
 				continue;
 			if (pn == PPN(UXSTACKTOP - 1))
 				continue;
@@ -154,17 +232,23 @@ fork(void)
 	}
 
 	// The child needs to start out with a valid exception stack.
-	if ((r = sys_page_alloc(envid, (void*) (UXSTACKTOP - PGSIZE), PTE_P|PTE_U|PTE_W)) < 0)
-		panic("allocating exception stack: %e", r);
+	if ((r = batch_add(&fork_batch, SYS_page_alloc, envid,
+			   UXSTACKTOP - PGSIZE, PTE_P|PTE_U|PTE_W, 0, 0)) < 0)
+		panic("fork: %e", r);
 
 	// Copy the user-mode exception entrypoint.
-	if ((r = sys_env_set_pgfault_upcall(envid, thisenv->env_pgfault_upcall)) < 0)
-		panic("sys_env_set_pgfault_upcall: %e", r);
-
+	if ((r = batch_add(&fork_batch, SYS_env_set_pgfault_upcall, envid,
+			   (uint64_t) thisenv->env_pgfault_upcall, 0, 0, 0)) < 0)
+		panic("fork: %e", r);
 
 	// Okay, the child is ready for life on its own.
-	if ((r = sys_env_set_status(envid, ENV_RUNNABLE)) < 0)
-		panic("sys_env_set_status: %e", r);
+	if ((r = batch_add(&fork_batch, SYS_env_set_status, envid,
+			   ENV_RUNNABLE, 0, 0, 0)) < 0)
+		panic("fork: %e", r);
+
+	// Make all the queued mappings, and only then start the child.
+	if ((r = batch_flush(&fork_batch)) < 0)
+		panic("fork: %e", r);
 
 	return envid;
 #line 204 "../lib/fork.c"
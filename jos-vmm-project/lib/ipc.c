@@ -47,13 +47,9 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 }
 
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
-// This function keeps trying until it succeeds.
-// It should panic() on any error other than -E_IPC_NOT_RECV.
-//
-// Hint:
-//   Use sys_yield() to be CPU-friendly.
-//   If 'pg' is null, pass sys_ipc_recv a value that it will understand
-//   as meaning "no page".  (Zero is not the right value.)
+// This function blocks in the kernel until 'toenv' receives the
+// message, queued behind any other senders that got there first.
+// It panics on any error.
 void
 ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 {
@@ -61,13 +57,97 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 
 	if (!pg)
 		pg = (void*) UTOP;
-	while ((r = sys_ipc_try_send(to_env, val, pg, perm)) == -E_IPC_NOT_RECV) {
-		sys_yield();
-	}
-	if (r < 0)
+	if ((r = sys_ipc_send(to_env, val, pg, perm, 0)) < 0)
 		panic("error in ipc_send: %e", r);
 }
 
+// Like ipc_send, but give up after 'timeout_ms' milliseconds, and
+// return errors rather than panic.
+// Returns 0 on success, -E_IPC_NOT_RECV if 'toenv' did not receive
+// the message in time, or another error as for sys_ipc_send.
+int
+ipc_send_timeout(envid_t to_env, uint32_t val, void *pg, int perm,
+		 unsigned timeout_ms)
+{
+	if (!pg)
+		pg = (void*) UTOP;
+	return sys_ipc_send(to_env, val, pg, perm, timeout_ms);
+}
+
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env' and
+// wait for its reply, like ipc_send followed by ipc_recv but in one
+// system call, and accepting only the reply from 'to_env'.
+// 'rcv_pg' and 'perm_store' are as for ipc_recv.
+// Returns the value of the reply, or < 0 if the call failed.
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm,
+	 void *rcv_pg, int *perm_store)
+{
+	int r;
+
+	if (!pg)
+		pg = (void*) UTOP;
+	if (!rcv_pg)
+		rcv_pg = (void*) UTOP;
+	if ((r = sys_ipc_call(to_env, val, pg, perm, rcv_pg)) < 0) {
+		if (perm_store)
+			*perm_store = 0;
+		return r;
+	}
+	if (perm_store)
+		*perm_store = thisenv->env_ipc_perm;
+	return thisenv->env_ipc_value;
+}
+
+// Reply 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env',
+// which is waiting in ipc_call, then receive the next request as
+// ipc_recv does, in one system call.  If 'to_env' is 0, only receive.
+// The reply is dropped if 'to_env' is no longer waiting for it.
+int32_t
+ipc_reply_recv(envid_t to_env, uint32_t val, void *pg, int perm,
+	       envid_t *from_env_store, void *rcv_pg, int *perm_store)
+{
+	int r;
+
+	if (!pg)
+		pg = (void*) UTOP;
+	if (!rcv_pg)
+		rcv_pg = (void*) UTOP;
+	if ((r = sys_ipc_reply_recv(to_env, val, pg, perm, rcv_pg)) < 0) {
+		if (from_env_store)
+			*from_env_store = 0;
+		if (perm_store)
+			*perm_store = 0;
+		return r;
+	}
+	if (from_env_store)
+		*from_env_store = thisenv->env_ipc_from;
+	if (perm_store)
+		*perm_store = thisenv->env_ipc_perm;
+	return thisenv->env_ipc_value;
+}
+
+// Make sure the 'npages' pages at 'va' are mapped writable in this
+// environment and not copy-on-write, so they can be sent with PTE_W in
+// a multi-page IPC.  Their contents are undefined.
+// Returns 0 on success, < 0 on error.
+int
+ipc_stage(void *va, size_t npages)
+{
+	uintptr_t pn;
+	int r;
+
+	for (pn = PGNUM(va); npages > 0; pn++, npages--) {
+		if (uvpde[pn >> 18] & PTE_P && uvpd[pn >> 9] & PTE_P &&
+		    (uvpt[pn] & (PTE_P|PTE_U|PTE_W)) == (PTE_P|PTE_U|PTE_W))
+			continue;
+		if ((r = sys_page_alloc(0, (void *) (pn * PGSIZE),
+					PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
+	}
+	return 0;
+}
+
 #ifdef VMM_GUEST
 
 // Access to host IPC interface through VMCALL.
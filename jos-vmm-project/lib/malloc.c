@@ -15,6 +15,9 @@
  * If we need to allocate a large amount (more than a page)
  * we can't put a ref count at the end of each page,
  * so we mark the pte entry with the bit PTE_CONTINUED.
+ *
+ * Pages are allocated with PTE_ZERO, so the parts of a large
+ * chunk that are never written use no memory.
  */
 enum
 {
@@ -34,7 +37,8 @@ isfree(void *v, size_t n)
 
 	for (va = (uintptr_t) v; va < end_va; va += PGSIZE)
 		if (va >= (uintptr_t) mend
-		    || ((uvpd[VPD(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P)))
+		    || ((uvpd[VPD(va)] & PTE_P) && ((uvpt[PGNUM(va)] & PTE_P) ||
+						    PTE_LAZYSHARE(uvpt[PGNUM(va)]))))
 			return 0;
 	return 1;
 }
@@ -98,7 +102,7 @@ malloc(size_t n)
 	 */
 	for (i = 0; i < n + 4; i += PGSIZE){
 		cont = (i + PGSIZE < n + 4) ? PTE_CONTINUED : 0;
-		if (sys_page_alloc(0, mptr + i, PTE_P|PTE_U|PTE_W|cont) < 0){
+		if (sys_page_alloc(0, mptr + i, PTE_P|PTE_U|PTE_W|PTE_ZERO|cont) < 0){
 			for (; i >= 0; i -= PGSIZE)
 				sys_page_unmap(0, mptr + i);
 			return 0;	/* out of physical memory */
@@ -26,8 +26,7 @@ nsipc(unsigned type)
 	if (debug)
 		cprintf("[%08x] nsipc %d\n", thisenv->env_id, type);
 
-	ipc_send(nsenv, type, &nsipcbuf, PTE_P|PTE_W|PTE_U);
-	return ipc_recv(NULL, NULL, NULL);
+	return ipc_call(nsenv, type, &nsipcbuf, PTE_P|PTE_W|PTE_U, NULL, NULL);
 }
 
 int
@@ -90,12 +89,14 @@ nsipc_recv(int s, void *mem, int len, unsigned int flags)
 {
 	int r;
 
+	// The reply overwrites the request, req_len included.
+	len = MIN(len, NSIPC_MAXBUF);
 	nsipcbuf.recv.req_s = s;
 	nsipcbuf.recv.req_len = len;
 	nsipcbuf.recv.req_flags = flags;
 
 	if ((r = nsipc(NSREQ_RECV)) >= 0) {
-		assert(r < 1600 && r <= len);
+		assert(r <= len);
 		memmove(mem, nsipcbuf.recvRet.ret_buf, r);
 	}
 
@@ -105,8 +106,8 @@ nsipc_recv(int s, void *mem, int len, unsigned int flags)
 int
 nsipc_send(int s, const void *buf, int size, unsigned int flags)
 {
+	size = MIN(size, NSIPC_MAXBUF);
 	nsipcbuf.send.req_s = s;
-	assert(size < 1600);
 	memmove(&nsipcbuf.send.req_buf, buf, size);
 	nsipcbuf.send.req_size = size;
 	nsipcbuf.send.req_flags = flags;
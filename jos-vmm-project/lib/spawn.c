@@ -6,6 +6,13 @@
 #define UTEMP2			(UTEMP + PGSIZE)
 #define UTEMP3			(UTEMP2 + PGSIZE)
 
+// Pages of a segment that map_segment() reads in at UTEMP at a time
+#define SPAWN_CHUNK		64
+
+// spawn() queues the page operations that build the child here and has
+// the kernel run them in batches.
+static struct SyscallBatch spawn_batch;
+
 // Helper functions for spawn.
 static int init_stack(envid_t child, const char **argv, uintptr_t *init_esp);
 static int map_segment(envid_t child, uintptr_t va, size_t memsz,
@@ -134,12 +141,17 @@ spawn(const char *prog, const char **argv)
 		panic("copy_shared_pages: %e", r);
 
 #line 137 "../lib/spawn.c"
-	if ((r = sys_env_set_trapframe(child, &child_tf)) < 0)
+	if ((r = batch_add(&spawn_batch, SYS_env_set_trapframe, child,
+			   (uint64_t) &child_tf, 0, 0, 0)) < 0)
 		panic("sys_env_set_trapframe: %e", r);
 
-	if ((r = sys_env_set_status(child, ENV_RUNNABLE)) < 0)
+	if ((r = batch_add(&spawn_batch, SYS_env_set_status, child,
+			   ENV_RUNNABLE, 0, 0, 0)) < 0)
 		panic("sys_env_set_status: %e", r);
 
+	if ((r = batch_flush(&spawn_batch)) < 0)
+		panic("spawn: %e", r);
+
 	return child;
 
 error:
@@ -268,7 +280,7 @@ static int
 map_segment(envid_t child, uintptr_t va, size_t memsz,
 	    int fd, size_t filesz, off_t fileoffset, int perm)
 {
-	int i, r;
+	int i, j, n, r;
 	void *blk;
 
 	//cprintf("map_segment %x+%x\n", va, memsz);
@@ -280,25 +292,41 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 		fileoffset -= i;
 	}
 
-	for (i = 0; i < memsz; i += PGSIZE) {
-		if (i >= filesz) {
-			// allocate a blank page
-			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
-				return r;
-		} else {
-			// from file
-			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
-			if ((r = seek(fd, fileoffset + i)) < 0)
-				return r;
-			if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
+	// Pages from the file: read them in SPAWN_CHUNK pages at a time at
+	// UTEMP, then move them all over to the child.
+	for (i = 0; i < memsz && i < filesz; i += n * PGSIZE) {
+		n = MIN(SPAWN_CHUNK, (ROUNDUP(filesz, PGSIZE) - i) / PGSIZE);
+		for (j = 0; j < n; j++)
+			if ((r = batch_add(&spawn_batch, SYS_page_alloc, 0,
+					   (uint64_t) (UTEMP + j * PGSIZE),
+					   PTE_P|PTE_U|PTE_W, 0, 0)) < 0)
 				return r;
-			if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
+		if ((r = batch_flush(&spawn_batch)) < 0)
+			return r;
+		if ((r = seek(fd, fileoffset + i)) < 0)
+			return r;
+		if ((r = readn(fd, UTEMP, MIN(n * PGSIZE, filesz - i))) < 0)
+			return r;
+		for (j = 0; j < n; j++) {
+			if ((r = batch_add(&spawn_batch, SYS_page_map, 0,
+					   (uint64_t) (UTEMP + j * PGSIZE), child,
+					   va + i + j * PGSIZE, perm)) < 0)
+				panic("spawn: sys_page_map data: %e", r);
+			if ((r = batch_add(&spawn_batch, SYS_page_unmap, 0,
+					   (uint64_t) (UTEMP + j * PGSIZE),
+					   0, 0, 0)) < 0)
 				panic("spawn: sys_page_map data: %e", r);
-			sys_page_unmap(0, UTEMP);
 		}
+		if ((r = batch_flush(&spawn_batch)) < 0)
+			panic("spawn: sys_page_map data: %e", r);
 	}
-	return 0;
+
+	// The rest of the segment is blank pages
+	for (; i < memsz; i += PGSIZE)
+		if ((r = batch_add(&spawn_batch, SYS_page_alloc, child,
+				   va + i, perm, 0, 0)) < 0)
+			return r;
+	return batch_flush(&spawn_batch);
 }
 
 #line 305 "../lib/spawn.c"
@@ -308,23 +336,40 @@ copy_shared_pages(envid_t child)
 {
 #line 310 "../lib/spawn.c"
 	int64_t pn, last_pn, r;
+	pte_t perm;
 	void* va;
 
 	for (pn = 0; pn < PGNUM(UTOP); ) {
 		if (!(uvpde[pn>>18] & PTE_P && uvpd[pn >> 9] & PTE_P))
 			pn += NPTENTRIES;
-		else {
+		else if (uvpd[pn >> 9] & PTE_PS) {
+			// A 2MB page: there is no page table to look in.
+			va = (void*) (pn << PGSHIFT);
+			if ((uvpd[pn >> 9] & PTE_SHARE) &&
+			    (r = batch_add(&spawn_batch, SYS_page_map, 0, (uint64_t) va,
+					   child, (uint64_t) va,
+					   PTE_PS | (uvpd[pn >> 9] & PTE_SYSCALL))) < 0)
+				return r;
+			pn += NPTENTRIES;
+		} else {
 			last_pn = pn + NPTENTRIES;
 			for (; pn < last_pn; pn++)
-				if ((uvpt[pn] & (PTE_P | PTE_SHARE)) == (PTE_P | PTE_SHARE)) {
+				if ((uvpt[pn] & (PTE_P | PTE_SHARE)) == (PTE_P | PTE_SHARE) ||
+				    PTE_LAZYSHARE(uvpt[pn])) {
 					va = (void*) (pn << PGSHIFT);
-					if ((r = sys_page_map(0, va, child, va, uvpt[pn] & PTE_SYSCALL)) < 0)
+					perm = uvpt[pn] & PTE_SYSCALL;
+					// A lazily allocated page gets its page when
+					// it is mapped, and is writable from then on.
+					if (perm & PTE_ZERO)
+						perm = (perm & ~PTE_ZERO) | PTE_P | PTE_W;
+					if ((r = batch_add(&spawn_batch, SYS_page_map, 0, (uint64_t) va,
+							   child, (uint64_t) va, perm)) < 0)
 						return r;
 				}
 		}
 	}
 #line 329 "../lib/spawn.c"
-	return 0;
+	return batch_flush(&spawn_batch);
 }
 #line 332 "../lib/spawn.c"
 
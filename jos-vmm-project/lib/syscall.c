@@ -9,6 +9,23 @@ syscall(int num, int check, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4,
 {
 	int64_t ret;
 
+#ifndef VMM_GUEST
+	// Fast system call: pass system call number in AX, up to five
+	// parameters in DX, R10, BX, DI, SI, and enter the kernel with
+	// SYSCALL.  SYSCALL itself overwrites CX and R11 with our return
+	// address and flags, and the kernel entry code uses R9 as scratch.
+	register uint64_t r10 asm("r10") = a2;
+
+	asm volatile("syscall\n"
+		     : "=a" (ret),
+		       "+r" (r10)
+		     : "a" (num),
+		       "d" (a1),
+		       "b" (a3),
+		       "D" (a4),
+		       "S" (a5)
+		     : "rcx", "r9", "r11", "cc", "memory");
+#else
 	// Generic system call: pass system call number in AX,
 	// up to five parameters in DX, CX, BX, DI, SI.
 	// Interrupt kernel with T_SYSCALL.
@@ -31,6 +48,7 @@ syscall(int num, int check, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4,
 		       "D" (a4),
 		       "S" (a5)
 		     : "cc", "memory");
+#endif
 
 	if(check && ret > 0)
 		panic("syscall %d returned %d (> 0)", num, ret);
@@ -95,6 +113,30 @@ sys_env_set_status(envid_t envid, int status)
 	return syscall(SYS_env_set_status, 1, envid, status, 0, 0, 0);
 }
 
+int
+sys_env_set_sched(envid_t envid, uint32_t weight, uint32_t flags)
+{
+	return syscall(SYS_env_set_sched, 1, envid, weight, flags, 0, 0);
+}
+
+envid_t
+sys_fork(void)
+{
+	return syscall(SYS_fork, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_batch(struct Syscall *calls, unsigned n)
+{
+	return syscall(SYS_batch, 0, (uint64_t) calls, n, 0, 0, 0);
+}
+
+int
+sys_env_set_affinity(envid_t envid, uint32_t cpumask)
+{
+	return syscall(SYS_env_set_affinity, 1, envid, cpumask, 0, 0, 0);
+}
+
 #line 99 "../lib/syscall.c"
 int
 sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
@@ -121,6 +163,45 @@ sys_ipc_recv(void *dstva)
 	return syscall(SYS_ipc_recv, 1, (uint64_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, int perm,
+	     unsigned timeout_ms)
+{
+	return syscall(SYS_ipc_send, 0, envid, value, (uint64_t) srcva, perm, timeout_ms);
+}
+
+int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, int perm,
+	     void *dstva)
+{
+	return syscall(SYS_ipc_call, 0, envid, value, (uint64_t) srcva, perm, (uint64_t) dstva);
+}
+
+int
+sys_ipc_reply_recv(envid_t envid, uint32_t value, void *srcva, int perm,
+		   void *dstva)
+{
+	return syscall(SYS_ipc_reply_recv, 0, envid, value, (uint64_t) srcva, perm, (uint64_t) dstva);
+}
+
+int
+sys_ipc_notify(envid_t envid, uint32_t bits)
+{
+	return syscall(SYS_ipc_notify, 0, envid, bits, 0, 0, 0);
+}
+
+int
+sys_ipc_notify_wait(void)
+{
+	return syscall(SYS_ipc_notify_wait, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_ipc_join(envid_t member)
+{
+	return syscall(SYS_ipc_join, 0, member, 0, 0, 0, 0);
+}
+
 #line 125 "../lib/syscall.c"
 unsigned int
 sys_time_msec(void)
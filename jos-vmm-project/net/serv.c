@@ -161,6 +161,21 @@ serve_init(uint32_t ipaddr, uint32_t netmask, uint32_t gw)
     cprintf("NS: TCP/IP initialized.\n");
 }
 
+// The reply to the most recently finished request.  serve() hands it
+// to the kernel along with its next receive, in one ipc_reply_recv.
+static envid_t reply_to;
+static int32_t reply_val;
+
+// Reply 'r' to 'whom', which is waiting in ipc_call.  Only one reply
+// is held back at a time; an earlier one still waiting goes now.
+static void
+reply(envid_t whom, int32_t r) {
+    if (reply_to)
+        ipc_send(reply_to, reply_val, 0, 0);
+    reply_to = whom;
+    reply_val = r;
+}
+
 static void
 process_timer(envid_t envid) {
     uint32_t start, now, to;
@@ -175,7 +190,7 @@ process_timer(envid_t envid) {
     now = sys_time_msec();
 
     to = TIMER_INTERVAL - (now - start);
-    ipc_send(envid, to, 0, 0);
+    reply(envid, to);
 }
 
 struct st_args {
@@ -220,11 +235,13 @@ serve_thread(uint64_t a) {
             // Note that we read the request fields before we
             // overwrite it with the response data.
             r = lwip_recv(req->recv.req_s, req->recvRet.ret_buf,
-                    req->recv.req_len, req->recv.req_flags);
+                    MIN(req->recv.req_len, NSIPC_MAXBUF),
+                    req->recv.req_flags);
             break;
         case NSREQ_SEND:
             r = lwip_send(req->send.req_s, &req->send.req_buf,
-                    req->send.req_size, req->send.req_flags);
+                    MIN(req->send.req_size, NSIPC_MAXBUF),
+                    req->send.req_flags);
             break;
         case NSREQ_SOCKET:
             r = lwip_socket(req->socket.req_domain, req->socket.req_type,
@@ -247,7 +264,7 @@ serve_thread(uint64_t a) {
     }
 
     if (args->reqno != NSREQ_INPUT)
-        ipc_send(args->whom, r, 0, 0);
+        reply(args->whom, r);
 
     put_buffer(args->req);
     sys_page_unmap(0, (void*) args->req);
@@ -258,6 +275,7 @@ void
 serve(void) {
     int32_t reqno;
     uint32_t whom;
+    envid_t to;
     int i, perm;
     void *va;
 
@@ -270,7 +288,10 @@ serve(void) {
 
         perm = 0;
         va = get_buffer();
-        reqno = ipc_recv((int32_t *) &whom, (void *) va, &perm);
+        to = reply_to;
+        reply_to = 0;
+        reqno = ipc_reply_recv(to, reply_val, 0, 0,
+                               (envid_t *) &whom, (void *) va, &perm);
         if (debug) {
             cprintf("ns req %d from %08x\n", reqno, whom);
         }
@@ -318,6 +339,10 @@ umain(int argc, char **argv)
 
     binaryname = "ns";
 
+    // Keep the server and its helper envs, which all touch the same
+    // packet buffers, on one CPU; the helpers inherit the pinning.
+    sys_env_set_affinity(0, 1 << thisenv->env_cpunum);
+
     // fork off the timer thread which will send us periodic messages
     timer_envid = fork();
     if (timer_envid < 0)
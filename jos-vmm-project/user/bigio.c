@@ -0,0 +1,89 @@
+#line 2 "../user/bigio.c"
+// Test reads and writes that span many pages, which reach the file
+// server as one multi-page IPC each, and compare the time to read a
+// file a page at a time against reading it in large chunks.
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+#define FILESIZE	(256 * 1024)
+#define BIGCHUNK	(FSIPC_MAXPAGES * PGSIZE)
+#define NPASSES		8
+
+static uint8_t buf[BIGCHUNK + PGSIZE];
+
+static uint8_t
+pattern(uint32_t off)
+{
+	return (off * 7) ^ (off >> 12);
+}
+
+// Write the test file in odd-sized chunks, so requests neither start
+// nor end on page boundaries.
+static void
+write_file(const char *path)
+{
+	uint32_t off, i;
+	int fd, n, r;
+
+	if ((fd = open(path, O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		panic("open %s: %e", path, fd);
+	for (off = 0; off < FILESIZE; off += r) {
+		n = MIN(FILESIZE - off, sizeof(buf) - 123);
+		for (i = 0; i < n; i++)
+			buf[i] = pattern(off + i);
+		if ((r = write(fd, buf, n)) <= 0)
+			panic("write at %d: %e", off, r);
+	}
+	close(fd);
+}
+
+// Read the test file back in 'chunk'-byte reads, checking the data.
+// Returns the cycles taken.
+static uint64_t
+read_file(const char *path, size_t chunk, bool check)
+{
+	uint32_t off, i;
+	uint64_t tsc;
+	int fd, r;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		panic("open %s: %e", path, fd);
+	tsc = read_tsc();
+	for (off = 0; off < FILESIZE; off += r) {
+		if ((r = readn(fd, buf, MIN(chunk, FILESIZE - off))) <= 0)
+			panic("read at %d: %e", off, r);
+		if (check)
+			for (i = 0; i < r; i++)
+				if (buf[i] != pattern(off + i))
+					panic("byte %d is %02x, want %02x", off + i,
+					      buf[i], pattern(off + i));
+	}
+	tsc = read_tsc() - tsc;
+	if ((r = read(fd, buf, 1)) != 0)
+		panic("read past end returned %d", r);
+	close(fd);
+	return tsc;
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t small = 0, big = 0;
+	int i;
+
+	write_file("/bigio");
+	read_file("/bigio", BIGCHUNK + PGSIZE - 1, true);
+	read_file("/bigio", 3 * PGSIZE + 5, true);
+	cprintf("%d-byte file read back intact\n", FILESIZE);
+
+	for (i = 0; i < NPASSES; i++) {
+		small += read_file("/bigio", PGSIZE, false);
+		big += read_file("/bigio", BIGCHUNK, false);
+	}
+	cprintf("%6d-byte reads: %d cycles/page\n", PGSIZE,
+		(int) (small / NPASSES / (FILESIZE / PGSIZE)));
+	cprintf("%6d-byte reads: %d cycles/page\n", BIGCHUNK,
+		(int) (big / NPASSES / (FILESIZE / PGSIZE)));
+	remove("/bigio");
+}
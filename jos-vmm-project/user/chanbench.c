@@ -0,0 +1,117 @@
+#line 2 "../user/chanbench.c"
+// Measure the cost of a request/response over an asynchronous channel,
+// with up to a ring's worth of requests outstanding at once, against
+// a synchronous ipc_call round trip.
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+#define NMSGS		100000
+#define NCALLS		10000
+#define CHAN_VA		((struct Chan *) 0x10000000)
+
+enum {
+	OP_ECHO = 1,
+	OP_QUIT,
+};
+
+// Answer each request with its argument plus one.
+static void
+server(struct Chan *ch)
+{
+	struct ChanMsg m;
+	int r;
+
+	if ((r = chan_accept(ch, 0)) < 0)
+		panic("chan_accept: %e", r);
+	while (1) {
+		chan_recv(ch, &m);
+		if (m.cm_op == OP_QUIT)
+			exit();
+		m.cm_arg[0]++;
+		while (chan_send(ch, &m) < 0)
+			sys_yield();
+	}
+}
+
+static void
+bench_chan(void)
+{
+	struct Chan *ch = CHAN_VA;
+	struct ChanMsg m;
+	uint64_t tsc;
+	uint32_t sent = 0, done = 0;
+	envid_t id;
+	int r;
+
+	if ((r = chan_create(ch, 0)) < 0)
+		panic("chan_create: %e", r);
+	if ((id = fork()) < 0)
+		panic("fork: %e", id);
+	if (id == 0)
+		server(ch);
+
+	tsc = read_tsc();
+	while (done < NMSGS) {
+		// Keep the ring full of requests, then collect responses.
+		while (sent < NMSGS && sent - done < CHAN_NSLOTS) {
+			m.cm_tag = sent;
+			m.cm_op = OP_ECHO;
+			m.cm_arg[0] = sent;
+			if (chan_send(ch, &m) < 0)
+				break;
+			sent++;
+		}
+		chan_recv(ch, &m);
+		do {
+			if (m.cm_tag != done || m.cm_arg[0] != done + 1)
+				panic("response %d: tag %d value %d", done,
+				      (int) m.cm_tag, (int) m.cm_arg[0]);
+			done++;
+		} while (chan_poll(ch, &m));
+	}
+	cprintf("chan  %d cycles/request\n",
+		(int) ((read_tsc() - tsc) / NMSGS));
+
+	m.cm_op = OP_QUIT;
+	while (chan_send(ch, &m) < 0)
+		sys_yield();
+	while (envs[ENVX(id)].env_id == id &&
+	       envs[ENVX(id)].env_status != ENV_FREE)
+		sys_yield();
+	sys_page_unmap(0, ch);
+}
+
+static void
+bench_call(void)
+{
+	envid_t id, whom = 0;
+	uint32_t val = 0;
+	uint64_t tsc;
+	int i;
+
+	if ((id = fork()) < 0)
+		panic("fork: %e", id);
+	if (id == 0) {
+		for (i = 0; i < NCALLS; i++)
+			val = ipc_reply_recv(whom, val + 1, NULL, 0, &whom,
+					     NULL, NULL);
+		ipc_reply_recv(whom, val + 1, NULL, 0, NULL, NULL, NULL);
+		exit();
+	}
+
+	tsc = read_tsc();
+	for (i = 0; i < NCALLS; i++)
+		if (ipc_call(id, i, NULL, 0, NULL, NULL) != i + 1)
+			panic("call %d: wrong value", i);
+	cprintf("call  %d cycles/request\n",
+		(int) ((read_tsc() - tsc) / NCALLS));
+	sys_env_destroy(id);
+}
+
+void
+umain(int argc, char **argv)
+{
+	bench_chan();
+	bench_call();
+}
@@ -0,0 +1,38 @@
+#line 2 "../user/envcycle.c"
+// Test env creation and teardown: fork many short-lived children, each
+// of which must start with nothing mapped where the previous one mapped
+// a page, even when it gets that child's PML4 back from the cache of
+// freed ones.  Then report the cost of a fork, exit and wait.
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+#define PROBE_VA	((uint8_t *) 0x80000000)
+#define NCHILD		200
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t tsc;
+	envid_t id;
+	int i, r;
+
+	tsc = read_tsc();
+	for (i = 0; i < NCHILD; i++) {
+		if ((id = fork()) < 0)
+			panic("fork: %e", id);
+		if (id == 0) {
+			if (uvpde[VPDPE(PROBE_VA)] & PTE_P)
+				panic("child %d inherits a page directory", i);
+			if ((r = sys_page_alloc(0, PROBE_VA, PTE_P|PTE_U|PTE_W)) < 0)
+				panic("sys_page_alloc: %e", r);
+			*(volatile int *) PROBE_VA = i;
+			exit();
+		}
+		wait(id);
+	}
+	tsc = read_tsc() - tsc;
+
+	cprintf("envcycle: OK\n");
+	cprintf("fork, exit and wait: %d cycles\n", (int) (tsc / NCHILD));
+}
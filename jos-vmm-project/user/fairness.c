@@ -2,25 +2,57 @@
 // Demonstrate lack of fairness in IPC.
 // Start three instances of this program as envs 1, 2, and 3.
 // (user/idle is env 0).
+//
+// The receiver, env 1, asks for ENV_SCHED_WAKEBOOST, so a message runs
+// it at once rather than after the senders' timeslices.  Each sender
+// does some work before every send, and runs with a weight of
+// ENV_WEIGHT_DEFAULT times its env index less one, so the messages the
+// receiver counts from each should follow the senders' weights.
 
 #include <inc/lib.h>
 
+#define WORK		100000	// Loop iterations between sends
+#define NREPORT		1000	// Messages between receiver reports
+
+static unsigned counts[NENV];
+
 void
 umain(int argc, char **argv)
 {
 	envid_t who, id;
+	uint32_t weight;
+	unsigned n = 0;
+	volatile unsigned i;
+	int r;
 
 	id = sys_getenvid();
 
 	if (thisenv == &envs[1]) {
+		if ((r = sys_env_set_sched(0, ENV_WEIGHT_DEFAULT,
+					   ENV_SCHED_WAKEBOOST)) < 0)
+			panic("sys_env_set_sched: %e", r);
 		while (1) {
 			ipc_recv(&who, 0, 0);
-			cprintf("%x recv from %x\n", id, who);
+			counts[ENVX(who)]++;
+			if (++n % NREPORT)
+				continue;
+			cprintf("%x recv:", id);
+			for (i = 0; i < NENV; i++)
+				if (counts[i])
+					cprintf(" %d from %x", counts[i],
+						envs[i].env_id);
+			cprintf("\n");
 		}
 	} else {
-		cprintf("%x loop sending to %x\n", id, envs[1].env_id);
-		while (1)
+		weight = (ENVX(id) - 1) * ENV_WEIGHT_DEFAULT;
+		if ((r = sys_env_set_sched(0, weight, 0)) < 0)
+			panic("sys_env_set_sched: %e", r);
+		cprintf("%x loop sending to %x with weight %d\n",
+			id, envs[1].env_id, weight);
+		while (1) {
+			for (i = 0; i < WORK; i++)
+				/* do nothing */;
 			ipc_send(envs[1].env_id, 0, 0, 0);
+		}
 	}
 }
-
@@ -0,0 +1,57 @@
+#line 2 "../user/forkbench.c"
+// Compare the cost of fork() with the user-level copy-on-write fork
+// and with sys_fork, for a small address space and a large one.
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+#define NFORKS		20
+#define NPAGES		1024
+
+// Where the large address space's extra pages go
+static uint8_t *heap = (uint8_t *) 0x10000000;
+
+static void
+run(const char *how, bool in_kernel, int npages)
+{
+	uint64_t tsc, cycles = 0;
+	envid_t id;
+	int i;
+
+	// Write to every page so that each fork has to make it
+	// copy-on-write again.
+	fork_in_kernel = in_kernel;
+	for (i = 0; i < npages; i++)
+		heap[i * PGSIZE] = i;
+
+	for (i = 0; i < NFORKS; i++) {
+		tsc = read_tsc();
+		if ((id = fork()) < 0)
+			panic("fork: %e", id);
+		if (id == 0)
+			exit();
+		cycles += read_tsc() - tsc;
+		wait(id);
+	}
+	cprintf("%-6s fork, %4d extra pages: %d cycles/fork\n",
+		how, npages, (int) (cycles / NFORKS));
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i, r;
+
+	// Nothing above UMAPTOP can be mapped, so no fork has to copy it.
+	if ((r = sys_page_alloc(0, (void *) UMAPTOP, PTE_P|PTE_U|PTE_W)) != -E_INVAL)
+		panic("sys_page_alloc at UMAPTOP: got %e, want -E_INVAL", r);
+
+	run("user", false, 0);
+	run("kernel", true, 0);
+
+	for (i = 0; i < NPAGES; i++)
+		if ((r = sys_page_alloc(0, heap + i * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+	run("user", false, NPAGES);
+	run("kernel", true, NPAGES);
+}
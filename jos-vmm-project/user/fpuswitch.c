@@ -0,0 +1,76 @@
+#line 2 "../user/fpuswitch.c"
+// Test that each env keeps its own SSE registers: several envs fill
+// %xmm0-%xmm7 with their own pattern, yield to each other many times,
+// and check the registers still hold it.  One env never touches the
+// FPU, and double arithmetic must still work along the way.
+
+#include <inc/lib.h>
+
+#define NCHILD		4
+#define NROUNDS		200
+
+static void
+check_xmm(uint64_t pattern)
+{
+	uint64_t out[16];
+	int i;
+
+	asm volatile("movq %0,%%xmm0\n\tpunpcklqdq %%xmm0,%%xmm0\n\t"
+		     "movdqa %%xmm0,%%xmm1\n\tmovdqa %%xmm0,%%xmm2\n\t"
+		     "movdqa %%xmm0,%%xmm3\n\tmovdqa %%xmm0,%%xmm4\n\t"
+		     "movdqa %%xmm0,%%xmm5\n\tmovdqa %%xmm0,%%xmm6\n\t"
+		     "movdqa %%xmm0,%%xmm7"
+		     : : "r" (pattern)
+		     : "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5",
+		       "xmm6", "xmm7");
+	sys_yield();
+	asm volatile("movdqu %%xmm0,0(%0)\n\tmovdqu %%xmm1,16(%0)\n\t"
+		     "movdqu %%xmm2,32(%0)\n\tmovdqu %%xmm3,48(%0)\n\t"
+		     "movdqu %%xmm4,64(%0)\n\tmovdqu %%xmm5,80(%0)\n\t"
+		     "movdqu %%xmm6,96(%0)\n\tmovdqu %%xmm7,112(%0)"
+		     : : "r" (out) : "memory");
+	for (i = 0; i < 16; i++)
+		if (out[i] != pattern)
+			panic("%%xmm%d is %016llx, want %016llx", i / 2,
+			      out[i], pattern);
+}
+
+static void
+child(int n)
+{
+	volatile double x = 1.0;
+	int i;
+
+	for (i = 0; i < NROUNDS; i++) {
+		check_xmm(0x0101010101010101ULL * (n + 1) + i);
+		x = x * 1.5 + n;
+	}
+	if ((int) x <= 0)
+		panic("double arithmetic went wrong");
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t ids[NCHILD + 1];
+	int i;
+
+	for (i = 0; i <= NCHILD; i++) {
+		if ((ids[i] = fork()) < 0)
+			panic("fork: %e", ids[i]);
+		if (ids[i] == 0) {
+			// The last child never touches the FPU.
+			if (i < NCHILD)
+				child(i);
+			else
+				for (i = 0; i < NROUNDS; i++)
+					sys_yield();
+			exit();
+		}
+	}
+	for (i = 0; i <= NCHILD; i++)
+		while (envs[ENVX(ids[i])].env_id == ids[i] &&
+		       envs[ENVX(ids[i])].env_status != ENV_FREE)
+			sys_yield();
+	cprintf("fpuswitch: OK\n");
+}
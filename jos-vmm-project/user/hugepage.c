@@ -0,0 +1,93 @@
+#line 2 "../user/hugepage.c"
+// Test 2MB pages: allocate one, check that it is mapped by a single
+// page directory entry, that a forked child gets its own copy while a
+// PTE_SHARE one is shared, and that it can be mapped at a second
+// address and unmapped.
+
+#include <inc/lib.h>
+
+#define HUGE_VA		((uint8_t *) 0x40000000)
+#define HUGE_VA2	(HUGE_VA + PTSIZE)
+#define HUGE_SHARE	(HUGE_VA2 + PTSIZE)
+
+static void
+check_zero(uint8_t *va)
+{
+	size_t i;
+
+	for (i = 0; i < PTSIZE; i += sizeof(uint64_t))
+		if (*(uint64_t *) (va + i))
+			panic("byte %d of new 2MB page is not zero", (int) i);
+}
+
+// Fork, with sys_fork or the user-level fork, and have the child write
+// to both 2MB pages: only the write to the PTE_SHARE one shows here.
+static void
+check_fork(bool in_kernel)
+{
+	envid_t id;
+	size_t i;
+
+	fork_in_kernel = in_kernel;
+	if ((id = fork()) < 0)
+		panic("fork: %e", id);
+	if (id == 0) {
+		for (i = 0; i < PTSIZE; i += PGSIZE)
+			if (HUGE_VA[i] != (uint8_t) (i / PGSIZE))
+				panic("child sees the wrong data at %d", (int) i);
+		HUGE_VA[PTSIZE - 1] = 0x5a;
+		HUGE_SHARE[PTSIZE - 1] = 0x5a;
+		exit();
+	}
+	wait(id);
+	fork_in_kernel = true;
+	if (HUGE_VA[PTSIZE - 1] == 0x5a)
+		panic("parent sees the child's write to its copy");
+	if (HUGE_SHARE[PTSIZE - 1] != 0x5a)
+		panic("parent does not see the child's write to a PTE_SHARE page");
+	HUGE_SHARE[PTSIZE - 1] = 0;
+}
+
+void
+umain(int argc, char **argv)
+{
+	size_t i;
+	int r;
+
+	if ((r = sys_page_alloc(0, HUGE_VA + PGSIZE, PTE_P|PTE_U|PTE_W|PTE_PS)) != -E_INVAL)
+		panic("unaligned 2MB sys_page_alloc returned %e", r);
+	if ((r = sys_page_alloc(0, HUGE_VA, PTE_P|PTE_U|PTE_W|PTE_PS)) < 0)
+		panic("sys_page_alloc: %e", r);
+	if (!(uvpd[PGNUM(HUGE_VA) >> 9] & PTE_PS))
+		panic("2MB page is not mapped with PTE_PS");
+	check_zero(HUGE_VA);
+	for (i = 0; i < PTSIZE; i += PGSIZE)
+		HUGE_VA[i] = i / PGSIZE;
+
+	if ((r = sys_page_alloc(0, HUGE_SHARE, PTE_P|PTE_U|PTE_W|PTE_PS|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+	check_fork(true);
+	check_fork(false);
+	sys_page_unmap(0, HUGE_SHARE);
+
+	// Map it a second time, and check that a 4KB map of part of it, or
+	// a 4KB page in it, fails.
+	if ((r = sys_page_map(0, HUGE_VA, 0, HUGE_VA2, PTE_P|PTE_U|PTE_W|PTE_PS)) < 0)
+		panic("sys_page_map: %e", r);
+	if ((r = sys_page_map(0, HUGE_VA + PGSIZE, 0, UTEMP, PTE_P|PTE_U)) != -E_INVAL)
+		panic("4KB sys_page_map of a 2MB page returned %e", r);
+	if ((r = sys_page_alloc(0, HUGE_VA2 + PGSIZE, PTE_P|PTE_U|PTE_W)) != -E_INVAL)
+		panic("4KB sys_page_alloc in a 2MB page returned %e", r);
+	HUGE_VA2[12345] = 0xa5;
+	if (HUGE_VA[12345] != 0xa5)
+		panic("second mapping is of a different page");
+
+	// Unmapping any address in a 2MB page unmaps all of it.
+	sys_page_unmap(0, HUGE_VA + 7 * PGSIZE);
+	if (uvpd[PGNUM(HUGE_VA) >> 9] & PTE_P)
+		panic("2MB page still mapped after sys_page_unmap");
+	if (HUGE_VA2[12345] != 0xa5)
+		panic("second mapping lost its data");
+	sys_page_unmap(0, HUGE_VA2);
+	cprintf("hugepage: OK\n");
+}
@@ -0,0 +1,112 @@
+#line 2 "../user/ipcpool.c"
+// Test IPC endpoints: this env adds a pool of workers to its endpoint,
+// and several clients call the endpoint at once.  A worker cannot add
+// this env to an endpoint of its own.  Every call must be
+// answered, by one of the workers, and the workers' share of the calls
+// is reported.  Then a worker dies with a call in hand: that call must
+// fail, and the rest of the pool must go on answering.
+
+#include <inc/lib.h>
+
+#define NWORKERS	4
+#define NCLIENTS	4
+#define NCALLS		1000
+#define DIE		0xdead	// Makes the worker that takes it exit
+
+static envid_t workers[NWORKERS];
+
+static void
+worker(envid_t ep)
+{
+	envid_t whom = 0;
+	uint32_t val = 0;
+	int r;
+
+	if ((r = sys_ipc_join(ep)) != -E_BAD_ENV)
+		panic("sys_ipc_join of the parent returned %e", r);
+	while (1) {
+		val = ipc_reply_recv(whom, val + 1, NULL, 0, &whom, NULL, NULL);
+		if (val == DIE)
+			exit();
+		// Make requests overlap, so more than one worker is busy.
+		if (val % 8 == 0)
+			sys_yield();
+	}
+}
+
+static void
+client(envid_t ep)
+{
+	int counts[NWORKERS] = {0}, i, j;
+	int32_t r;
+
+	for (i = 0; i < NCALLS; i++) {
+		if ((r = ipc_call(ep, i, NULL, 0, NULL, NULL)) != i + 1)
+			panic("call %d returned %d", i, r);
+		for (j = 0; j < NWORKERS; j++)
+			if (thisenv->env_ipc_from == workers[j])
+				break;
+		if (j == NWORKERS)
+			panic("call %d answered by %08x, not a worker", i,
+			      thisenv->env_ipc_from);
+		counts[j]++;
+	}
+	cprintf("client %08x:", thisenv->env_id);
+	for (j = 0; j < NWORKERS; j++)
+		cprintf(" %d", counts[j]);
+	cprintf("\n");
+}
+
+static void
+wait_exit(envid_t id)
+{
+	const volatile struct Env *e = &envs[ENVX(id)];
+
+	while (e->env_id == id && e->env_status != ENV_FREE)
+		sys_yield();
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t ep = thisenv->env_id, clients[NCLIENTS], id;
+	int i, r;
+
+	if ((r = sys_ipc_join(0)) < 0)
+		panic("sys_ipc_join: %e", r);
+	for (i = 0; i < NWORKERS; i++) {
+		if ((workers[i] = fork()) < 0)
+			panic("fork: %e", workers[i]);
+		if (workers[i] == 0)
+			worker(ep);
+		if ((r = sys_ipc_join(workers[i])) < 0)
+			panic("sys_ipc_join: %e", r);
+	}
+	// Clients inherit the worker list.
+	for (i = 0; i < NCLIENTS; i++) {
+		if ((clients[i] = fork()) < 0)
+			panic("fork: %e", clients[i]);
+		if (clients[i] == 0) {
+			client(ep);
+			exit();
+		}
+	}
+	for (i = 0; i < NCLIENTS; i++)
+		wait_exit(clients[i]);
+	cprintf("%d calls answered by a pool of %d workers\n",
+		NCLIENTS * NCALLS, NWORKERS);
+
+	if ((id = fork()) < 0)
+		panic("fork: %e", id);
+	if (id == 0) {
+		if ((r = ipc_call(ep, DIE, NULL, 0, NULL, NULL)) != -E_BAD_ENV)
+			panic("call to a worker that died returned %e", r);
+		if ((r = ipc_call(ep, 1, NULL, 0, NULL, NULL)) != 2)
+			panic("call after a worker died returned %d", r);
+		exit();
+	}
+	wait_exit(id);
+	cprintf("call to a worker that died failed\n");
+	for (i = 0; i < NWORKERS; i++)
+		sys_env_destroy(workers[i]);
+}
@@ -0,0 +1,198 @@
+#line 2 "../user/ipcsend.c"
+// Test blocking IPC sends: senders waiting for the same receiver are
+// served in the order they started waiting, a send times out if the
+// receiver never receives, and a sender made runnable leaves the
+// queue.  Then measure an IPC round trip with a sys_ipc_try_send/
+// sys_yield loop, with the blocking send, and with ipc_call and
+// ipc_reply_recv.
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+#define NSENDERS	8
+#define TIMEOUT_MSEC	100
+#define NROUNDS		10000
+
+static void
+wait_blocked(envid_t id)
+{
+	const volatile struct Env *e = &envs[ENVX(id)];
+
+	while (e->env_status != ENV_NOT_RUNNABLE)
+		sys_yield();
+}
+
+static void
+wait_exit(envid_t id)
+{
+	const volatile struct Env *e = &envs[ENVX(id)];
+
+	while (e->env_id == id && e->env_status != ENV_FREE)
+		sys_yield();
+}
+
+// Start senders one at a time, each only once the last is queued,
+// then check that their messages arrive in that order.
+static void
+test_fifo(void)
+{
+	envid_t ids[NSENDERS], parent = thisenv->env_id, from;
+	uint32_t val;
+	int i;
+
+	for (i = 0; i < NSENDERS; i++) {
+		if ((ids[i] = fork()) < 0)
+			panic("fork: %e", ids[i]);
+		if (ids[i] == 0) {
+			ipc_send(parent, i, NULL, 0);
+			exit();
+		}
+		wait_blocked(ids[i]);
+	}
+	for (i = 0; i < NSENDERS; i++) {
+		val = ipc_recv(&from, NULL, NULL);
+		if (val != i || from != ids[i])
+			panic("message %d was %d from %08x, want %d from %08x",
+			      i, val, from, i, ids[i]);
+	}
+	cprintf("%d queued senders served in order\n", NSENDERS);
+}
+
+// Send to an env that never receives, with a timeout.
+static void
+test_timeout(void)
+{
+	envid_t parent = thisenv->env_id, id;
+	unsigned start, took;
+	int r;
+
+	if ((id = fork()) < 0)
+		panic("fork: %e", id);
+	if (id == 0) {
+		start = sys_time_msec();
+		r = ipc_send_timeout(parent, 0, NULL, 0, TIMEOUT_MSEC);
+		took = sys_time_msec() - start;
+		if (r != -E_IPC_NOT_RECV)
+			panic("timed out send returned %e", r);
+		if (took < TIMEOUT_MSEC)
+			panic("send timed out after %d ms, want %d",
+			      took, TIMEOUT_MSEC);
+		cprintf("send timed out after %d ms\n", took);
+		exit();
+	}
+	wait_exit(id);
+}
+
+// Make a queued sender runnable: its send fails and it leaves the
+// queue, so the receiver next gets the message it sends after that.
+static void
+test_set_status(void)
+{
+	envid_t parent = thisenv->env_id, id, from;
+	uint32_t val;
+	int r;
+
+	if ((id = fork()) < 0)
+		panic("fork: %e", id);
+	if (id == 0) {
+		r = sys_ipc_send(parent, 1, (void *) UTOP, 0, 0);
+		if (r != -E_IPC_NOT_RECV)
+			panic("send of a sender made runnable returned %e", r);
+		ipc_send(parent, 2, NULL, 0);
+		exit();
+	}
+	wait_blocked(id);
+	if ((r = sys_env_set_status(id, ENV_RUNNABLE)) < 0)
+		panic("sys_env_set_status: %e", r);
+	val = ipc_recv(&from, NULL, NULL);
+	if (val != 2 || from != id)
+		panic("got %d from %08x, want 2 from %08x", val, from, id);
+	wait_exit(id);
+	cprintf("sender made runnable left the queue\n");
+}
+
+static void
+try_send(envid_t to, uint32_t val)
+{
+	int r;
+
+	while ((r = sys_ipc_try_send(to, val, (void *) UTOP, 0)) == -E_IPC_NOT_RECV)
+		sys_yield();
+	if (r < 0)
+		panic("sys_ipc_try_send: %e", r);
+}
+
+// Bounce a value off a child NROUNDS times and report the average
+// round trip.
+static void
+bench(const char *how, bool blocking)
+{
+	envid_t parent = thisenv->env_id, id;
+	uint64_t tsc;
+	int i;
+
+	if ((id = fork()) < 0)
+		panic("fork: %e", id);
+	if (id == 0) {
+		for (i = 0; i < NROUNDS; i++) {
+			ipc_recv(NULL, NULL, NULL);
+			if (blocking)
+				ipc_send(parent, i, NULL, 0);
+			else
+				try_send(parent, i);
+		}
+		exit();
+	}
+
+	tsc = read_tsc();
+	for (i = 0; i < NROUNDS; i++) {
+		if (blocking)
+			ipc_send(id, i, NULL, 0);
+		else
+			try_send(id, i);
+		if (ipc_recv(NULL, NULL, NULL) != i)
+			panic("round %d: wrong value", i);
+	}
+	cprintf("%-9s %d cycles/round trip\n", how,
+		(int) ((read_tsc() - tsc) / NROUNDS));
+	wait_exit(id);
+}
+
+// The same round trip, with the child as a server that replies with
+// ipc_reply_recv.
+static void
+bench_call(void)
+{
+	envid_t id, whom = 0;
+	uint32_t val = 0;
+	uint64_t tsc;
+	int i;
+
+	if ((id = fork()) < 0)
+		panic("fork: %e", id);
+	if (id == 0) {
+		for (i = 0; i <= NROUNDS; i++)
+			val = ipc_reply_recv(whom, val, NULL, 0, &whom, NULL, NULL);
+		exit();
+	}
+
+	tsc = read_tsc();
+	for (i = 0; i < NROUNDS; i++)
+		if (ipc_call(id, i, NULL, 0, NULL, NULL) != i)
+			panic("round %d: wrong value", i);
+	cprintf("%-9s %d cycles/round trip\n", "call",
+		(int) ((read_tsc() - tsc) / NROUNDS));
+	ipc_send(id, 0, NULL, 0);
+	wait_exit(id);
+}
+
+void
+umain(int argc, char **argv)
+{
+	test_fifo();
+	test_timeout();
+	test_set_status();
+	bench("try_send", false);
+	bench("send", true);
+	bench_call();
+}
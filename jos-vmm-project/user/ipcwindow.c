@@ -0,0 +1,63 @@
+#line 2 "../user/ipcwindow.c"
+// Test receive windows: a child receives with IPC_WINDOW(va, n), an
+// unaligned dstva.  A window that runs past UMAPTOP is refused, a send of
+// more pages than the window holds fails and maps nothing, and one that
+// fits is mapped in order.
+
+#include <inc/lib.h>
+
+#define SEND_VA		((uint8_t *) 0x20000000)
+#define RECV_VA		((uint8_t *) 0x30000000)
+#define WINDOW		4
+
+static void
+child(void)
+{
+	int i, r;
+
+	if ((r = sys_ipc_recv(IPC_WINDOW(UMAPTOP - PGSIZE, 2))) != -E_INVAL)
+		panic("window past UMAPTOP: got %e, want -E_INVAL", r);
+	if ((r = ipc_recv(NULL, IPC_WINDOW(RECV_VA, WINDOW), NULL)) < 0)
+		panic("ipc_recv: %e", r);
+	if (thisenv->env_ipc_npages != WINDOW - 1)
+		panic("received %d pages, want %d", thisenv->env_ipc_npages,
+		      WINDOW - 1);
+	for (i = 0; i < WINDOW - 1; i++)
+		if (RECV_VA[i * PGSIZE] != i + 1)
+			panic("page %d holds %d", i, RECV_VA[i * PGSIZE]);
+	if (uvpt[PGNUM(RECV_VA + (WINDOW - 1) * PGSIZE)] & PTE_P)
+		panic("page past the pages sent is mapped");
+	exit();
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct IpcSg sg;
+	envid_t id;
+	int i, r;
+
+	for (i = 0; i <= WINDOW; i++) {
+		if ((r = sys_page_alloc(0, SEND_VA + i * PGSIZE,
+					PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		SEND_VA[i * PGSIZE] = i + 1;
+	}
+	sg.is_n = 1;
+	sg.is_ranges[0].ir_va = SEND_VA;
+
+	if ((id = fork()) < 0)
+		panic("fork: %e", id);
+	if (id == 0)
+		child();
+
+	while (!envs[ENVX(id)].env_ipc_recving)
+		sys_yield();
+	sg.is_ranges[0].ir_npages = WINDOW + 1;
+	if ((r = sys_ipc_try_send(id, 0, &sg, PTE_P|PTE_U|IPC_SG)) != -E_INVAL)
+		panic("send past the window: got %e, want -E_INVAL", r);
+	sg.is_ranges[0].ir_npages = WINDOW - 1;
+	ipc_send(id, 0, &sg, PTE_P|PTE_U|IPC_SG);
+	wait(id);
+	cprintf("ipcwindow: OK\n");
+}
@@ -0,0 +1,101 @@
+#line 2 "../user/lazyzero.c"
+// Test lazily allocated pages: they read as zeroes from the shared zero
+// page until written, get a page of their own on the first write or
+// when mapped writable elsewhere, and stay shared across fork when they
+// are PTE_SHARE, without fork allocating them.  Then compare the cost
+// of sys_page_alloc with and without PTE_ZERO.
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+#define LAZY_VA		((uint8_t *) 0x20000000)
+#define NPAGES		64
+
+static physaddr_t
+frame(void *va)
+{
+	return PTE_ADDR(uvpt[PGNUM(va)]);
+}
+
+static uint64_t
+time_alloc(int perm)
+{
+	uint64_t tsc;
+	int i, r;
+
+	tsc = read_tsc();
+	for (i = 0; i < NPAGES; i++)
+		if ((r = sys_page_alloc(0, LAZY_VA + i * PGSIZE, perm)) < 0)
+			panic("sys_page_alloc: %e", r);
+	tsc = read_tsc() - tsc;
+	for (i = 0; i < NPAGES; i++)
+		sys_page_unmap(0, LAZY_VA + i * PGSIZE);
+	return tsc / NPAGES;
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint8_t *a = LAZY_VA, *b = LAZY_VA + PGSIZE, *c = LAZY_VA + 2 * PGSIZE;
+	uint8_t *d = LAZY_VA + 3 * PGSIZE;
+	envid_t id;
+	int i, r;
+
+	for (i = 0; i < 3; i++)
+		if ((r = sys_page_alloc(0, LAZY_VA + i * PGSIZE,
+					PTE_P|PTE_U|PTE_W|PTE_ZERO)) < 0)
+			panic("sys_page_alloc: %e", r);
+
+	// Untouched pages share one read-only frame of zeroes.
+	if (frame(a) != frame(b) || (uvpt[PGNUM(a)] & PTE_W))
+		panic("lazy pages are not mapped to the zero page");
+	for (i = 0; i < PGSIZE; i++)
+		if (a[i] || b[i])
+			panic("lazy page is not zero at %d", i);
+
+	// Writing gives a page its own frame, and leaves the others alone.
+	a[100] = 1;
+	if (frame(a) == frame(b) || !(uvpt[PGNUM(a)] & PTE_W))
+		panic("write did not allocate a page");
+	if (a[100] != 1 || a[101] != 0 || b[100] != 0)
+		panic("wrong data after the first write");
+
+	// Mapping a lazy page writable gives it a page of its own first.
+	if ((r = sys_page_map(0, b, 0, d, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("writable sys_page_map of a lazy page: %e", r);
+	if (frame(b) != frame(d) || frame(b) == frame(c) ||
+	    !(uvpt[PGNUM(b)] & PTE_W))
+		panic("writable mapping of a lazy page is of the zero page");
+	d[5] = 5;
+	if (b[5] != 5 || c[5] != 0)
+		panic("write through the second mapping went astray");
+	sys_page_unmap(0, d);
+
+	// A PTE_SHARE lazy page is still shared once the child writes it.
+	if ((r = sys_page_map(0, c, 0, c, PTE_P|PTE_U|PTE_ZERO|PTE_SHARE)) < 0)
+		panic("sys_page_map: %e", r);
+	if ((id = fork()) < 0)
+		panic("fork: %e", id);
+	if (id == 0) {
+		c[7] = 7;
+		b[7] = 7;
+		exit();
+	}
+	if (uvpt[PGNUM(c)] & PTE_P)
+		panic("fork gave a shared lazy page a page");
+	while (envs[ENVX(id)].env_id == id &&
+	       envs[ENVX(id)].env_status != ENV_FREE)
+		sys_yield();
+	if (c[7] != 7)
+		panic("shared lazy page was not shared");
+	if (b[7] != 0)
+		panic("child's write to a lazy page reached the parent");
+
+	for (i = 0; i < 3; i++)
+		sys_page_unmap(0, LAZY_VA + i * PGSIZE);
+	cprintf("lazyzero: OK\n");
+
+	cprintf("sys_page_alloc: %d cycles, lazy %d cycles\n",
+		(int) time_alloc(PTE_P|PTE_U|PTE_W),
+		(int) time_alloc(PTE_P|PTE_U|PTE_W|PTE_ZERO));
+}
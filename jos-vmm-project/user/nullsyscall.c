@@ -0,0 +1,52 @@
+#line 2 "../user/nullsyscall.c"
+// Measure the round trip time of a null system call, sys_getenvid,
+// entering the kernel with 'int $T_SYSCALL' and with SYSCALL.
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+#define NCALLS	100000
+
+static envid_t
+getenvid_int(void)
+{
+	envid_t ret;
+
+	asm volatile("int %1\n"
+		     : "=a" (ret)
+		     : "i" (T_SYSCALL),
+		       "a" (SYS_getenvid)
+		     : "cc", "memory");
+	return ret;
+}
+
+static void
+report(const char *how, uint64_t cycles)
+{
+	cprintf("%-8s %d cycles/call\n", how, (int) (cycles / NCALLS));
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t tsc;
+	int i;
+
+	// Warm up the caches and TLB for both paths first
+	for (i = 0; i < 1000; i++) {
+		getenvid_int();
+		sys_getenvid();
+	}
+
+	tsc = read_tsc();
+	for (i = 0; i < NCALLS; i++)
+		if (getenvid_int() != thisenv->env_id)
+			panic("int: wrong env id");
+	report("int", read_tsc() - tsc);
+
+	tsc = read_tsc();
+	for (i = 0; i < NCALLS; i++)
+		if (sys_getenvid() != thisenv->env_id)
+			panic("syscall: wrong env id");
+	report("syscall", read_tsc() - tsc);
+}
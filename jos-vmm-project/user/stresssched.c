@@ -1,15 +1,25 @@
 #line 2 "../user/stresssched.c"
+#include <inc/x86.h>
 #include <inc/lib.h>
 
 volatile int counter;
+static uint64_t tsc_per_ms;
 
 void
 umain(int argc, char **argv)
 {
 	int i, j;
 	int seen;
+	uint64_t tsc, wait, max_wait = 0;
 	envid_t parent = sys_getenvid();
 
+	// Calibrate the TSC so the children can report times in us
+	tsc = read_tsc();
+	j = sys_time_msec();
+	while (sys_time_msec() < j + 10)
+		asm volatile("pause");
+	tsc_per_ms = (read_tsc() - tsc) / 10;
+
 	// Fork several environments
 	for (i = 0; i < 20; i++)
 		if (fork() == 0)
@@ -24,8 +34,13 @@ umain(int argc, char **argv)
 		asm volatile("pause");
 
 	// Check that one environment doesn't run on two CPUs at once
+	// and time how long each yield keeps us off the CPU
 	for (i = 0; i < 10; i++) {
+		tsc = read_tsc();
 		sys_yield();
+		wait = read_tsc() - tsc;
+		if (wait > max_wait)
+			max_wait = wait;
 		for (j = 0; j < 10000; j++)
 			counter++;
 	}
@@ -35,6 +50,10 @@ umain(int argc, char **argv)
 
 	// Check that we see environments running on different CPUs
 	cprintf("[%08x] stresssched on CPU %d\n", thisenv->env_id, thisenv->env_cpunum);
+	cprintf("[%08x] used %d us of CPU, longest wait to run %d us\n",
+		thisenv->env_id,
+		(int) (thisenv->env_cputime * 1000 / tsc_per_ms),
+		(int) (max_wait * 1000 / tsc_per_ms));
 
 }
 
@@ -0,0 +1,94 @@
+#line 2 "../user/tlbshoot.c"
+// Test TLB shootdown: a child spins on another CPU reading a page,
+// and the parent remaps the page under it.  The child never enters the
+// kernel, so it only sees the new page if its CPU's TLB was flushed.
+// Then compare the cost of unmapping pages of the running child one
+// system call at a time against doing it in one SYS_batch.
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+#define WATCH_VA	((volatile uint32_t *) 0x30000000)
+#define REPORT_VA	((volatile uint32_t *) 0x30001000)
+#define UNMAP_VA	((uint8_t *) 0x31000000)
+#define NPAGES		64
+#define TIMEOUT		(1ULL << 32)
+
+static void
+wait_report(uint32_t val)
+{
+	uint64_t tsc = read_tsc();
+
+	while (*REPORT_VA != val)
+		if (read_tsc() - tsc > TIMEOUT)
+			panic("child still sees %d, not %d", *REPORT_VA, val);
+}
+
+static void
+map_pages(envid_t child)
+{
+	int i, r;
+
+	for (i = 0; i < NPAGES; i++)
+		if ((r = sys_page_map(0, (void *) WATCH_VA, child,
+				      UNMAP_VA + i * PGSIZE, PTE_P|PTE_U)) < 0)
+			panic("sys_page_map: %e", r);
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct SyscallBatch b;
+	uint64_t single, batched;
+	envid_t child;
+	int i, r;
+
+	if ((r = sys_page_alloc(0, (void *) WATCH_VA, PTE_P|PTE_U|PTE_W)) < 0 ||
+	    (r = sys_page_alloc(0, (void *) REPORT_VA,
+				PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0 ||
+	    (r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+	*WATCH_VA = 1;
+	*(uint32_t *) UTEMP = 2;
+
+	if ((r = sys_env_set_affinity(0, 1 << 0)) < 0)
+		panic("sys_env_set_affinity: %e", r);
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0)
+		while (1)
+			*REPORT_VA = *WATCH_VA;
+	if ((r = sys_env_set_affinity(child, 1 << 1)) < 0) {
+		cprintf("tlbshoot: needs 2 CPUs\n");
+		sys_env_destroy(child);
+		return;
+	}
+
+	// Once the child has the page in its TLB, replace it.
+	wait_report(1);
+	if ((r = sys_page_map(0, UTEMP, child, (void *) WATCH_VA,
+			      PTE_P|PTE_U)) < 0)
+		panic("sys_page_map: %e", r);
+	wait_report(2);
+	cprintf("tlbshoot: OK\n");
+
+	map_pages(child);
+	single = read_tsc();
+	for (i = 0; i < NPAGES; i++)
+		sys_page_unmap(child, UNMAP_VA + i * PGSIZE);
+	single = read_tsc() - single;
+
+	map_pages(child);
+	b.sb_n = 0;
+	batched = read_tsc();
+	for (i = 0; i < NPAGES; i++)
+		batch_add(&b, SYS_page_unmap, child,
+			  (uint64_t) (UNMAP_VA + i * PGSIZE), 0, 0, 0);
+	if ((r = batch_flush(&b)) < 0)
+		panic("batch_flush: %e", r);
+	batched = read_tsc() - batched;
+
+	cprintf("unmap from a running env: %d cycles/page, batched %d cycles/page\n",
+		(int) (single / NPAGES), (int) (batched / NPAGES));
+	sys_env_destroy(child);
+}
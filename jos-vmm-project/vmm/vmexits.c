@@ -58,6 +58,16 @@ bool
 handle_interrupts(struct Trapframe *tf, struct VmxGuestInfo *ginfo, uint32_t host_vector) {
 	uint64_t rflags;
 	uint32_t procbased_ctls_or;
+
+	// Reschedule IPIs are meant for the host scheduler, which runs
+	// right after this exit, and TLB shootdowns for the host's own
+	// page tables; don't reflect them into the guest.
+	if ((host_vector & 0xff) == IRQ_OFFSET + IRQ_RESCHED ||
+	    (host_vector & 0xff) == IRQ_OFFSET + IRQ_TLB) {
+		lapic_eoi();
+		return true;
+	}
+
 	rflags = vmcs_read64(VMCS_GUEST_RFLAGS);
 
 	if ( !(rflags & (0x1 << 9)) ) {	//we have to wait the interrupt window open
@@ -43,6 +43,7 @@ bool vmx_sel_resume(int num) {
 			if (vm_count == num) {
 				cprintf("Resume vm.%d\n", num);
 				envs[i].env_status = ENV_RUNNABLE;
+				sched_enqueue(&envs[i]);
 				return true;
 			}
 		}
@@ -235,7 +236,9 @@ int vmx_init_vmxon() {
 
 void vmcs_host_init() {
 	vmcs_write64( VMCS_HOST_CR0, rcr0() );
-	vmcs_write64( VMCS_HOST_CR3, rcr3() );
+	// VM exits return to the kernel's page tables, which outlive any
+	// env's, with no PCID in the low bits.
+	vmcs_write64( VMCS_HOST_CR3, boot_cr3 );
 	vmcs_write64( VMCS_HOST_CR4, rcr4() );
 
 	vmcs_write16( VMCS_16BIT_HOST_ES_SELECTOR, GD_KD );
@@ -257,7 +260,7 @@ void vmcs_host_init() {
 	vmcs_write64( VMCS_HOST_GDTR_BASE, xdtr_base );
 
 	vmcs_write64( VMCS_HOST_FS_BASE, 0x0 );
-	vmcs_write64( VMCS_HOST_GS_BASE, 0x0 );
+	vmcs_write64( VMCS_HOST_GS_BASE, (uint64_t) thiscpu );
 	vmcs_write64( VMCS_HOST_TR_BASE, (uint64_t) &thiscpu->cpu_ts );
 
 	uint64_t tmpl;